@@ -62,9 +62,6 @@
 // How many client connection do we accept at once?
 #define MAXCONNS 255
 
-// Over how many queries do we iterate at most when trying to find a match?
-#define MAXITER 1000
-
 // How many hours do we want to store in FTL's memory? [hours]
 #define MAXLOGAGE 24
 
@@ -28,23 +28,11 @@
 #include "version.h"
 // enum REGEX
 #include "regex_r.h"
+// toplist_get()
+#include "toplist.h"
 
 #define min(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a < _b ? _a : _b; })
 
-/* qsort comparision function (count field), sort ASC */
-static int __attribute__((pure)) cmpasc(const void *a, const void *b)
-{
-	const int *elem1 = (int*)a;
-	const int *elem2 = (int*)b;
-
-	if (elem1[1] < elem2[1])
-		return -1;
-	else if (elem1[1] > elem2[1])
-		return 1;
-	else
-		return 0;
-}
-
 // qsort subroutine, sort DESC
 static int __attribute__((pure)) cmpdesc(const void *a, const void *b)
 {
@@ -61,8 +49,12 @@ static int __attribute__((pure)) cmpdesc(const void *a, const void *b)
 
 void getStats(const int *sock)
 {
-	const int blocked = counters->blocked;
-	const int total = counters->queries;
+	// Take a lock-free snapshot of the counters
+	countersStruct snapshot;
+	snapshot_counters(&snapshot, NULL);
+
+	const int blocked = snapshot.blocked;
+	const int total = snapshot.queries;
 	float percentage = 0.0f;
 
 	// Avoid 1/0 condition
@@ -71,43 +63,33 @@ void getStats(const int *sock)
 
 	// Send domains being blocked
 	if(istelnet[*sock]) {
-		ssend(*sock, "domains_being_blocked %i\n", counters->gravity);
+		ssend(*sock, "domains_being_blocked %i\n", snapshot.gravity);
 	}
 	else
-		pack_int32(*sock, counters->gravity);
+		pack_int32(*sock, snapshot.gravity);
 
 	// unique_clients: count only clients that have been active within the most recent 24 hours
-	int activeclients = 0;
-	for(int clientID=0; clientID < counters->clients; clientID++)
-	{
-		// Get client pointer
-		const clientsData* client = getClient(clientID, true);
-		if(client == NULL)
-			continue;
-
-		if(client->count > 0)
-			activeclients++;
-	}
+	const int activeclients = snapshot.active_clients;
 
 	if(istelnet[*sock]) {
 		ssend(*sock, "dns_queries_today %i\nads_blocked_today %i\nads_percentage_today %f\n",
 		      total, blocked, percentage);
 		ssend(*sock, "unique_domains %i\nqueries_forwarded %i\nqueries_cached %i\n",
-		      counters->domains, counters->forwarded, counters->cached);
-		ssend(*sock, "clients_ever_seen %i\n", counters->clients);
+		      snapshot.domains, snapshot.forwarded, snapshot.cached);
+		ssend(*sock, "clients_ever_seen %i\n", snapshot.clients);
 		ssend(*sock, "unique_clients %i\n", activeclients);
 
 		// Sum up all query types (A, AAAA, ANY, SRV, SOA, ...)
 		int sumalltypes = 0;
 		for(int queryType=0; queryType < TYPE_MAX-1; queryType++)
 		{
-			sumalltypes += counters->querytype[queryType];
+			sumalltypes += snapshot.querytype[queryType];
 		}
 		ssend(*sock, "dns_queries_all_types %i\n", sumalltypes);
 
 		// Send individual reply type counters
 		ssend(*sock, "reply_NODATA %i\nreply_NXDOMAIN %i\nreply_CNAME %i\nreply_IP %i\n",
-		      counters->reply_NODATA, counters->reply_NXDOMAIN, counters->reply_CNAME, counters->reply_IP);
+		      snapshot.reply_NODATA, snapshot.reply_NXDOMAIN, snapshot.reply_CNAME, snapshot.reply_IP);
 		ssend(*sock, "privacy_level %i\n", config.privacylevel);
 	}
 	else
@@ -115,10 +97,10 @@ void getStats(const int *sock)
 		pack_int32(*sock, total);
 		pack_int32(*sock, blocked);
 		pack_float(*sock, percentage);
-		pack_int32(*sock, counters->domains);
-		pack_int32(*sock, counters->forwarded);
-		pack_int32(*sock, counters->cached);
-		pack_int32(*sock, counters->clients);
+		pack_int32(*sock, snapshot.domains);
+		pack_int32(*sock, snapshot.forwarded);
+		pack_int32(*sock, snapshot.cached);
+		pack_int32(*sock, snapshot.clients);
 		pack_int32(*sock, activeclients);
 	}
 
@@ -132,15 +114,19 @@ void getStats(const int *sock)
 
 void getOverTime(const int *sock)
 {
+	// Take a lock-free snapshot of the overTime data
+	overTimeData slots[OVERTIME_SLOTS];
+	snapshot_counters(NULL, slots);
+
 	int from = 0, until = OVERTIME_SLOTS;
 	bool found = false;
-	time_t mintime = overTime[0].timestamp;
+	time_t mintime = slots[0].timestamp;
 
 	// Start with the first non-empty overTime slot
 	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
 	{
-		if((overTime[slot].total > 0 || overTime[slot].blocked > 0) &&
-		   overTime[slot].timestamp >= mintime)
+		if((slots[slot].total > 0 || slots[slot].blocked > 0) &&
+		   slots[slot].timestamp >= mintime)
 		{
 			from = slot;
 			found = true;
@@ -151,7 +137,7 @@ void getOverTime(const int *sock)
 	// End with last non-empty overTime slot
 	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
 	{
-		if(overTime[slot].timestamp >= time(NULL))
+		if(slots[slot].timestamp >= time(NULL))
 		{
 			until = slot;
 			break;
@@ -167,9 +153,9 @@ void getOverTime(const int *sock)
 		for(int slot = from; slot < until; slot++)
 		{
 			ssend(*sock,"%li %i %i\n",
-			      overTime[slot].timestamp,
-			      overTime[slot].total,
-			      overTime[slot].blocked);
+			      slots[slot].timestamp,
+			      slots[slot].total,
+			      slots[slot].blocked);
 		}
 	}
 	else
@@ -180,29 +166,57 @@ void getOverTime(const int *sock)
 		// Send domains over time
 		pack_map16_start(*sock, (uint16_t) (until - from));
 		for(int slot = from; slot < until; slot++) {
-			pack_int32(*sock, overTime[slot].timestamp);
-			pack_int32(*sock, overTime[slot].total);
+			pack_int32(*sock, slots[slot].timestamp);
+			pack_int32(*sock, slots[slot].total);
 		}
 
 		// Send ads over time
 		pack_map16_start(*sock, (uint16_t) (until - from));
 		for(int slot = from; slot < until; slot++) {
-			pack_int32(*sock, overTime[slot].timestamp);
-			pack_int32(*sock, overTime[slot].blocked);
+			pack_int32(*sock, slots[slot].timestamp);
+			pack_int32(*sock, slots[slot].blocked);
 		}
 	}
 }
 
+// Check if a domain is to be shown in the top lists
+static bool show_domain(const domainsData *domain, const bool blocked, const bool audit,
+                        const bool showblocked, const bool showpermitted, const bool exclude)
+{
+	if(domain == NULL)
+		return false;
+
+	// Skip this domain if there is a filter on it
+	if(exclude && insetupVarsArray(getstr(domain->domainpos)))
+		return false;
+
+	// Skip this domain if already audited
+	if(audit && in_auditlist(getstr(domain->domainpos)) > 0)
+	{
+		if(config.debug & DEBUG_API)
+			logg("API: %s has been audited.", getstr(domain->domainpos));
+		return false;
+	}
+
+	// Hidden domain, probably due to privacy level. Skip this in the top lists
+	if(strcmp(getstr(domain->domainpos), HIDDEN_DOMAIN) == 0)
+		return false;
+
+	if(blocked)
+		return showblocked && domain->blockedcount > 0;
+	else
+		return showpermitted && (domain->count - domain->blockedcount) > 0;
+}
+
 void getTopDomains(const char *client_message, const int *sock)
 {
-	int temparray[counters->domains][2], count=10, num;
+	int count=10, num;
 	bool audit = false, asc = false;
 
 	const bool blocked = command(client_message, ">top-ads");
 
 	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
-	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS) {
+	if(get_request_privacy_level() >= PRIVACY_HIDE_DOMAINS) {
 		// Always send the total number of domains, but pretend it's 0
 		if(!istelnet[*sock])
 			pack_int32(*sock, 0);
@@ -227,28 +241,6 @@ void getTopDomains(const char *client_message, const int *sock)
 	if(command(client_message, " asc"))
 		asc = true;
 
-	for(int domainID=0; domainID < counters->domains; domainID++)
-	{
-		// Get domain pointer
-		const domainsData* domain = getDomain(domainID, true);
-		if(domain == NULL)
-			continue;
-
-		temparray[domainID][0] = domainID;
-		if(blocked)
-			temparray[domainID][1] = domain->blockedcount;
-		else
-			// Count only permitted queries
-			temparray[domainID][1] = (domain->count - domain->blockedcount);
-	}
-
-	// Sort temporary array
-	if(asc)
-		qsort(temparray, counters->domains, sizeof(int[2]), cmpasc);
-	else
-		qsort(temparray, counters->domains, sizeof(int[2]), cmpdesc);
-
-
 	// Get filter
 	const char* filter = read_setupVarsconf("API_QUERY_LOG_SHOW");
 	bool showpermitted = true, showblocked = true;
@@ -276,6 +268,30 @@ void getTopDomains(const char *client_message, const int *sock)
 			getSetupVarsArray(excludedomains);
 		}
 	}
+	const bool exclude = excludedomains != NULL;
+
+	// Try to serve the request from the incrementally maintained top list
+	// and only sort all domains if it doesn't hold enough domains to show
+	const enum toplist_type type = blocked ? TOPLIST_ADS : TOPLIST_DOMAINS;
+	int candidates[TOPLIST_SIZE];
+	int *ids = candidates, *sorted = NULL, numids = -1;
+	if(!asc && count > 0)
+	{
+		bool complete = false;
+		numids = toplist_get(type, candidates, &complete);
+		int shown = 0;
+		for(int i = 0; i < numids && shown < count && !complete; i++)
+			if(show_domain(getDomain(candidates[i], true), blocked, audit, showblocked, showpermitted, exclude))
+				shown++;
+		if(!complete && shown < count)
+			numids = -1;
+	}
+	if(numids < 0)
+	{
+		ids = sorted = toplist_sorted(type, asc, &numids);
+		if(sorted == NULL)
+			numids = 0;
+	}
 
 	if(!istelnet[*sock])
 	{
@@ -287,73 +303,77 @@ void getTopDomains(const char *client_message, const int *sock)
 	}
 
 	int n = 0;
-	for(int i=0; i < counters->domains; i++)
+	for(int i=0; i < numids; i++)
 	{
-		// Get sorted index
-		const int domainID = temparray[i][0];
 		// Get domain pointer
-		const domainsData* domain = getDomain(domainID, true);
-		if(domain == NULL)
-			continue;
-
-		// Skip this domain if there is a filter on it
-		if(excludedomains != NULL && insetupVarsArray(getstr(domain->domainpos)))
-			continue;
-
-		// Skip this domain if already audited
-		if(audit && in_auditlist(getstr(domain->domainpos)) > 0)
-		{
-			if(config.debug & DEBUG_API)
-				logg("API: %s has been audited.", getstr(domain->domainpos));
-			continue;
-		}
-
-		// Hidden domain, probably due to privacy level. Skip this in the top lists
-		if(strcmp(getstr(domain->domainpos), HIDDEN_DOMAIN) == 0)
+		const domainsData* domain = getDomain(ids[i], true);
+		if(!show_domain(domain, blocked, audit, showblocked, showpermitted, exclude))
 			continue;
 
-		if(blocked && showblocked && domain->blockedcount > 0)
+		if(blocked)
 		{
 			if(istelnet[*sock])
 				ssend(*sock, "%i %i %s\n", n, domain->blockedcount, getstr(domain->domainpos));
 			else {
 				if(!pack_str32(*sock, getstr(domain->domainpos)))
-					return;
+					break;
 
 				pack_int32(*sock, domain->blockedcount);
 			}
-			n++;
 		}
-		else if(!blocked && showpermitted && (domain->count - domain->blockedcount) > 0)
+		else
 		{
 			if(istelnet[*sock])
 				ssend(*sock,"%i %i %s\n",n,(domain->count - domain->blockedcount),getstr(domain->domainpos));
 			else
 			{
 				if(!pack_str32(*sock, getstr(domain->domainpos)))
-					return;
+					break;
 
 				pack_int32(*sock, domain->count - domain->blockedcount);
 			}
-			n++;
 		}
+		n++;
 
 		// Only count entries that are actually sent and return when we have send enough data
 		if(n == count)
 			break;
 	}
 
+	free(sorted);
+
 	if(excludedomains != NULL)
 		clearSetupVarsArray();
 }
 
+// Check if a client is to be shown in the top lists
+static bool show_client(const clientsData *client, const int ccount,
+                        const bool includezeroclients, const bool exclude)
+{
+	if(client == NULL)
+		return false;
+
+	// Skip this client if there is a filter on it
+	if(exclude &&
+		(insetupVarsArray(getstr(client->ippos)) || insetupVarsArray(getstr(client->namepos))))
+		return false;
+
+	// Hidden client, probably due to privacy level. Skip this in the top lists
+	if(strcmp(getstr(client->ippos), HIDDEN_CLIENT) == 0)
+		return false;
+
+	// Return this client if either
+	// - "withzero" option is set, and/or
+	// - the client made at least one query within the most recent 24 hours
+	return includezeroclients || ccount > 0;
+}
+
 void getTopClients(const char *client_message, const int *sock)
 {
-	int temparray[counters->clients][2], count=10, num;
+	int count=10, num;
 
 	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
-	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS) {
+	if(get_request_privacy_level() >= PRIVACY_HIDE_DOMAINS_CLIENTS) {
 		// Always send the total number of clients, but pretend it's 0
 		if(!istelnet[*sock])
 			pack_int32(*sock, 0);
@@ -382,35 +402,46 @@ void getTopClients(const char *client_message, const int *sock)
 	if(command(client_message, " blocked"))
 		blockedonly = true;
 
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		// Get client pointer
-		const clientsData* client = getClient(clientID, true);
-		if(client == NULL)
-			continue;
-		temparray[clientID][0] = clientID;
-		// Use either blocked or total count based on request string
-		temparray[clientID][1] = blockedonly ? client->blockedcount : client->count;
-	}
-
 	// Sort in ascending order?
 	// example: >top-clients asc
 	bool asc = false;
 	if(command(client_message, " asc"))
 		asc = true;
 
-	// Sort temporary array
-	if(asc)
-		qsort(temparray, counters->clients, sizeof(int[2]), cmpasc);
-	else
-		qsort(temparray, counters->clients, sizeof(int[2]), cmpdesc);
-
 	// Get clients which the user doesn't want to see
 	const char* excludeclients = read_setupVarsconf("API_EXCLUDE_CLIENTS");
 	if(excludeclients != NULL)
 	{
 		getSetupVarsArray(excludeclients);
 	}
+	const bool exclude = excludeclients != NULL;
+
+	// Try to serve the request from the incrementally maintained top list
+	// and only sort all clients if it doesn't hold enough clients to show
+	const enum toplist_type type = blockedonly ? TOPLIST_CLIENTS_BLOCKED : TOPLIST_CLIENTS;
+	int candidates[TOPLIST_SIZE];
+	int *ids = candidates, *sorted = NULL, numids = -1;
+	if(!asc && !includezeroclients && count > 0)
+	{
+		bool complete = false;
+		numids = toplist_get(type, candidates, &complete);
+		int shown = 0;
+		for(int i = 0; i < numids && shown < count && !complete; i++)
+		{
+			const clientsData* client = getClient(candidates[i], true);
+			if(client != NULL &&
+			   show_client(client, blockedonly ? client->blockedcount : client->count, false, exclude))
+				shown++;
+		}
+		if(!complete && shown < count)
+			numids = -1;
+	}
+	if(numids < 0)
+	{
+		ids = sorted = toplist_sorted(type, asc, &numids);
+		if(sorted == NULL)
+			numids = 0;
+	}
 
 	if(!istelnet[*sock])
 	{
@@ -419,50 +450,39 @@ void getTopClients(const char *client_message, const int *sock)
 	}
 
 	int n = 0;
-	for(int i=0; i < counters->clients; i++)
+	for(int i=0; i < numids; i++)
 	{
-		// Get sorted indices and counter values (may be either total or blocked count)
-		const int clientID = temparray[i][0];
-		const int ccount = temparray[i][1];
 		// Get client pointer
-		const clientsData* client = getClient(clientID, true);
+		const clientsData* client = getClient(ids[i], true);
 		if(client == NULL)
 			continue;
 
-		// Skip this client if there is a filter on it
-		if(excludeclients != NULL &&
-			(insetupVarsArray(getstr(client->ippos)) || insetupVarsArray(getstr(client->namepos))))
-			continue;
-
-		// Hidden client, probably due to privacy level. Skip this in the top lists
-		if(strcmp(getstr(client->ippos), HIDDEN_CLIENT) == 0)
+		// Counter value (may be either total or blocked count)
+		const int ccount = blockedonly ? client->blockedcount : client->count;
+		if(!show_client(client, ccount, includezeroclients, exclude))
 			continue;
 
 		// Get client IP and name
 		const char *client_ip = getstr(client->ippos);
 		const char *client_name = getstr(client->namepos);
 
-		// Return this client if either
-		// - "withzero" option is set, and/or
-		// - the client made at least one query within the most recent 24 hours
-		if(includezeroclients || ccount > 0)
+		if(istelnet[*sock])
+			ssend(*sock,"%i %i %s %s\n", n, ccount, client_ip, client_name);
+		else
 		{
-			if(istelnet[*sock])
-				ssend(*sock,"%i %i %s %s\n", n, ccount, client_ip, client_name);
-			else
-			{
-				if(!pack_str32(*sock, "") || !pack_str32(*sock, client_ip))
-					return;
+			if(!pack_str32(*sock, "") || !pack_str32(*sock, client_ip))
+				break;
 
-				pack_int32(*sock, ccount);
-			}
-			n++;
+			pack_int32(*sock, ccount);
 		}
+		n++;
 
 		if(n == count)
 			break;
 	}
 
+	free(sorted);
+
 	if(excludeclients != NULL)
 		clearSetupVarsArray();
 }
@@ -572,10 +592,14 @@ const char *querytypes[TYPE_MAX] = {"A", "AAAA", "ANY", "SRV", "SOA", "PTR", "TX
 
 void getQueryTypes(const int *sock)
 {
+	// Take a lock-free snapshot of the counters
+	countersStruct snapshot;
+	snapshot_counters(&snapshot, NULL);
+
 	int total = 0;
 	for(int i=0; i < TYPE_MAX-1; i++)
 	{
-		total += counters->querytype[i];
+		total += snapshot.querytype[i];
 	}
 
 	float percentage[TYPE_MAX-1] = { 0.0 };
@@ -585,7 +609,7 @@ void getQueryTypes(const int *sock)
 	{
 		for(int i=0; i < TYPE_MAX-1; i++)
 		{
-			percentage[i] = 1e2f*counters->querytype[i]/total;
+			percentage[i] = 1e2f*snapshot.querytype[i]/total;
 		}
 	}
 
@@ -629,33 +653,277 @@ void getQueryTypes(const int *sock)
 	}
 }
 
-void getAllQueries(const char *client_message, const int *sock)
+// Filters applicable to the query log
+typedef struct {
+	int from;
+	int until;
+	int domainID;
+	int clientID;
+	int upstreamID; // -1 = cache, -2 = blocklist
+	bool filterupstream;
+	unsigned char querytype;
+	bool showpermitted;
+	bool showblocked;
+} queryFilter;
+
+static bool __attribute__((pure)) is_blocked_status(const enum query_status status)
 {
-	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
-	if(config.privacylevel >= PRIVACY_MAXIMUM)
-		return;
+	return status == QUERY_GRAVITY ||
+	       status == QUERY_REGEX ||
+	       status == QUERY_BLACKLIST ||
+	       status == QUERY_GRAVITY_CNAME ||
+	       status == QUERY_REGEX_CNAME ||
+	       status == QUERY_BLACKLIST_CNAME;
+}
 
-	// Do we want a more specific version of this command (domain/client/time interval filtered)?
-	int from = 0, until = 0;
+// Returns the ID of the matching upstream server, -1 for the cache,
+// -2 for the blocking lists or -3 if nothing matched
+static int find_upstream_filter(const char *name)
+{
+	if(strcmp(name, "cache") == 0)
+		return -1;
+	else if(strcmp(name, "blocklist") == 0)
+		return -2;
+
+	// Iterate through all known forward destinations
+	for(int i = 0; i < counters->upstreams; i++)
+	{
+		// Get forward pointer
+		const upstreamsData* forward = getUpstream(i, true);
+		if(forward == NULL)
+			continue;
+
+		// Try to match the requested string against their IP addresses and
+		// (if available) their host names
+		if(strcmp(getstr(forward->ippos), name) == 0 ||
+		   (forward->namepos != 0 &&
+		    strcmp(getstr(forward->namepos), name) == 0))
+			return i;
+	}
+
+	return -3;
+}
+
+static int find_domain_filter(const char *name)
+{
+	// Domains are resolved through the hash index
+	return lookupDomainID(name);
+}
+
+static int find_client_filter(const char *name)
+{
+	// Clients are indexed by their address, try this first
+	const int clientID = lookupClientID(name);
+	if(clientID > -1 || isValidIPv4(name) || isValidIPv6(name))
+		return clientID;
+
+	// Host names are not part of the hash index, we have to iterate
+	// through all known clients to find a match
+	for(int i = 0; i < counters->clients; i++)
+	{
+		// Get client pointer
+		const clientsData* client = getClient(i, true);
+		if(client == NULL)
+			continue;
+
+		// Try to match the requested string
+		if(strcmp(getstr(client->ippos), name) == 0 ||
+		   (client->namepos != 0 &&
+		    strcmp(getstr(client->namepos), name) == 0))
+			return i;
+	}
+
+	return -1;
+}
+
+// Get potentially existing filtering flags
+static void read_query_log_show(queryFilter *filter)
+{
+	char * setting = read_setupVarsconf("API_QUERY_LOG_SHOW");
+	filter->showpermitted = true;
+	filter->showblocked = true;
+	if(setting != NULL)
+	{
+		if((strcmp(setting, "permittedonly")) == 0)
+			filter->showblocked = false;
+		else if((strcmp(setting, "blockedonly")) == 0)
+			filter->showpermitted = false;
+		else if((strcmp(setting, "nothing")) == 0)
+		{
+			filter->showpermitted = false;
+			filter->showblocked = false;
+		}
+	}
+	clearSetupVarsArray();
+}
 
-	char *domainname = NULL;
-	bool filterdomainname = false;
-	int domainid = -1;
+static bool __attribute__((pure)) query_matches(const queriesData *query, const queryFilter *filter)
+{
+	// Check if this query has been create while in maximum privacy mode
+	if(query == NULL || query->privacylevel >= PRIVACY_MAXIMUM)
+		return false;
+
+	// Verify query type
+	if(query->type > TYPE_MAX-1)
+		return false;
+
+	// 1 = gravity.list, 4 = wildcard, 5 = black.list
+	if(is_blocked_status(query->status) && !filter->showblocked)
+		return false;
+	// 2 = forwarded, 3 = cached
+	if((query->status == QUERY_FORWARDED ||
+	    query->status == QUERY_CACHE) && !filter->showpermitted)
+		return false;
+
+	// Skip those entries which so not meet the requested timeframe
+	const time_t timestamp = query->timestamp;
+	if((filter->from > timestamp && filter->from != 0) ||
+	   (timestamp > filter->until && filter->until != 0))
+		return false;
+
+	// Skip if domain is not identical with what the user wants to see
+	if(filter->domainID > -1 && query->domainID != filter->domainID)
+		return false;
+
+	// Skip if client name and IP are not identical with what the user wants to see
+	if(filter->clientID > -1 && query->clientID != filter->clientID)
+		return false;
+
+	// Skip if query type is not identical with what the user wants to see
+	if(filter->querytype != 0 && filter->querytype != query->type)
+		return false;
+
+	if(filter->filterupstream)
+	{
+		// Does the user want to see queries answered from blocking lists?
+		if(filter->upstreamID == -2 && !is_blocked_status(query->status))
+			return false;
+		// Does the user want to see queries answered from local cache?
+		else if(filter->upstreamID == -1 && query->status != QUERY_CACHE)
+			return false;
+		// Does the user want to see queries answered by an upstream server?
+		else if(filter->upstreamID >= 0 && filter->upstreamID != query->upstreamID)
+			return false;
+	}
+
+	return true;
+}
 
-	char *clientname = NULL;
-	bool filterclientname = false;
-	int clientid = -1;
+// Returns the posting list of the filtered domain or client (if any) so only
+// the matching queries need to be looked at
+static const postingList *filter_postings(const queryFilter *filter)
+{
+	if(!config.query_index)
+		return NULL;
 
-	unsigned char querytype = 0;
+	if(filter->domainID > -1)
+	{
+		const domainsData *domain = getDomain(filter->domainID, true);
+		return domain != NULL ? &domain->queries : NULL;
+	}
 
-	char *forwarddest = NULL;
-	bool filterforwarddest = false;
-	int forwarddestid = 0;
+	if(filter->clientID > -1)
+	{
+		const clientsData *client = getClient(filter->clientID, true);
+		return client != NULL ? &client->queries : NULL;
+	}
+
+	return NULL;
+}
+
+// Send a single query log entry, returns false on serialization errors
+static bool send_query(const int *sock, const queriesData *query, const int queryID)
+{
+	// Get query type
+	const char *qtype = querytypes[query->type - TYPE_A];
+
+	// Ask subroutine for domain. It may return "hidden" depending on
+	// the privacy settings at the time the query was made
+	const char *domain = getDomainString(query);
+
+	// Similarly for the client
+	const char *clientIPName = NULL;
+	// Get client pointer
+	const clientsData* client = getClient(query->clientID, true);
+	if(domain == NULL || client == NULL)
+		return true;
+
+	if(strlen(getstr(client->namepos)) > 0)
+		clientIPName = getClientNameString(query);
+	else
+		clientIPName = getClientIPString(query);
+
+	unsigned long delay = query->response;
+	// Check if received (delay should be smaller than 30min)
+	if(delay > 1.8e7)
+		delay = 0;
+
+	// Get domain blocked during deep CNAME inspection, if applicable
+	const char *CNAME_domain = "N/A";
+	if(query->CNAME_domainID > -1)
+	{
+		CNAME_domain = getCNAMEDomainString(query);
+	}
+
+	// Get ID of blocking regex, if applicable
+	int regex_idx = -1;
+	if (query->status == QUERY_REGEX || query->status == QUERY_REGEX_CNAME)
+	{
+		// Queries imported from the database may not have a cache entry
+		const int cacheID = findCacheID(query->domainID, query->clientID, false);
+		const DNSCacheData *dns_cache = cacheID < 0 ? NULL : getDNSCache(cacheID, true);
+		if(dns_cache != NULL)
+			regex_idx = dns_cache->black_regex_idx;
+	}
+
+	if(istelnet[*sock])
+	{
+		ssend(*sock,"%u %s %s %s %i %i %i %lu %s %i",
+			query->timestamp,
+			qtype,
+			domain,
+			clientIPName,
+			query->status,
+			query->dnssec,
+			query->reply,
+			delay,
+			CNAME_domain,
+			regex_idx);
+		if(config.debug & DEBUG_API)
+			ssend(*sock, " %i", queryID);
+		ssend(*sock, "\n");
+	}
+	else
+	{
+		pack_int32(*sock, query->timestamp);
+
+		// Use a fixstr because the length of qtype is always 4 (max is 31 for fixstr)
+		if(!pack_fixstr(*sock, qtype))
+			return false;
+
+		// Use str32 for domain and client because we have no idea how long they will be (max is 4294967295 for str32)
+		if(!pack_str32(*sock, domain) || !pack_str32(*sock, clientIPName))
+			return false;
+
+		pack_uint8(*sock, query->status);
+		pack_uint8(*sock, query->dnssec);
+	}
+
+	return true;
+}
+
+void getAllQueries(const char *client_message, const int *sock)
+{
+	// Exit before processing any data if requested via config setting
+	if(get_request_privacy_level() >= PRIVACY_MAXIMUM)
+		return;
+
+	// Do we want a more specific version of this command (domain/client/time interval filtered)?
+	queryFilter filter = { 0, 0, -1, -1, 0, false, 0, true, true };
 
 	// Time filtering?
 	if(command(client_message, ">getallqueries-time")) {
-		sscanf(client_message, ">getallqueries-time %i %i",&from, &until);
+		sscanf(client_message, ">getallqueries-time %i %i", &filter.from, &filter.until);
 	}
 
 	// Query type filtering?
@@ -668,79 +936,34 @@ void getAllQueries(const char *client_message, const int *sock)
 			// Invalid query type requested
 			return;
 		}
-		querytype = qtype;
+		filter.querytype = qtype;
 	}
 
 	// Forward destination filtering?
 	if(command(client_message, ">getallqueries-forward")) {
 		// Get forward destination name we want to see only (limit length to 255 chars)
-		forwarddest = calloc(256, sizeof(char));
-		if(forwarddest == NULL) return;
+		char forwarddest[256] = "";
 		sscanf(client_message, ">getallqueries-forward %255s", forwarddest);
-		filterforwarddest = true;
-
-		if(strcmp(forwarddest, "cache") == 0)
-			forwarddestid = -1;
-		else if(strcmp(forwarddest, "blocklist") == 0)
-			forwarddestid = -2;
-		else
+		filter.filterupstream = true;
+		filter.upstreamID = find_upstream_filter(forwarddest);
+		if(filter.upstreamID < -2)
 		{
-			// Iterate through all known forward destinations
-			forwarddestid = -3;
-			for(int i = 0; i < counters->upstreams; i++)
-			{
-				// Get forward pointer
-				const upstreamsData* forward = getUpstream(i, true);
-				if(forward == NULL)
-					continue;
-
-				// Try to match the requested string against their IP addresses and
-				// (if available) their host names
-				if(strcmp(getstr(forward->ippos), forwarddest) == 0 ||
-				   (forward->namepos != 0 &&
-				    strcmp(getstr(forward->namepos), forwarddest) == 0))
-				{
-					forwarddestid = i;
-					break;
-				}
-			}
-			if(forwarddestid < 0)
-			{
-				// Requested forward destination has not been found, we directly
-				// exit here as there is no data to be returned
-				free(forwarddest);
-				return;
-			}
+			// Requested forward destination has not been found, we directly
+			// exit here as there is no data to be returned
+			return;
 		}
 	}
 
 	// Domain filtering?
 	if(command(client_message, ">getallqueries-domain")) {
 		// Get domain name we want to see only (limit length to 255 chars)
-		domainname = calloc(256, sizeof(char));
-		if(domainname == NULL) return;
+		char domainname[256] = "";
 		sscanf(client_message, ">getallqueries-domain %255s", domainname);
-		filterdomainname = true;
-		// Iterate through all known domains
-		for(int domainID = 0; domainID < counters->domains; domainID++)
-		{
-			// Get domain pointer
-			const domainsData* domain = getDomain(domainID, true);
-			if(domain == NULL)
-				continue;
-
-			// Try to match the requested string
-			if(strcmp(getstr(domain->domainpos), domainname) == 0)
-			{
-				domainid = domainID;
-				break;
-			}
-		}
-		if(domainid < 0)
+		filter.domainID = find_domain_filter(domainname);
+		if(filter.domainID < 0)
 		{
 			// Requested domain has not been found, we directly
 			// exit here as there is no data to be returned
-			free(domainname);
 			return;
 		}
 	}
@@ -748,206 +971,200 @@ void getAllQueries(const char *client_message, const int *sock)
 	// Client filtering?
 	if(command(client_message, ">getallqueries-client")) {
 		// Get client name we want to see only (limit length to 255 chars)
-		clientname = calloc(256, sizeof(char));
-		if(clientname == NULL) return;
+		char clientname[256] = "";
 		sscanf(client_message, ">getallqueries-client %255s", clientname);
-		filterclientname = true;
-
-		// Iterate through all known clients
-		for(int i = 0; i < counters->clients; i++)
-		{
-			// Get client pointer
-			const clientsData* client = getClient(i, true);
-			if(client == NULL)
-				continue;
-
-			// Try to match the requested string
-			if(strcmp(getstr(client->ippos), clientname) == 0 ||
-			   (client->namepos != 0 &&
-			    strcmp(getstr(client->namepos), clientname) == 0))
-			{
-				clientid = i;
-				break;
-			}
-		}
-		if(clientid < 0)
+		filter.clientID = find_client_filter(clientname);
+		if(filter.clientID < 0)
 		{
 			// Requested client has not been found, we directly
 			// exit here as there is no data to be returned
-			free(clientname);
 			return;
 		}
 	}
 
-	int ibeg = 0, num;
+	int ibeg = counters->queries_first, num;
 	// Test for integer that specifies number of entries to be shown
 	if(sscanf(client_message, "%*[^(](%i)", &num) > 0)
 	{
 		// User wants a different number of requests
 		// Don't allow a start index that is smaller than zero
-		ibeg = counters->queries-num;
-		if(ibeg < 0)
-			ibeg = 0;
+		ibeg = counters->queries_first + counters->queries - num;
+		if(ibeg < counters->queries_first)
+			ibeg = counters->queries_first;
 	}
 
-	// Get potentially existing filtering flags
-	char * filter = read_setupVarsconf("API_QUERY_LOG_SHOW");
-	bool showpermitted = true, showblocked = true;
-	if(filter != NULL)
+	read_query_log_show(&filter);
+
+	const postingList *postings = filter_postings(&filter);
+	if(postings != NULL)
 	{
-		if((strcmp(filter, "permittedonly")) == 0)
-			showblocked = false;
-		else if((strcmp(filter, "blockedonly")) == 0)
-			showpermitted = false;
-		else if((strcmp(filter, "nothing")) == 0)
+		// Walk only the queries of the requested domain or client
+		postingIterator it;
+		int queryID;
+		postings_seek(postings, &it, ibeg - 1);
+		while(postings_next(&it, &queryID))
 		{
-			showpermitted = false;
-			showblocked = false;
+			const queriesData* query = getQuery(queryID, true);
+			if(!query_matches(query, &filter))
+				continue;
+
+			if(!send_query(sock, query, queryID))
+				return;
 		}
+		return;
 	}
-	clearSetupVarsArray();
 
-	for(int queryID = ibeg; queryID < counters->queries; queryID++)
+	for(int queryID = ibeg; queryID < counters->queries_first + counters->queries; queryID++)
 	{
 		const queriesData* query = getQuery(queryID, true);
-		// Check if this query has been create while in maximum privacy mode
-		if(query == NULL || query->privacylevel >= PRIVACY_MAXIMUM)
-			continue;
-
-		// Verify query type
-		if(query->type > TYPE_MAX-1)
-			continue;
-		// Get query type
-		const char *qtype = querytypes[query->type - TYPE_A];
-
-		// 1 = gravity.list, 4 = wildcard, 5 = black.list
-		if((query->status == QUERY_GRAVITY ||
-		    query->status == QUERY_REGEX ||
-		    query->status == QUERY_BLACKLIST ||
-		    query->status == QUERY_GRAVITY_CNAME ||
-		    query->status == QUERY_REGEX_CNAME ||
-		    query->status == QUERY_BLACKLIST_CNAME) && !showblocked)
-			continue;
-		// 2 = forwarded, 3 = cached
-		if((query->status == QUERY_FORWARDED ||
-		    query->status == QUERY_CACHE) && !showpermitted)
-			continue;
-
-		// Skip those entries which so not meet the requested timeframe
-		if((from > query->timestamp && from != 0) || (query->timestamp > until && until != 0))
-			continue;
-
-		// Skip if domain is not identical with what the user wants to see
-		if(filterdomainname && query->domainID != domainid)
+		if(!query_matches(query, &filter))
 			continue;
 
-		// Skip if client name and IP are not identical with what the user wants to see
-		if(filterclientname && query->clientID != clientid)
-			continue;
+		if(!send_query(sock, query, queryID))
+			return;
+	}
+}
 
-		// Skip if query type is not identical with what the user wants to see
-		if(querytype != 0 && querytype != query->type)
-			continue;
+// Paginated query log, newest queries first:
+//   >getallqueries-cursor <cursor> <limit> [filters]
+// Returns up to <limit> queries older than <cursor> (0 = start with the most
+// recent query) followed by the cursor for the next page (0 = no more data).
+// Cursors are based on stable query IDs, which are not affected by garbage
+// collection or ID rebasing, so pages neither repeat nor skip queries while
+// new queries arrive. The lock is released between pages by the caller and
+// each page scans at most MAX_CURSOR_SCAN queries to keep the time spent
+// under the lock bounded even for very selective filters.
+// Supported filters are space-separated key=value tokens:
+//   from=<timestamp> until=<timestamp> qtype=<type> domain=<name>
+//   client=<name or IP> forward=<name, IP, "cache" or "blocklist">
+#define MAX_CURSOR_SCAN 100000
+#define DEFAULT_CURSOR_LIMIT 100
+#define MAX_CURSOR_LIMIT 10000
+void getAllQueriesCursor(const char *client_message, const int *sock)
+{
+	// Exit before processing any data if requested via config setting
+	if(get_request_privacy_level() >= PRIVACY_MAXIMUM)
+		return;
 
-		if(filterforwarddest)
+	long long cursor = 0;
+	int limit = DEFAULT_CURSOR_LIMIT, offset = 0;
+	if(sscanf(client_message, ">getallqueries-cursor %lli %i%n", &cursor, &limit, &offset) < 2)
+	{
+		ssend(*sock, "Error: Expected cursor and limit\n");
+		return;
+	}
+	if(limit < 1 || limit > MAX_CURSOR_LIMIT)
+		limit = DEFAULT_CURSOR_LIMIT;
+
+	// Parse optional filters
+	queryFilter filter = { 0, 0, -1, -1, 0, false, 0, true, true };
+	char key[16], value[256];
+	const char *p = client_message + offset;
+	int consumed = 0;
+	while(sscanf(p, " %15[a-z]=%255s%n", key, value, &consumed) == 2)
+	{
+		p += consumed;
+		if(strcmp(key, "from") == 0)
+			filter.from = atoi(value);
+		else if(strcmp(key, "until") == 0)
+			filter.until = atoi(value);
+		else if(strcmp(key, "qtype") == 0)
 		{
-			// Does the user want to see queries answered from blocking lists?
-			if(forwarddestid == -2 && query->status != QUERY_GRAVITY
-			                       && query->status != QUERY_REGEX
-			                       && query->status != QUERY_BLACKLIST
-			                       && query->status != QUERY_GRAVITY_CNAME
-			                       && query->status != QUERY_REGEX_CNAME
-			                       && query->status != QUERY_BLACKLIST_CNAME)
-				continue;
-			// Does the user want to see queries answered from local cache?
-			else if(forwarddestid == -1 && query->status != QUERY_CACHE)
-				continue;
-			// Does the user want to see queries answered by an upstream server?
-			else if(forwarddestid >= 0 && forwarddestid != query->upstreamID)
-				continue;
+			const int qtype = atoi(value);
+			if(qtype < 1 || qtype >= TYPE_MAX)
+			{
+				ssend(*sock, "Error: Invalid query type %s\n", value);
+				return;
+			}
+			filter.querytype = qtype;
 		}
-
-		// Ask subroutine for domain. It may return "hidden" depending on
-		// the privacy settings at the time the query was made
-		const char *domain = getDomainString(query);
-
-		// Similarly for the client
-		const char *clientIPName = NULL;
-		// Get client pointer
-		const clientsData* client = getClient(query->clientID, true);
-		if(domain == NULL || client == NULL)
-			continue;
-
-		if(strlen(getstr(client->namepos)) > 0)
-			clientIPName = getClientNameString(query);
-		else
-			clientIPName = getClientIPString(query);
-
-		unsigned long delay = query->response;
-		// Check if received (delay should be smaller than 30min)
-		if(delay > 1.8e7)
-			delay = 0;
-
-		// Get domain blocked during deep CNAME inspection, if applicable
-		const char *CNAME_domain = "N/A";
-		if(query->CNAME_domainID > -1)
+		else if(strcmp(key, "domain") == 0)
 		{
-			CNAME_domain = getCNAMEDomainString(query);
+			if((filter.domainID = find_domain_filter(value)) < 0)
+				cursor = -1;
 		}
-
-		// Get ID of blocking regex, if applicable
-		int regex_idx = -1;
-		if (query->status == QUERY_REGEX || query->status == QUERY_REGEX_CNAME)
+		else if(strcmp(key, "client") == 0)
 		{
-			unsigned int cacheID = findCacheID(query->domainID, query->clientID);
-			DNSCacheData *dns_cache = getDNSCache(cacheID, true);
-			if(dns_cache != NULL)
-				regex_idx = dns_cache->black_regex_idx;
+			if((filter.clientID = find_client_filter(value)) < 0)
+				cursor = -1;
 		}
-
-		if(istelnet[*sock])
+		else if(strcmp(key, "forward") == 0)
 		{
-			ssend(*sock,"%li %s %s %s %i %i %i %lu %s %i",
-				query->timestamp,
-				qtype,
-				domain,
-				clientIPName,
-				query->status,
-				query->dnssec,
-				query->reply,
-				delay,
-				CNAME_domain,
-				regex_idx);
-			if(config.debug & DEBUG_API)
-				ssend(*sock, " %i", queryID);
-			ssend(*sock, "\n");
+			filter.filterupstream = true;
+			if((filter.upstreamID = find_upstream_filter(value)) < -2)
+				cursor = -1;
 		}
 		else
 		{
-			pack_int32(*sock, query->timestamp);
+			ssend(*sock, "Error: Unknown filter %s\n", key);
+			return;
+		}
+	}
 
-			// Use a fixstr because the length of qtype is always 4 (max is 31 for fixstr)
-			if(!pack_fixstr(*sock, qtype))
-				return;
+	read_query_log_show(&filter);
+
+	// Translate the stable cursor into the current query ID range. A negative
+	// cursor marks a filter that cannot match anything
+	const long long rebased = counters->queries_rebased;
+	const int first = counters->queries_first;
+	const int end = counters->queries_first + counters->queries;
+	int queryID = end - 1;
+	if(cursor < 0)
+		queryID = first - 1;
+	else if(cursor > 0 && cursor - rebased <= end)
+		queryID = (int)(cursor - rebased) - 1;
+
+	int found = 0, scanned = 0;
+	const postingList *postings = filter_postings(&filter);
+	if(postings != NULL)
+	{
+		// Walk only the queries of the requested domain or client
+		postingIterator it;
+		int postingID;
+		postings_seek(postings, &it, queryID);
+		queryID = first - 1;
+		while(found < limit && postings_prev(&it, &postingID) && postingID >= first)
+		{
+			if(scanned++ >= MAX_CURSOR_SCAN)
+			{
+				// Continue with this query on the next page
+				queryID = postingID;
+				break;
+			}
 
-			// Use str32 for domain and client because we have no idea how long they will be (max is 4294967295 for str32)
-			if(!pack_str32(*sock, domain) || !pack_str32(*sock, clientIPName))
+			const queriesData* query = getQuery(postingID, true);
+			if(!query_matches(query, &filter))
+				continue;
+
+			if(!send_query(sock, query, postingID))
 				return;
+			found++;
 
-			pack_uint8(*sock, query->status);
-			pack_uint8(*sock, query->dnssec);
+			// Same cursor as the linear scan below once the page is full
+			if(found >= limit)
+				queryID = postingID - 1;
 		}
 	}
+	else
+	{
+		for(; queryID >= first && found < limit && scanned < MAX_CURSOR_SCAN; queryID--, scanned++)
+		{
+			const queriesData* query = getQuery(queryID, true);
+			if(!query_matches(query, &filter))
+				continue;
 
-	// Free allocated memory
-	if(filterclientname)
-		free(clientname);
-
-	if(filterdomainname)
-		free(domainname);
+			if(!send_query(sock, query, queryID))
+				return;
+			found++;
+		}
+	}
 
-	if(filterforwarddest)
-		free(forwarddest);
+	// The next page starts below the last query we looked at
+	const long long next = queryID >= first ? rebased + queryID + 1 : 0;
+	if(istelnet[*sock])
+		ssend(*sock, "cursor %lli\n", next);
+	else
+		pack_int64(*sock, next);
 }
 
 void getRecentBlocked(const char *client_message, const int *sock)
@@ -963,7 +1180,7 @@ void getRecentBlocked(const char *client_message, const int *sock)
 
 	// Find most recently blocked query
 	int found = 0;
-	for(int queryID = counters->queries - 1; queryID > 0 ; queryID--)
+	for(int queryID = counters->queries_first + counters->queries - 1; queryID > counters->queries_first; queryID--)
 	{
 		const queriesData* query = getQuery(queryID, true);
 		if(query == NULL)
@@ -1005,12 +1222,16 @@ void getClientID(const int *sock)
 
 void getQueryTypesOverTime(const int *sock)
 {
+	// Take a lock-free snapshot of the overTime data
+	overTimeData slots[OVERTIME_SLOTS];
+	snapshot_counters(NULL, slots);
+
 	int from = -1, until = OVERTIME_SLOTS;
-	const time_t mintime = overTime[0].timestamp;
+	const time_t mintime = slots[0].timestamp;
 
 	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
 	{
-		if((overTime[slot].total > 0 || overTime[slot].blocked > 0) && overTime[slot].timestamp >= mintime)
+		if((slots[slot].total > 0 || slots[slot].blocked > 0) && slots[slot].timestamp >= mintime)
 		{
 			from = slot;
 			break;
@@ -1020,7 +1241,7 @@ void getQueryTypesOverTime(const int *sock)
 	// End with last non-empty overTime slot
 	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
 	{
-		if(overTime[slot].timestamp >= time(NULL))
+		if(slots[slot].timestamp >= time(NULL))
 		{
 			until = slot;
 			break;
@@ -1034,17 +1255,17 @@ void getQueryTypesOverTime(const int *sock)
 	for(int slot = from; slot < until; slot++)
 	{
 		float percentageIPv4 = 0.0, percentageIPv6 = 0.0;
-		int sum = overTime[slot].querytypedata[0] + overTime[slot].querytypedata[1];
+		int sum = slots[slot].querytypedata[0] + slots[slot].querytypedata[1];
 
 		if(sum > 0) {
-			percentageIPv4 = (float) (1e2 * overTime[slot].querytypedata[0] / sum);
-			percentageIPv6 = (float) (1e2 * overTime[slot].querytypedata[1] / sum);
+			percentageIPv4 = (float) (1e2 * slots[slot].querytypedata[0] / sum);
+			percentageIPv6 = (float) (1e2 * slots[slot].querytypedata[1] / sum);
 		}
 
 		if(istelnet[*sock])
-			ssend(*sock, "%li %.2f %.2f\n", overTime[slot].timestamp, percentageIPv4, percentageIPv6);
+			ssend(*sock, "%li %.2f %.2f\n", slots[slot].timestamp, percentageIPv4, percentageIPv6);
 		else {
-			pack_int32(*sock, overTime[slot].timestamp);
+			pack_int32(*sock, slots[slot].timestamp);
 			pack_float(*sock, percentageIPv4);
 			pack_float(*sock, percentageIPv6);
 		}
@@ -1122,13 +1343,36 @@ void getDBstats(const int *sock)
 	}
 }
 
+void getLockStats(const int *sock)
+{
+	unsigned long histogram[2][LOCK_WAIT_BINS];
+	get_lock_wait_histogram(histogram);
+
+	// One line per bin: upper limit of the bin [us], number of waits for
+	// the shared and for the exclusive lock. The last bin has no limit
+	for(unsigned int bin = 0; bin < LOCK_WAIT_BINS; bin++)
+	{
+		if(istelnet[*sock])
+		{
+			if(bin < LOCK_WAIT_BINS-1)
+				ssend(*sock, "%lu %lu %lu\n", 1UL << bin, histogram[0][bin], histogram[1][bin]);
+			else
+				ssend(*sock, "inf %lu %lu\n", histogram[0][bin], histogram[1][bin]);
+		}
+		else
+		{
+			pack_uint64(*sock, histogram[0][bin]);
+			pack_uint64(*sock, histogram[1][bin]);
+		}
+	}
+}
+
 void getClientsOverTime(const int *sock)
 {
 	int sendit = -1, until = OVERTIME_SLOTS;
 
 	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
-	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS)
+	if(get_request_privacy_level() >= PRIVACY_HIDE_DOMAINS_CLIENTS)
 		return;
 
 	// Find minimum ID to send
@@ -1218,8 +1462,7 @@ void getClientsOverTime(const int *sock)
 void getClientNames(const int *sock)
 {
 	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
-	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS)
+	if(get_request_privacy_level() >= PRIVACY_HIDE_DOMAINS_CLIENTS)
 		return;
 
 	// Get clients which the user doesn't want to see
@@ -1277,11 +1520,10 @@ void getClientNames(const int *sock)
 void getUnknownQueries(const int *sock)
 {
 	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
-	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS)
+	if(get_request_privacy_level() >= PRIVACY_HIDE_DOMAINS)
 		return;
 
-	for(int queryID = 0; queryID < counters->queries; queryID++)
+	for(int queryID = counters->queries_first; queryID < counters->queries_first + counters->queries; queryID++)
 	{
 		const queriesData* query = getQuery(queryID, true);
 
@@ -1311,7 +1553,7 @@ void getUnknownQueries(const int *sock)
 		const char *clientIP = getstr(client->ippos);
 
 		if(istelnet[*sock])
-			ssend(*sock, "%li %i %i %s %s %s %i %s\n", query->timestamp, queryID, query->id, type, getstr(domain->domainpos), clientIP, query->status, query->complete ? "true" : "false");
+			ssend(*sock, "%u %i %i %s %s %s %i %s\n", query->timestamp, queryID, query->id, type, getstr(domain->domainpos), clientIP, query->status, query->complete ? "true" : "false");
 		else {
 			pack_int32(*sock, query->timestamp);
 			pack_int32(*sock, query->id);
@@ -1362,9 +1604,10 @@ void getDomainDetails(const char *client_message, const int *sock)
 					continue;
 				}
 				const char *str = "N/A";
-				unsigned int cacheID = findCacheID(domainID, clientID);
-				DNSCacheData *dns_cache = getDNSCache(cacheID, true);
-				switch(dns_cache->blocking_status)
+				// Clients that never queried this domain have no cache entry
+				const int cacheID = findCacheID(domainID, clientID, false);
+				const DNSCacheData *dns_cache = cacheID < 0 ? NULL : getDNSCache(cacheID, true);
+				switch(dns_cache != NULL ? dns_cache->blocking_status : UNKNOWN_BLOCKED)
 				{
 					case UNKNOWN_BLOCKED:
 						str = "unknown";
@@ -18,6 +18,7 @@ void getTopClients(const char *client_message, const int *sock);
 void getUpstreamDestinations(const char *client_message, const int *sock);
 void getQueryTypes(const int *sock);
 void getAllQueries(const char *client_message, const int *sock);
+void getAllQueriesCursor(const char *client_message, const int *sock);
 void getRecentBlocked(const char *client_message, const int *sock);
 void getQueryTypesOverTime(const int *sock);
 void getClientsOverTime(const int *sock);
@@ -29,6 +30,7 @@ void getClientID(const int *sock);
 void getVersion(const int *sock);
 void getDBstats(const int *sock);
 void getUnknownQueries(const int *sock);
+void getLockStats(const int *sock);
 
 // DNS resolver methods (dnsmasq_interface.c)
 void getCacheInformation(const int *sock);
@@ -33,79 +33,83 @@ void process_request(const char *client_message, int *sock)
 	if(command(client_message, ">stats"))
 	{
 		processed = true;
-		lock_shm();
+		// No lock required, a consistent snapshot is taken internally
 		getStats(sock);
-		unlock_shm();
 	}
 	else if(command(client_message, ">overTime"))
 	{
 		processed = true;
-		lock_shm();
+		// No lock required, a consistent snapshot is taken internally
 		getOverTime(sock);
-		unlock_shm();
 	}
 	else if(command(client_message, ">top-domains") || command(client_message, ">top-ads"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getTopDomains(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">top-clients"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getTopClients(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">forward-dest"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getUpstreamDestinations(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">forward-names"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getUpstreamDestinations(">forward-dest unsorted", sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">querytypes"))
 	{
 		processed = true;
-		lock_shm();
+		// No lock required, a consistent snapshot is taken internally
 		getQueryTypes(sock);
-		unlock_shm();
+	}
+	else if(command(client_message, ">getallqueries-cursor"))
+	{
+		processed = true;
+		// The lock is only held for one (bounded) page
+		lock_shm_read();
+		getAllQueriesCursor(client_message, sock);
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">getallqueries"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getAllQueries(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">recentBlocked"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getRecentBlocked(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">clientID"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getClientID(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">QueryTypesoverTime"))
 	{
 		processed = true;
-		lock_shm();
+		// No lock required, a consistent snapshot is taken internally
 		getQueryTypesOverTime(sock);
-		unlock_shm();
 	}
 	else if(command(client_message, ">version"))
 	{
@@ -123,37 +127,37 @@ void process_request(const char *client_message, int *sock)
 	else if(command(client_message, ">ClientsoverTime"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getClientsOverTime(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">client-names"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getClientNames(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">unknown"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getUnknownQueries(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">domain"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getDomainDetails(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">cacheinfo"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getCacheInformation(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">reresolve"))
 	{
@@ -166,6 +170,12 @@ void process_request(const char *client_message, int *sock)
 		resolveForwardDestinations(false);
 		logg("Done re-resolving host names");
 	}
+	else if(command(client_message, ">lockstats"))
+	{
+		processed = true;
+		// No lock required, the histograms are updated atomically
+		getLockStats(sock);
+	}
 	else if(command(client_message, ">recompile-regex"))
 	{
 		processed = true;
@@ -188,7 +198,7 @@ void process_request(const char *client_message, int *sock)
 	if(command(client_message, ">quit") || command(client_message, EOT))
 	{
 		processed = true;
-		close(*sock);
+		sclose(*sock);
 		*sock = 0;
 	}
 
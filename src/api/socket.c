@@ -9,6 +9,8 @@
 *  Please see LICENSE file for your rights under this license. */
 
 #include "FTL.h"
+// writev()
+#include <sys/uio.h>
 #include "api.h"
 #include "log.h"
 #include "socket.h"
@@ -187,32 +189,171 @@ static bool bind_to_unix_socket(int *socketdescriptor)
 	return true;
 }
 
+// Responses are collected in a per-connection buffer and sent with only a
+// few syscalls instead of one (or two) write() per field. The buffer is
+// flushed once it exceeds SOCKET_FLUSH_THRESHOLD and at the end of each
+// message. Larger payloads are sent directly from the caller's memory
+// together with the pending buffer using a single writev()
+#define SOCKET_FLUSH_THRESHOLD 65536u
+static struct {
+	char *buffer;
+	size_t len;
+	size_t size;
+} outbuf[MAXCONNS] = {{ NULL, 0u, 0u }};
+
+// Write out all given vectors, retrying on partial writes and interrupts
+static bool swritev(const int sock, struct iovec *iov, int iovcnt)
+{
+	while(iovcnt > 0)
+	{
+		const ssize_t ret = writev(sock, iov, iovcnt);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			logg("WARNING: Socket write returned error %s (%i)", strerror(errno), errno);
+			return false;
+		}
+
+		// Skip fully written vectors and advance into a partially written one
+		size_t written = (size_t)ret;
+		while(iovcnt > 0 && written >= iov->iov_len)
+		{
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0)
+		{
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return true;
+}
+
+// Make sure there is room for at least <size> more bytes in the buffer
+static bool sreserve(const int sock, const size_t size)
+{
+	if(outbuf[sock].len + size <= outbuf[sock].size)
+		return true;
+
+	size_t newsize = outbuf[sock].size > 0u ? outbuf[sock].size : 4096u;
+	while(newsize < outbuf[sock].len + size)
+		newsize *= 2u;
+
+	char *newbuffer = realloc(outbuf[sock].buffer, newsize);
+	if(newbuffer == NULL)
+		return false;
+
+	outbuf[sock].buffer = newbuffer;
+	outbuf[sock].size = newsize;
+	return true;
+}
+
+void sflush(const int sock)
+{
+	if(sock < 0 || sock >= MAXCONNS || outbuf[sock].len == 0u)
+		return;
+
+	struct iovec iov = { outbuf[sock].buffer, outbuf[sock].len };
+	swritev(sock, &iov, 1);
+	outbuf[sock].len = 0u;
+}
+
+// Send pending output, release the buffer and close the connection. The
+// buffer has to be released before closing as the descriptor may be reused
+// by a new connection right afterwards
+void sclose(const int sock)
+{
+	sflush(sock);
+	if(sock >= 0 && sock < MAXCONNS)
+	{
+		free(outbuf[sock].buffer);
+		outbuf[sock].buffer = NULL;
+		outbuf[sock].len = 0u;
+		outbuf[sock].size = 0u;
+	}
+	close(sock);
+}
+
 void seom(const int sock)
 {
 	if(istelnet[sock])
 		ssend(sock, "---EOM---\n\n");
 	else
 		pack_eom(sock);
+
+	sflush(sock);
 }
 
 void __attribute__ ((format (gnu_printf, 2, 3))) ssend(const int sock, const char *format, ...)
 {
-	char *buffer;
 	va_list args;
+	if(sock >= 0 && sock < MAXCONNS && sreserve(sock, 256u))
+	{
+		// Try to format directly into the remaining space of the buffer
+		// and retry with a sufficiently large buffer if it didn't fit
+		for(unsigned int attempt = 0; attempt < 2; attempt++)
+		{
+			const size_t avail = outbuf[sock].size - outbuf[sock].len;
+			va_start(args, format);
+			const int ret = vsnprintf(outbuf[sock].buffer + outbuf[sock].len, avail, format, args);
+			va_end(args);
+			if(ret < 0)
+				return;
+			if((size_t)ret < avail)
+			{
+				outbuf[sock].len += (size_t)ret;
+				if(outbuf[sock].len >= SOCKET_FLUSH_THRESHOLD)
+					sflush(sock);
+				return;
+			}
+			if(!sreserve(sock, (size_t)ret + 1u))
+				break;
+		}
+	}
+
+	// Fall back to sending the formatted string directly
+	char *buffer;
 	va_start(args, format);
 	int ret = vasprintf(&buffer, format, args);
 	va_end(args);
 	if(ret > 0)
 	{
-		if(!write(sock, buffer, strlen(buffer)))
-			logg("WARNING: Socket write returned error %s (%i)", strerror(errno), errno);
+		swrite(sock, buffer, (size_t)ret);
 		free(buffer);
 	}
 }
 
 void swrite(const int sock, const void *value, size_t size) {
-	if(write(sock, value, size) == -1)
-		logg("WARNING: Socket write returned error code %i", errno);
+	if(sock < 0 || sock >= MAXCONNS ||
+	   (size < SOCKET_FLUSH_THRESHOLD && !sreserve(sock, size)))
+	{
+		// Unbuffered connection or out of memory
+		sflush(sock);
+		struct iovec iov = { (void*)value, size };
+		swritev(sock, &iov, 1);
+		return;
+	}
+
+	if(size >= SOCKET_FLUSH_THRESHOLD)
+	{
+		// Send pending output together with the large payload
+		struct iovec iov[2] = {
+			{ outbuf[sock].buffer, outbuf[sock].len },
+			{ (void*)value, size }
+		};
+		swritev(sock, iov, 2);
+		outbuf[sock].len = 0u;
+		return;
+	}
+
+	memcpy(outbuf[sock].buffer + outbuf[sock].len, value, size);
+	outbuf[sock].len += size;
+	if(outbuf[sock].len >= SOCKET_FLUSH_THRESHOLD)
+		sflush(sock);
 }
 
 static inline int checkClientLimit(const int socket) {
@@ -328,7 +469,7 @@ static void *telnet_connection_handler_thread(void *socket_desc)
 
 	//Free the socket pointer
 	if(sock != 0)
-		close(sock);
+		sclose(sock);
 	free(socket_desc);
 
 	return false;
@@ -380,7 +521,7 @@ static void *socket_connection_handler_thread(void *socket_desc)
 
 	//Free the socket pointer
 	if(sock != 0)
-		close(sock);
+		sclose(sock);
 	free(socket_desc);
 
 	return false;
@@ -16,6 +16,10 @@
 #include "log.h"
 // global variable killed
 #include "signals.h"
+// gravity_index_compile()
+#include "database/gravity-index.h"
+// getGravityPaths()
+#include "config.h"
 
 static bool debug = false;
 bool daemonmode = true;
@@ -143,6 +147,19 @@ void parse_args(int argc, char* argv[])
 			exit(EXIT_SUCCESS);
 		}
 
+		// Compile gravity database into a binary image which is mapped
+		// into memory by FTL on the next reload of the lists
+		if(strcmp(argv[i], "gravity-compile") == 0)
+		{
+			daemonmode = false;
+			open_FTL_log(true);
+			// Default to the locations configured in pihole-FTL.conf
+			getGravityPaths();
+			const char *db = i + 1 < argc ? argv[i + 1] : FTLfiles.gravity_db;
+			const char *img = i + 2 < argc ? argv[i + 2] : FTLfiles.gravity_image;
+			exit(gravity_index_compile(db, img) ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
 		// Don't go into background
 		if(strcmp(argv[i], "-f") == 0 ||
 		   strcmp(argv[i], "no-daemon") == 0)
@@ -169,6 +186,11 @@ void parse_args(int argc, char* argv[])
 			printf("\t-h, help          Display this help and exit\n");
 			printf("\tdnsmasq-test      Test syntax of dnsmasq's\n");
 			printf("\t                  config files and exit\n");
+			printf("\tgravity-compile [<db> [<image>]]\n");
+			printf("\t                  Compile gravity database into\n");
+			printf("\t                  a binary image and exit\n");
+			printf("\t                  (defaults: GRAVITYDB and\n");
+			printf("\t                  GRAVITYIMAGE of pihole-FTL.conf)\n");
 			printf("\n\nOnline help: https://github.com/pi-hole/FTL\n");
 			exit(EXIT_SUCCESS);
 		}
@@ -29,12 +29,14 @@ FTLFileNamesStruct FTLfiles = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
-// Private global variables
-static char *conflinebuffer = NULL;
-static size_t size = 0;
+// Private global variables. They are thread-local as API threads may
+// read the config file concurrently while holding the shared lock
+static __thread char *conflinebuffer = NULL;
+static __thread size_t size = 0;
 
 // Private prototypes
 static char *parse_FTLconf(FILE *fp, const char * key);
@@ -84,6 +86,31 @@ void getLogFilePath(void)
 		logg("Using log file %s", FTLfiles.log);
 }
 
+// Read only the paths of the gravity database and its compiled image. This is
+// used by the gravity-compile command which does not need the full config
+void getGravityPaths(void)
+{
+	FILE *fp;
+
+	// Try to open default config file. Use fallback if not found
+	if( ((fp = fopen(FTLfiles.conf, "r")) == NULL) &&
+	    ((fp = fopen(FTLfiles.snapConf, "r")) == NULL) &&
+	    ((fp = fopen("pihole-FTL.conf", "r")) == NULL))
+	{
+		logg("Notice: Found no readable FTL config file");
+		logg("        Using default settings");
+	}
+
+	getpath(fp, "GRAVITYDB", "/etc/pihole/gravity.db", &FTLfiles.gravity_db);
+	getpath(fp, "GRAVITYIMAGE", "/etc/pihole/gravity.img", &FTLfiles.gravity_image);
+
+	// Release memory
+	release_config_memory();
+
+	if(fp != NULL)
+		fclose(fp);
+}
+
 void read_FTLconf(void)
 {
 	FILE *fp;
@@ -312,6 +339,9 @@ void read_FTLconf(void)
 	// GRAVITYDB
 	getpath(fp, "GRAVITYDB", "/etc/pihole/gravity.db", &FTLfiles.gravity_db);
 
+	// GRAVITYIMAGE
+	getpath(fp, "GRAVITYIMAGE", "/etc/pihole/gravity.img", &FTLfiles.gravity_image);
+
 	// PARSE_ARP_CACHE
 	// defaults to: true
 	buffer = parse_FTLconf(fp, "PARSE_ARP_CACHE");
@@ -386,6 +416,75 @@ void read_FTLconf(void)
 	else
 		logg("   NAMES_FROM_NETDB: Disabled");
 
+	// GC_BATCH_SIZE
+	// How many queries may the garbage collection remove at most while
+	// holding the shared memory lock? GC continues with the next batch
+	// shortly after. Zero disables the limit
+	// defaults to: 1000 queries
+	config.gc_batch_size = 1000u;
+	buffer = parse_FTLconf(fp, "GC_BATCH_SIZE");
+
+	unsigned int uvalue = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &uvalue))
+		config.gc_batch_size = uvalue;
+
+	// GC_BATCH_TIME
+	// For how long may the garbage collection hold the shared memory lock
+	// at most [microseconds]? Zero disables the limit
+	// defaults to: 2000 microseconds
+	config.gc_batch_time = 2000u;
+	buffer = parse_FTLconf(fp, "GC_BATCH_TIME");
+
+	uvalue = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &uvalue))
+		config.gc_batch_time = uvalue;
+
+	if(config.gc_batch_size == 0 && config.gc_batch_time == 0)
+		logg("   GC_BATCH: Removing expired queries in one go");
+	else
+		logg("   GC_BATCH: Removing up to %u queries within up to %u us per batch",
+		     config.gc_batch_size, config.gc_batch_time);
+
+	// GRAVITY_IN_MEMORY
+	// Should gravity and the exact white- and blacklists be loaded into
+	// memory? Domains are then checked without querying the database at
+	// the expense of memory
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "GRAVITY_IN_MEMORY");
+	config.gravity_in_memory = read_bool(buffer, false);
+
+	if(config.gravity_in_memory)
+		logg("   GRAVITY_IN_MEMORY: Enabled, checking domains in memory");
+	else
+		logg("   GRAVITY_IN_MEMORY: Disabled");
+
+	// SHM_HUGEPAGES
+	// Should the large shared memory objects (queries, clients and DNS
+	// cache) be backed by transparent huge pages? This reduces TLB misses
+	// when scanning them on large instances
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "SHM_HUGEPAGES");
+	config.shm_hugepages = read_bool(buffer, false);
+
+	if(config.shm_hugepages)
+		logg("   SHM_HUGEPAGES: Enabled, requesting huge pages for large shared memory objects");
+	else
+		logg("   SHM_HUGEPAGES: Disabled");
+
+	// QUERY_INDEX
+	// Should FTL maintain lists of the queries of each domain and client?
+	// They allow filtering the query log by domain or client without
+	// scanning all queries at the cost of about ten bytes per query plus
+	// up to 128 bytes for each domain and client with queries in the log
+	// defaults to: true
+	buffer = parse_FTLconf(fp, "QUERY_INDEX");
+	config.query_index = read_bool(buffer, true);
+
+	if(config.query_index)
+		logg("   QUERY_INDEX: Enabled, indexing queries by domain and client");
+	else
+		logg("   QUERY_INDEX: Disabled");
+
 	// Read DEBUG_... setting from pihole-FTL.conf
 	read_debuging_settings(fp);
 
@@ -489,6 +588,42 @@ void release_config_memory(void)
 	}
 }
 
+// Get the privacy level to apply to an API request. Like get_privacy_level(),
+// this only allows increasing the level at runtime, but it does not modify
+// config.privacylevel and uses its own line buffer. This makes it safe to
+// call from API threads running concurrently under the shared lock
+enum privacy_level get_request_privacy_level(void)
+{
+	enum privacy_level level = config.privacylevel;
+	FILE *fp;
+	if((fp = fopen(FTLfiles.conf, "r")) == NULL)
+		return level;
+
+	char *line = NULL;
+	size_t len = 0;
+	while(getline(&line, &len, fp) != -1)
+	{
+		// Skip comment lines
+		if(line[0] == '#' || line[0] == ';')
+			continue;
+
+		const char *key = strstr(line, "PRIVACYLEVEL=");
+		if(key == NULL)
+			continue;
+
+		int value = 0;
+		if(sscanf(key + strlen("PRIVACYLEVEL="), "%i", &value) == 1 &&
+		   value >= PRIVACY_SHOW_ALL && value <= PRIVACY_MAXIMUM &&
+		   value > (int)level)
+			level = value;
+		break;
+	}
+
+	free(line);
+	fclose(fp);
+	return level;
+}
+
 void get_privacy_level(FILE *fp)
 {
 	// See if we got a file handle, if not we have to open
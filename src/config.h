@@ -18,7 +18,9 @@
 
 void getLogFilePath(void);
 void read_FTLconf(void);
+void getGravityPaths(void);
 void get_privacy_level(FILE *fp);
+enum privacy_level get_request_privacy_level(void);
 void get_blocking_mode(FILE *fp);
 void read_debuging_settings(FILE *fp);
 
@@ -29,6 +31,8 @@ typedef struct {
 	int maxlogage;
 	int dns_port;
 	unsigned int delay_startup;
+	unsigned int gc_batch_size;
+	unsigned int gc_batch_time;
 	int16_t debug;
 	enum privacy_level privacylevel;
 	enum blocking_mode blockingmode;
@@ -43,6 +47,9 @@ typedef struct {
 	bool cname_inspection;
 	bool block_esni;
 	bool names_from_netdb;
+	bool gravity_in_memory;
+	bool shm_hugepages;
+	bool query_index;
 } ConfigStruct;
 
 typedef struct {
@@ -53,6 +60,7 @@ typedef struct {
 	char* socketfile;
 	char* FTL_db;
 	char* gravity_db;
+	char* gravity_image;
 	char* macvendor_db;
 	char* setupVars;
 	char* auditlist;
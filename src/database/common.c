@@ -28,6 +28,24 @@ static bool db_avail = false;
 
 static pthread_mutex_t dblock;
 
+// The connection opened by dbopen() is kept open between operations so that
+// neither the file nor the schema have to be parsed again each time. We
+// remember which process opened it (connections must not be carried across
+// fork()) and which file it refers to (the file may have been replaced)
+static sqlite3 *persistent_db = NULL;
+static pid_t persistent_pid = 0;
+static dev_t persistent_dev = 0;
+static ino_t persistent_ino = 0;
+
+// Prepared statements of recurring queries on the persistent connection
+#define MAX_CACHED_STATEMENTS 24
+static struct {
+	char *sql;
+	sqlite3_stmt *stmt;
+} stmt_cache[MAX_CACHED_STATEMENTS] = {{ 0 }};
+
+static void db_disconnect(void);
+
 __attribute__ ((pure)) bool FTL_DB_avail(void)
 {
 	return db_avail;
@@ -35,10 +53,19 @@ __attribute__ ((pure)) bool FTL_DB_avail(void)
 
 void dbclose(void)
 {
-	// Only try to close an existing database connection
 	int rc = SQLITE_OK;
-	if( FTL_db != NULL )
+	if( FTL_db != NULL && FTL_db == persistent_db )
+	{
+		// Keep the persistent connection open. Roll back a transaction
+		// left open due to an error as closing the connection would have
+		// done before
+		if(!sqlite3_get_autocommit(FTL_db))
+			rc = sqlite3_exec(FTL_db, "ROLLBACK", NULL, NULL, NULL);
+		FTL_db = NULL;
+	}
+	else if( FTL_db != NULL )
 	{
+		// Only try to close an existing database connection
 		rc = sqlite3_close(FTL_db);
 		FTL_db = NULL;
 	}
@@ -73,6 +100,25 @@ bool dbopen(void)
 	if(config.debug & DEBUG_LOCKS)
 		logg("Locking database: Success");
 
+	// Check if we can re-use the already open connection
+	struct stat st;
+	if(persistent_db != NULL &&
+	   (persistent_pid != getpid() ||
+	    stat(FTLfiles.FTL_db, &st) != 0 ||
+	    st.st_dev != persistent_dev || st.st_ino != persistent_ino))
+	{
+		if(config.debug & DEBUG_DATABASE)
+			logg("Re-opening database connection");
+		db_disconnect();
+	}
+
+	if(persistent_db != NULL)
+	{
+		FTL_db = persistent_db;
+		db_avail = true;
+		return true;
+	}
+
 	// Try to open database
 	int rc = sqlite3_open_v2(FTLfiles.FTL_db, &FTL_db, SQLITE_OPEN_READWRITE, NULL);
 	if( rc != SQLITE_OK )
@@ -94,11 +140,145 @@ bool dbopen(void)
 		return false;
 	}
 
+	// Remember this connection for re-use
+	persistent_db = FTL_db;
+	persistent_pid = getpid();
+	if(stat(FTLfiles.FTL_db, &st) == 0)
+	{
+		persistent_dev = st.st_dev;
+		persistent_ino = st.st_ino;
+	}
+
 	db_avail = true;
 
 	return true;
 }
 
+// Close the persistent connection (if any) and free all cached statements
+static void db_disconnect(void)
+{
+	// A connection inherited from our parent process has to be left alone,
+	// finalizing its statements or closing it may interfere with the parent
+	const bool inherited = persistent_pid != getpid();
+
+	for(unsigned int i = 0; i < MAX_CACHED_STATEMENTS; i++)
+	{
+		if(stmt_cache[i].stmt != NULL && !inherited)
+			sqlite3_finalize(stmt_cache[i].stmt);
+		if(stmt_cache[i].sql != NULL)
+			free(stmt_cache[i].sql);
+		stmt_cache[i].sql = NULL;
+		stmt_cache[i].stmt = NULL;
+	}
+
+	if(persistent_db != NULL && !inherited)
+		sqlite3_close(persistent_db);
+	persistent_db = NULL;
+}
+
+// Get a prepared statement for the given SQL string. Statements of recurring
+// queries are cached so that SQLite parses them only once. Hand the statement
+// back using db_release_stmt() once done, never finalize it yourself
+sqlite3_stmt *db_prepare_cached(const char *sql)
+{
+	if(FTL_db == NULL)
+	{
+		logg("db_prepare_cached(\"%s\") called but database is not available!", sql);
+		return NULL;
+	}
+
+	unsigned int i;
+	for(i = 0; i < MAX_CACHED_STATEMENTS && stmt_cache[i].sql != NULL; i++)
+		if(strcmp(stmt_cache[i].sql, sql) == 0)
+			return stmt_cache[i].stmt;
+
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v3(FTL_db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+	if( rc != SQLITE_OK )
+	{
+		logg("Encountered prepare error in db_prepare_cached(\"%s\"): %s", sql, sqlite3_errstr(rc));
+		return NULL;
+	}
+
+	// Only statements of the persistent connection can be cached. If the
+	// cache is full, the statement is finalized by db_release_stmt(). The
+	// SQL string is copied as callers may pass temporary buffers
+	if(FTL_db == persistent_db && i < MAX_CACHED_STATEMENTS &&
+	   (stmt_cache[i].sql = strdup(sql)) != NULL)
+		stmt_cache[i].stmt = stmt;
+
+	return stmt;
+}
+
+// Reset a statement obtained from db_prepare_cached() for later re-use
+void db_release_stmt(sqlite3_stmt *stmt)
+{
+	if(stmt == NULL)
+		return;
+
+	for(unsigned int i = 0; i < MAX_CACHED_STATEMENTS && stmt_cache[i].sql != NULL; i++)
+	{
+		if(stmt_cache[i].stmt == stmt)
+		{
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			return;
+		}
+	}
+
+	// Not cached
+	sqlite3_finalize(stmt);
+}
+
+// Execute a (cached) statement not returning any rows and release it
+int db_step_stmt(sqlite3_stmt *stmt)
+{
+	if(config.debug & DEBUG_DATABASE)
+	{
+		char *sql = sqlite3_expanded_sql(stmt);
+		logg("dbquery: \"%s\"", sql);
+		sqlite3_free(sql);
+	}
+
+	int rc = sqlite3_step(stmt);
+	if(rc == SQLITE_DONE || rc == SQLITE_ROW)
+		rc = SQLITE_OK;
+	else
+		logg("Encountered step error in db_step_stmt(\"%s\"): %s", sqlite3_sql(stmt), sqlite3_errstr(rc));
+
+	db_release_stmt(stmt);
+	return rc;
+}
+
+// Execute a (cached) statement returning a single integer and release it
+int db_query_int_stmt(sqlite3_stmt *stmt)
+{
+	if(config.debug & DEBUG_DATABASE)
+	{
+		char *sql = sqlite3_expanded_sql(stmt);
+		logg("dbquery: \"%s\"", sql);
+		sqlite3_free(sql);
+	}
+
+	int result;
+	const int rc = sqlite3_step(stmt);
+	if( rc == SQLITE_ROW )
+		result = sqlite3_column_int(stmt, 0);
+	else if( rc == SQLITE_DONE )
+		result = DB_NODATA;
+	else
+	{
+		logg("Encountered step error in db_query_int_stmt(\"%s\"): %s", sqlite3_sql(stmt), sqlite3_errstr(rc));
+		result = DB_FAILED;
+	}
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("         ---> Result %i (int)", result);
+
+	db_release_stmt(stmt);
+	return result;
+}
+
 int dbquery(const char *format, ...)
 {
 	va_list args;
@@ -427,9 +607,22 @@ bool db_update_counters(const int total, const int blocked)
 		logg("db_update_counters(%i, %i) called but database is not available!", total, blocked);
 		return false;
 	}
-	if(dbquery("UPDATE counters SET value = value + %i WHERE id = %i;", total, DB_TOTALQUERIES) != SQLITE_OK)
+	const char *sql = "UPDATE counters SET value = value + ? WHERE id = ?;";
+	sqlite3_stmt *stmt = db_prepare_cached(sql);
+	if(stmt == NULL)
 		return false;
-	if(dbquery("UPDATE counters SET value = value + %i WHERE id = %i;", blocked, DB_BLOCKEDQUERIES) != SQLITE_OK)
+	sqlite3_bind_int(stmt, 1, total);
+	sqlite3_bind_int(stmt, 2, DB_TOTALQUERIES);
+	if(db_step_stmt(stmt) != SQLITE_OK)
+		return false;
+
+	// Re-use the same statement for the blocked counter
+	stmt = db_prepare_cached(sql);
+	if(stmt == NULL)
+		return false;
+	sqlite3_bind_int(stmt, 1, blocked);
+	sqlite3_bind_int(stmt, 2, DB_BLOCKEDQUERIES);
+	if(db_step_stmt(stmt) != SQLITE_OK)
 		return false;
 	return true;
 }
@@ -505,23 +698,19 @@ long int get_max_query_ID(void)
 		logg("dbquery: \"%s\"", sql);
 	}
 
-	sqlite3_stmt* stmt = NULL;
-	int rc = sqlite3_prepare_v2(FTL_db, sql, -1, &stmt, NULL);
-	if( rc != SQLITE_OK )
+	sqlite3_stmt* stmt = db_prepare_cached(sql);
+	if( stmt == NULL )
 	{
-		if( rc != SQLITE_BUSY )
-		{
-			logg("Encountered prepare error in get_max_query_ID(): %s", sqlite3_errstr(rc));
-			database = false;
-		}
+		database = false;
 		dbclose();
 		return DB_FAILED;
 	}
 
-	rc = sqlite3_step(stmt);
+	int rc = sqlite3_step(stmt);
 	if( rc != SQLITE_ROW )
 	{
 		logg("Encountered step error in get_max_query_ID(): %s", sqlite3_errstr(rc));
+		db_release_stmt(stmt);
 		database = false;
 		dbclose();
 		return DB_FAILED;
@@ -532,7 +721,7 @@ long int get_max_query_ID(void)
 	{
 		logg("         ---> Result %lli (long long int)", (long long int)result);
 	}
-	sqlite3_finalize(stmt);
+	db_release_stmt(stmt);
 	return result;
 }
 
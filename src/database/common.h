@@ -35,6 +35,10 @@ int dbquery(const char *format, ...);
 bool FTL_DB_avail(void) __attribute__ ((pure));
 bool dbopen(void);
 void dbclose(void);
+sqlite3_stmt *db_prepare_cached(const char *sql);
+void db_release_stmt(sqlite3_stmt *stmt);
+int db_step_stmt(sqlite3_stmt *stmt);
+int db_query_int_stmt(sqlite3_stmt *stmt);
 int db_query_int(const char*);
 long get_lastID(void);
 void SQLite3LogCallback(void *pArg, int iErrCode, const char *zMsg);
@@ -11,8 +11,6 @@
 #include "FTL.h"
 #include "database-thread.h"
 #include "common.h"
-// [un]lock_shm();
-#include "shmem.h"
 // parse_neighbor_cache()
 #include "network-table.h"
 // DB_save_queries()
@@ -45,16 +43,10 @@ void *DB_thread(void *val)
 			// Update lastDBsave timer
 			lastDBsave = time(NULL) - time(NULL)%config.DBinterval;
 
-			// Lock FTL's data structures, since it is
-			// likely that they will be changed here
-			lock_shm();
-
-			// Save data to database
+			// Save data to database. This locks FTL's data
+			// structures only while copying the queries
 			DB_save_queries();
 
-			// Release data lock
-			unlock_shm();
-
 			// Check if GC should be done on the database
 			if(DBdeleteoldqueries)
 			{
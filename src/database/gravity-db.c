@@ -21,6 +21,8 @@
 #include "../vector.h"
 // log_subnet_warning()
 #include "database/message-table.h"
+// gravity_index_*()
+#include "database/gravity-index.h"
 
 // Process-private prepared statements are used to support multiple forks (might
 // be TCP workers) to use the database simultaneously without corrupting the
@@ -33,6 +35,8 @@ sqlite3_stmt_vec *blacklist_stmt = NULL;
 static sqlite3 *gravity_db = NULL;
 static sqlite3_stmt* table_stmt = NULL;
 static sqlite3_stmt* auditlist_stmt = NULL;
+// API threads may check the audit list concurrently under the shared lock
+static pthread_mutex_t auditlist_lock = PTHREAD_MUTEX_INITIALIZER;
 bool gravityDB_opened = false;
 
 // Table names corresponding to the enum defined in gravity-db.h
@@ -406,6 +410,9 @@ bool gravityDB_prepare_client_statements(const int clientID, clientsData *client
 	if(!client->found_group && !get_client_groupids(client))
 		return false;
 
+	// Update groups of this client in the in-memory index (if enabled)
+	gravity_index_set_client(clientID, getstr(client->groupspos));
+
 	// Prepare whitelist statement
 	// We use SELECT EXISTS() as this is known to efficiently use the index
 	// We are only interested in whether the domain exists or not in the
@@ -519,6 +526,24 @@ void gravityDB_close(void)
 	gravityDB_opened = false;
 }
 
+// (Re-)load the index of gravity and the exact white- and blacklists. A
+// precompiled image is preferred as it is shared by all processes and needs
+// no time to build. Otherwise, the index is built in memory if enabled.
+// Lookups fall back to the database if neither is available
+void gravityDB_build_index(void)
+{
+	if(gravity_index_load_image(FTLfiles.gravity_image, FTLfiles.gravity_db))
+		return;
+
+	if(!config.gravity_in_memory || (!gravityDB_opened && !gravityDB_open()))
+	{
+		gravity_index_free();
+		return;
+	}
+
+	gravity_index_build(gravity_db);
+}
+
 // Prepare a SQLite3 statement which can be used by gravityDB_getDomain() to get
 // blocking domains from a table which is specified when calling this function
 bool gravityDB_getTable(const unsigned char list)
@@ -782,6 +807,10 @@ bool in_whitelist(const char *domain, const int clientID, clientsData* client)
 	// only if the exact whitelist lookup does not deliver a positive match. This is an
 	// optimization as the database lookup will most likely hit (a) more domains and (b)
 	// will be faster (given a sufficiently large number of regex whitelisting filters).
+	if(gravity_index_available())
+		return gravity_index_lookup(EXACT_WHITELIST_TABLE, domain, clientID) ||
+		       match_regex(domain, clientID, REGEX_WHITELIST) != -1;
+
 	return domain_in_list(domain, stmt, "whitelist") ||
 	       match_regex(domain, clientID, REGEX_WHITELIST) != -1;
 }
@@ -810,6 +839,9 @@ bool in_gravity(const char *domain, const int clientID, clientsData* client)
 		stmt = gravity_stmt->get(gravity_stmt, clientID);
 	}
 
+	if(gravity_index_available())
+		return gravity_index_lookup(GRAVITY_TABLE, domain, clientID);
+
 	return domain_in_list(domain, stmt, "gravity");
 }
 
@@ -837,6 +869,9 @@ inline bool in_blacklist(const char *domain, const int clientID, clientsData* cl
 		stmt = blacklist_stmt->get(blacklist_stmt, clientID);
 	}
 
+	if(gravity_index_available())
+		return gravity_index_lookup(EXACT_BLACKLIST_TABLE, domain, clientID);
+
 	return domain_in_list(domain, stmt, "blacklist");
 }
 
@@ -847,8 +882,12 @@ bool in_auditlist(const char *domain)
 	if(auditlist_stmt == NULL)
 		return false;
 
-	// We check the domain_audit table for the given domain
-	return domain_in_list(domain, auditlist_stmt, "auditlist");
+	// We check the domain_audit table for the given domain. The statement
+	// is shared so binding, stepping and resetting it has to be serialized
+	pthread_mutex_lock(&auditlist_lock);
+	const bool found = domain_in_list(domain, auditlist_stmt, "auditlist");
+	pthread_mutex_unlock(&auditlist_lock);
+	return found;
 }
 
 bool gravityDB_get_regex_client_groups(clientsData* client, const int numregex, const int *regexid,
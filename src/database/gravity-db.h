@@ -22,6 +22,7 @@ void gravityDB_forked(void);
 bool gravityDB_open(void);
 bool gravityDB_prepare_client_statements(const int clientID, clientsData* client);
 void gravityDB_close(void);
+void gravityDB_build_index(void);
 bool gravityDB_getTable(unsigned char list);
 const char* gravityDB_getDomain(int *rowid);
 char* get_group_names(const char *group_ids) __attribute__ ((malloc));
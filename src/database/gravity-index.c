@@ -0,0 +1,675 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2020 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory gravity index
+*
+*  The exact white- and blacklists as well as gravity are loaded into hash
+*  tables together with a bitset of the groups each domain is assigned to.
+*  Checking if a domain is on a list for a given client is then a single hash
+*  lookup plus a bitwise AND with the groups of the client, no SQLite query is
+*  needed on the hot path.
+*
+*  The index can either be built in memory from the database or be compiled
+*  into a binary image (pihole-FTL gravity-compile) which is mapped read-only
+*  into memory. The image is position-independent so all processes share the
+*  same physical pages and pages are only read from disk when first used.
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "gravity-index.h"
+#include "hashtable.h"
+#include "config.h"
+#include "log.h"
+#include "timers.h"
+// mmap()
+#include <sys/mman.h>
+// open()
+#include <fcntl.h>
+
+// Increase this whenever the layout of the image file changes
+#define GRAVITY_IMAGE_VERSION 1
+#define GRAVITY_IMAGE_MAGIC "FTLGRAV"
+
+// Lists held in the index, indexed by enum gravity_tables
+#define NUM_INDEXED_LISTS (EXACT_WHITELIST_TABLE + 1)
+
+typedef struct {
+	// Hash table mapping domains to their index
+	hashSlot *table;
+	size_t table_size;
+	// Offset of the domain string in the string arena
+	uint32_t *offsets;
+	// group_words bitset words per domain
+	uint64_t *bits;
+	char *strings;
+	size_t strings_len;
+	size_t strings_alloc;
+	unsigned int domains;
+	unsigned int domains_alloc;
+} domainIndex;
+
+// Read-only view of a list used for lookups. It points either into the
+// index built in memory or into the mapped image file
+typedef struct {
+	const hashSlot *table;
+	size_t table_size;
+	const uint32_t *offsets;
+	const uint64_t *bits;
+	const char *strings;
+	unsigned int domains;
+} domainView;
+
+// Layout of the image file. All offsets are relative to the start of the
+// file, all sections are aligned to eight bytes
+typedef struct {
+	uint64_t table_offset;
+	uint64_t table_size;
+	uint64_t offsets_offset;
+	uint64_t bits_offset;
+	uint64_t strings_offset;
+	uint64_t strings_len;
+	uint32_t domains;
+	uint32_t padding;
+} imageList;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_groups;
+	uint32_t group_words;
+	uint32_t padding;
+	// Modification time and size of the database the image was compiled
+	// from, a changed database invalidates the image
+	int64_t source_mtime_sec;
+	int64_t source_mtime_nsec;
+	uint64_t source_size;
+	uint64_t groups_offset;
+	uint64_t size;
+	imageList lists[NUM_INDEXED_LISTS];
+} imageHeader;
+
+static domainIndex lists[NUM_INDEXED_LISTS] = {{ 0 }};
+static domainView views[NUM_INDEXED_LISTS] = {{ 0 }};
+static const char *listviews[NUM_INDEXED_LISTS] = { "vw_gravity", "vw_blacklist", "vw_whitelist" };
+static bool index_available = false;
+
+// Mapped image file (if any)
+static void *image = NULL;
+static size_t image_size = 0u;
+
+// Sorted IDs of all groups, a group's position in here is its bit position
+static int *group_ids = NULL;
+static const int *group_view = NULL;
+static unsigned int num_groups = 0u;
+static unsigned int group_words = 1u;
+
+// Process-private group bitsets of all clients (group_words words each)
+static uint64_t *client_groups = NULL;
+static unsigned int client_groups_size = 0u;
+
+// List the match callback compares against
+static __thread const char *match_strings = NULL;
+static __thread const uint32_t *match_offsets = NULL;
+
+static bool domain_matches(const int ID, const void *key)
+{
+	return strcmp(match_strings + match_offsets[ID], key) == 0;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	const int x = *(const int*)a, y = *(const int*)b;
+	return (x > y) - (x < y);
+}
+
+// Get bit position of a group or -1 if the group is unknown
+static int __attribute__((pure)) group_bit(const int groupID)
+{
+	const int *found = bsearch(&groupID, group_view, num_groups, sizeof(int), cmp_int);
+	return found != NULL ? (int)(found - group_view) : -1;
+}
+
+static bool read_groups(sqlite3 *db)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, "SELECT id FROM \"group\" ORDER BY id;", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("gravity_index_build(): SQL error prepare (groups): %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	unsigned int alloc = 0u;
+	num_groups = 0u;
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if(num_groups >= alloc)
+		{
+			alloc = alloc > 0u ? 2u*alloc : 64u;
+			int *new_ids = realloc(group_ids, alloc*sizeof(int));
+			if(new_ids == NULL)
+				break;
+			group_ids = new_ids;
+		}
+		group_ids[num_groups++] = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("gravity_index_build(): Failed to read groups: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	group_view = group_ids;
+	group_words = num_groups > 0u ? (num_groups + 63u)/64u : 1u;
+	return true;
+}
+
+// Double the size of the hash table of a list
+static bool grow_table(domainIndex *list)
+{
+	const size_t new_size = list->table_size > 0u ? 2u*list->table_size : hashtable_size(1024u);
+	hashSlot *new_table = calloc(new_size, sizeof(hashSlot));
+	if(new_table == NULL)
+		return false;
+
+	for(size_t i = 0; i < list->table_size; i++)
+		if(list->table[i].idx != 0)
+			hashtable_insert(new_table, new_size, list->table[i].hash, list->table[i].idx - 1);
+
+	if(list->table != NULL)
+		free(list->table);
+	list->table = new_table;
+	list->table_size = new_size;
+	return true;
+}
+
+// Append a new domain to a list, returns its index or -1 on error
+static int add_domain(domainIndex *list, const char *domain, const uint32_t hash)
+{
+	// Keep the load factor at or below 50%
+	if(2u*(list->domains + 1u) > list->table_size && !grow_table(list))
+		return -1;
+
+	if(list->domains >= list->domains_alloc)
+	{
+		const unsigned int new_alloc = list->domains_alloc > 0u ? 2u*list->domains_alloc : 1024u;
+		uint32_t *new_offsets = realloc(list->offsets, new_alloc*sizeof(uint32_t));
+		if(new_offsets == NULL)
+			return -1;
+		list->offsets = new_offsets;
+		uint64_t *new_bits = realloc(list->bits, (size_t)new_alloc*group_words*sizeof(uint64_t));
+		if(new_bits == NULL)
+			return -1;
+		list->bits = new_bits;
+		list->domains_alloc = new_alloc;
+	}
+
+	const size_t len = strlen(domain) + 1u;
+	if(list->strings_len + len > list->strings_alloc)
+	{
+		size_t new_alloc = list->strings_alloc > 0u ? 2u*list->strings_alloc : 16384u;
+		while(list->strings_len + len > new_alloc)
+			new_alloc *= 2u;
+		if(new_alloc > UINT32_MAX)
+			return -1;
+		char *new_strings = realloc(list->strings, new_alloc);
+		if(new_strings == NULL)
+			return -1;
+		list->strings = new_strings;
+		list->strings_alloc = new_alloc;
+	}
+
+	const int ID = list->domains++;
+	list->offsets[ID] = list->strings_len;
+	memcpy(list->strings + list->strings_len, domain, len);
+	list->strings_len += len;
+	memset(&list->bits[(size_t)ID*group_words], 0, group_words*sizeof(uint64_t));
+	hashtable_insert(list->table, list->table_size, hash, ID);
+
+	return ID;
+}
+
+static bool read_list(sqlite3 *db, const enum gravity_tables listID)
+{
+	domainIndex *list = &lists[listID];
+	char *querystr = NULL;
+	// Domains not assigned to any group never match (group_id IN (...) is
+	// never true for NULL) so we do not need to index them
+	if(asprintf(&querystr, "SELECT domain, group_id FROM %s WHERE group_id IS NOT NULL;", listviews[listID]) < 1)
+	{
+		logg("gravity_index_build(%s) - asprintf() error", listviews[listID]);
+		return false;
+	}
+
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	free(querystr);
+	if(rc != SQLITE_OK)
+	{
+		logg("gravity_index_build(%s) - SQL error prepare: %s", listviews[listID], sqlite3_errstr(rc));
+		return false;
+	}
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *domain = (const char*)sqlite3_column_text(stmt, 0);
+		const int bit = group_bit(sqlite3_column_int(stmt, 1));
+		if(domain == NULL || bit < 0)
+			continue;
+
+		// The same domain appears once per group it is assigned to
+		const uint32_t hash = hashStr(domain);
+		match_strings = list->strings;
+		match_offsets = list->offsets;
+		int ID = hashtable_find(list->table, list->table_size, hash, domain_matches, domain);
+		if(ID < 0 && (ID = add_domain(list, domain, hash)) < 0)
+		{
+			logg("gravity_index_build(%s): Memory allocation failed", listviews[listID]);
+			sqlite3_finalize(stmt);
+			return false;
+		}
+
+		list->bits[(size_t)ID*group_words + bit/64] |= 1ULL << (bit%64);
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("gravity_index_build(%s) - SQL error step: %s", listviews[listID], sqlite3_errstr(rc));
+		return false;
+	}
+
+	return true;
+}
+
+void gravity_index_free(void)
+{
+	for(unsigned int i = 0; i < NUM_INDEXED_LISTS; i++)
+	{
+		domainIndex *list = &lists[i];
+		if(list->table != NULL)
+			free(list->table);
+		if(list->offsets != NULL)
+			free(list->offsets);
+		if(list->bits != NULL)
+			free(list->bits);
+		if(list->strings != NULL)
+			free(list->strings);
+		memset(list, 0, sizeof(*list));
+		memset(&views[i], 0, sizeof(views[i]));
+	}
+
+	if(image != NULL)
+		munmap(image, image_size);
+	image = NULL;
+	image_size = 0u;
+
+	if(group_ids != NULL)
+		free(group_ids);
+	group_ids = NULL;
+	group_view = NULL;
+	num_groups = 0u;
+	group_words = 1u;
+
+	if(client_groups != NULL)
+		free(client_groups);
+	client_groups = NULL;
+	client_groups_size = 0u;
+
+	index_available = false;
+}
+
+// Read all lists from the database into memory
+static bool build_lists(sqlite3 *db)
+{
+	timer_start(LISTS_TIMER);
+	if(!read_groups(db))
+		return false;
+
+	size_t bytes = 0u;
+	for(unsigned int i = 0; i < NUM_INDEXED_LISTS; i++)
+	{
+		if(!read_list(db, i))
+			return false;
+		const domainIndex *list = &lists[i];
+		bytes += list->table_size*sizeof(hashSlot) +
+		         list->domains_alloc*(sizeof(uint32_t) + group_words*sizeof(uint64_t)) +
+		         list->strings_alloc;
+	}
+
+	logg("Compiled gravity index (%u gravity, %u blacklist, %u whitelist domains, %u groups) using %.1f MB in %.1f ms",
+	     lists[GRAVITY_TABLE].domains, lists[EXACT_BLACKLIST_TABLE].domains,
+	     lists[EXACT_WHITELIST_TABLE].domains, num_groups,
+	     1e-6*bytes, timer_elapsed_msec(LISTS_TIMER));
+
+	return true;
+}
+
+// (Re-)build the index in memory from the gravity database
+bool gravity_index_build(sqlite3 *db)
+{
+	gravity_index_free();
+	if(db == NULL)
+		return false;
+
+	if(!build_lists(db))
+	{
+		logg("WARNING: Building in-memory gravity index failed, using the database instead");
+		gravity_index_free();
+		return false;
+	}
+
+	for(unsigned int i = 0; i < NUM_INDEXED_LISTS; i++)
+	{
+		const domainIndex *list = &lists[i];
+		views[i].table = list->table;
+		views[i].table_size = list->table_size;
+		views[i].offsets = list->offsets;
+		views[i].bits = list->bits;
+		views[i].strings = list->strings;
+		views[i].domains = list->domains;
+	}
+
+	index_available = true;
+	return true;
+}
+
+static inline uint64_t align8(const uint64_t offset)
+{
+	return (offset + 7u) & ~(uint64_t)7u;
+}
+
+// Write a section of the image followed by padding up to the next multiple
+// of eight bytes
+static bool write_section(FILE *fp, const void *data, const size_t len)
+{
+	static const char zeros[8] = { 0 };
+	if(len > 0u && fwrite(data, 1, len, fp) != len)
+		return false;
+	const size_t pad = align8(len) - len;
+	return pad == 0u || fwrite(zeros, 1, pad, fp) == pad;
+}
+
+static bool write_image(const char *path, const struct stat *source)
+{
+	imageHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, GRAVITY_IMAGE_MAGIC, sizeof(header.magic));
+	header.version = GRAVITY_IMAGE_VERSION;
+	header.num_groups = num_groups;
+	header.group_words = group_words;
+	header.source_mtime_sec = source->st_mtim.tv_sec;
+	header.source_mtime_nsec = source->st_mtim.tv_nsec;
+	header.source_size = source->st_size;
+
+	uint64_t offset = align8(sizeof(header));
+	for(unsigned int i = 0; i < NUM_INDEXED_LISTS; i++)
+	{
+		const domainIndex *list = &lists[i];
+		imageList *il = &header.lists[i];
+		il->domains = list->domains;
+		il->table_size = list->table_size;
+		il->table_offset = offset;
+		offset += align8(list->table_size*sizeof(hashSlot));
+		il->offsets_offset = offset;
+		offset += align8(list->domains*sizeof(uint32_t));
+		il->bits_offset = offset;
+		offset += align8((uint64_t)list->domains*group_words*sizeof(uint64_t));
+		il->strings_offset = offset;
+		il->strings_len = list->strings_len;
+		offset += align8(list->strings_len);
+	}
+	header.groups_offset = offset;
+	offset += align8(num_groups*sizeof(int));
+	header.size = offset;
+
+	FILE *fp = fopen(path, "w");
+	if(fp == NULL)
+	{
+		logg("gravity_index_compile(): Cannot open %s for writing: %s", path, strerror(errno));
+		return false;
+	}
+
+	bool ok = write_section(fp, &header, sizeof(header));
+	for(unsigned int i = 0; i < NUM_INDEXED_LISTS && ok; i++)
+	{
+		const domainIndex *list = &lists[i];
+		ok = write_section(fp, list->table, list->table_size*sizeof(hashSlot)) &&
+		     write_section(fp, list->offsets, list->domains*sizeof(uint32_t)) &&
+		     write_section(fp, list->bits, (size_t)list->domains*group_words*sizeof(uint64_t)) &&
+		     write_section(fp, list->strings, list->strings_len);
+	}
+	ok = ok && write_section(fp, group_ids, num_groups*sizeof(int));
+
+	// Make sure the image is on disk before it replaces the old one
+	ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	if(fclose(fp) != 0)
+		ok = false;
+
+	if(!ok)
+		logg("gravity_index_compile(): Writing %s failed: %s", path, strerror(errno));
+
+	return ok;
+}
+
+// Compile the gravity database into an image file. The image is written to a
+// temporary file first and then renamed so that processes mapping the old
+// image are never exposed to a partially written file
+bool gravity_index_compile(const char *dbpath, const char *imagepath)
+{
+	struct stat st;
+	if(stat(dbpath, &st) != 0)
+	{
+		logg("gravity_index_compile(): %s does not exist", dbpath);
+		return false;
+	}
+
+	sqlite3 *db = NULL;
+	int rc = sqlite3_open_v2(dbpath, &db, SQLITE_OPEN_READONLY, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("gravity_index_compile(): Cannot open %s: %s", dbpath, sqlite3_errstr(rc));
+		sqlite3_close(db);
+		return false;
+	}
+
+	gravity_index_free();
+	bool ok = build_lists(db);
+	sqlite3_close(db);
+
+	char *tmppath = NULL;
+	if(ok && asprintf(&tmppath, "%s.tmp", imagepath) < 1)
+		ok = false;
+
+	if(ok && !write_image(tmppath, &st))
+	{
+		unlink(tmppath);
+		ok = false;
+	}
+
+	if(ok && rename(tmppath, imagepath) != 0)
+	{
+		logg("gravity_index_compile(): Cannot rename %s to %s: %s", tmppath, imagepath, strerror(errno));
+		unlink(tmppath);
+		ok = false;
+	}
+
+	if(ok)
+		logg("Stored gravity image in %s", imagepath);
+
+	if(tmppath != NULL)
+		free(tmppath);
+	gravity_index_free();
+	return ok;
+}
+
+// Check that a section lies entirely within the mapped image
+static inline bool in_image(const uint64_t offset, const uint64_t len)
+{
+	return offset <= image_size && len <= image_size - offset && offset % 8u == 0u;
+}
+
+// Sections are aligned to eight bytes within the page-aligned mapping
+static inline const void *image_at(const uint64_t offset)
+{
+	return (const char*)image + offset;
+}
+
+// Map a precompiled image of the lists into memory. Returns false if there
+// is no image or the image does not correspond to the current database
+bool gravity_index_load_image(const char *imagepath, const char *dbpath)
+{
+	gravity_index_free();
+
+	struct stat st, source;
+	const int fd = open(imagepath, O_RDONLY);
+	if(fd < 0)
+	{
+		if(config.debug & DEBUG_DATABASE)
+			logg("gravity_index_load_image(): No image at %s", imagepath);
+		return false;
+	}
+
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(imageHeader))
+	{
+		logg("WARNING: Ignoring invalid gravity image %s", imagepath);
+		close(fd);
+		return false;
+	}
+
+	image_size = st.st_size;
+	image = mmap(NULL, image_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(image == MAP_FAILED)
+	{
+		logg("WARNING: Cannot map gravity image %s: %s", imagepath, strerror(errno));
+		image = NULL;
+		image_size = 0u;
+		return false;
+	}
+
+	// Domains are looked up in random order, don't read ahead
+	madvise(image, image_size, MADV_RANDOM);
+
+	const imageHeader *header = image;
+	bool valid = memcmp(header->magic, GRAVITY_IMAGE_MAGIC, sizeof(header->magic)) == 0 &&
+	             header->version == GRAVITY_IMAGE_VERSION &&
+	             header->size == image_size &&
+	             header->group_words == (header->num_groups > 0u ? (header->num_groups + 63u)/64u : 1u) &&
+	             in_image(header->groups_offset, header->num_groups*sizeof(int));
+	for(unsigned int i = 0; i < NUM_INDEXED_LISTS && valid; i++)
+	{
+		const imageList *il = &header->lists[i];
+		valid = (il->table_size & (il->table_size - 1u)) == 0u &&
+		        il->table_size >= 2u*il->domains &&
+		        in_image(il->table_offset, il->table_size*sizeof(hashSlot)) &&
+		        in_image(il->offsets_offset, il->domains*sizeof(uint32_t)) &&
+		        in_image(il->bits_offset, (uint64_t)il->domains*header->group_words*sizeof(uint64_t)) &&
+		        in_image(il->strings_offset, il->strings_len) &&
+		        (il->strings_len == 0u || ((const char*)image)[il->strings_offset + il->strings_len - 1u] == '\0');
+	}
+	if(!valid)
+	{
+		logg("WARNING: Ignoring invalid gravity image %s", imagepath);
+		gravity_index_free();
+		return false;
+	}
+
+	// The image is outdated when the database changed since it was compiled
+	if(stat(dbpath, &source) != 0 ||
+	   source.st_mtim.tv_sec != header->source_mtime_sec ||
+	   source.st_mtim.tv_nsec != header->source_mtime_nsec ||
+	   (uint64_t)source.st_size != header->source_size)
+	{
+		logg("WARNING: Ignoring outdated gravity image %s, run pihole-FTL gravity-compile", imagepath);
+		gravity_index_free();
+		return false;
+	}
+
+	num_groups = header->num_groups;
+	group_words = header->group_words;
+	group_view = image_at(header->groups_offset);
+	for(unsigned int i = 0; i < NUM_INDEXED_LISTS; i++)
+	{
+		const imageList *il = &header->lists[i];
+		views[i].table = image_at(il->table_offset);
+		views[i].table_size = il->table_size;
+		views[i].offsets = image_at(il->offsets_offset);
+		views[i].bits = image_at(il->bits_offset);
+		views[i].strings = image_at(il->strings_offset);
+		views[i].domains = il->domains;
+	}
+
+	logg("Mapped gravity image %s (%u gravity, %u blacklist, %u whitelist domains, %u groups, %.1f MB)",
+	     imagepath, views[GRAVITY_TABLE].domains, views[EXACT_BLACKLIST_TABLE].domains,
+	     views[EXACT_WHITELIST_TABLE].domains, num_groups, 1e-6*image_size);
+
+	index_available = true;
+	return true;
+}
+
+bool __attribute__((pure)) gravity_index_available(void)
+{
+	return index_available;
+}
+
+// Store the groups (comma-separated list of group IDs) of a client
+void gravity_index_set_client(const int clientID, const char *groups)
+{
+	if(!index_available || clientID < 0)
+		return;
+
+	if((unsigned int)clientID >= client_groups_size)
+	{
+		unsigned int new_size = client_groups_size > 0u ? client_groups_size : 64u;
+		while((unsigned int)clientID >= new_size)
+			new_size *= 2u;
+		uint64_t *new_groups = realloc(client_groups, (size_t)new_size*group_words*sizeof(uint64_t));
+		if(new_groups == NULL)
+			return;
+		memset(&new_groups[(size_t)client_groups_size*group_words], 0,
+		       (size_t)(new_size - client_groups_size)*group_words*sizeof(uint64_t));
+		client_groups = new_groups;
+		client_groups_size = new_size;
+	}
+
+	uint64_t *mask = &client_groups[(size_t)clientID*group_words];
+	memset(mask, 0, group_words*sizeof(uint64_t));
+	for(const char *p = groups; p != NULL && *p != '\0'; p = strchr(p, ','))
+	{
+		if(*p == ',')
+			p++;
+		const int bit = group_bit(atoi(p));
+		if(bit >= 0)
+			mask[bit/64] |= 1ULL << (bit%64);
+	}
+}
+
+// Check if a domain is on the given list for any group of the client
+bool gravity_index_lookup(const enum gravity_tables listID, const char *domain, const int clientID)
+{
+	if(!index_available || listID >= NUM_INDEXED_LISTS ||
+	   clientID < 0 || (unsigned int)clientID >= client_groups_size)
+		return false;
+
+	const domainView *list = &views[listID];
+	match_strings = list->strings;
+	match_offsets = list->offsets;
+	const int ID = hashtable_find(list->table, list->table_size, hashStr(domain), domain_matches, domain);
+	if(ID < 0)
+		return false;
+
+	const uint64_t *bits = &list->bits[(size_t)ID*group_words];
+	const uint64_t *mask = &client_groups[(size_t)clientID*group_words];
+	for(unsigned int i = 0; i < group_words; i++)
+		if(bits[i] & mask[i])
+			return true;
+
+	return false;
+}
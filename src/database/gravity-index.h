@@ -0,0 +1,26 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2020 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory gravity index prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef GRAVITY_INDEX_H
+#define GRAVITY_INDEX_H
+
+#include <stdbool.h>
+#include "database/sqlite3.h"
+// enum gravity_tables
+#include "database/gravity-db.h"
+
+bool gravity_index_build(sqlite3 *db);
+bool gravity_index_compile(const char *dbpath, const char *imagepath);
+bool gravity_index_load_image(const char *imagepath, const char *dbpath);
+void gravity_index_free(void);
+bool gravity_index_available(void) __attribute__((pure));
+void gravity_index_set_client(const int clientID, const char *groups);
+bool gravity_index_lookup(const enum gravity_tables list, const char *domain, const int clientID);
+
+#endif //GRAVITY_INDEX_H
@@ -106,26 +106,27 @@ bool create_network_addresses_table(void)
 	return true;
 }
 
+// Run a (cached) statement with a single text argument returning an integer
+static int query_int_text(const char *querystr, const char *arg)
+{
+	sqlite3_stmt *stmt = db_prepare_cached(querystr);
+	if(stmt == NULL)
+		return DB_FAILED;
+
+	// SQLITE_STATIC: arg outlives the statement execution below
+	sqlite3_bind_text(stmt, 1, arg, -1, SQLITE_STATIC);
+	return db_query_int_stmt(stmt);
+}
+
 // Try to find device by recent usage of this IP address
 static int find_device_by_recent_ip(const char *ipaddr)
 {
-	char *querystr = NULL;
-	int ret = asprintf(&querystr,
-	                   "SELECT network_id FROM network_addresses "
-	                   "WHERE ip = \'%s\' AND "
-	                   "lastSeen > (cast(strftime('%%s', 'now') as int)-86400) "
-	                   "ORDER BY lastSeen DESC LIMIT 1;",
-	                   ipaddr);
-	if(querystr == NULL || ret < 0)
-	{
-		logg("Memory allocation failed in find_device_by_recent_ip(\"%s\"): %i",
-		     ipaddr, ret);
-		return -1;
-	}
-
 	// Perform SQL query
-	int network_id = db_query_int(querystr);
-	free(querystr);
+	int network_id = query_int_text("SELECT network_id FROM network_addresses "
+	                                "WHERE ip = ? AND "
+	                                "lastSeen > (cast(strftime('%s', 'now') as int)-86400) "
+	                                "ORDER BY lastSeen DESC LIMIT 1;",
+	                                ipaddr);
 
 	if(network_id == DB_FAILED)
 	{
@@ -148,43 +149,18 @@ static int find_device_by_recent_ip(const char *ipaddr)
 // Try to find device by mock hardware address (generated from IP address)
 static int find_device_by_mock_hwaddr(const char *ipaddr)
 {
-	char *querystr = NULL;
-	int ret = asprintf(&querystr, "SELECT id FROM network WHERE hwaddr = \'ip-%s\';", ipaddr);
-	if(querystr == NULL || ret < 0)
-	{
-		logg("Memory allocation failed in find_device_by_mock_hwaddr(\"%s\"): %i",
-		     ipaddr, ret);
-		return -1;
-	}
-
 	// Perform SQL query
-	int network_id = db_query_int(querystr);
-	free(querystr);
-
-	return network_id;
+	return query_int_text("SELECT id FROM network WHERE hwaddr = 'ip-' || ?;", ipaddr);
 }
 
 // Try to find device by RECENT mock hardware address (generated from IP address)
 static int find_recent_device_by_mock_hwaddr(const char *ipaddr)
 {
-	char *querystr = NULL;
-	int ret = asprintf(&querystr,
-	                   "SELECT id FROM network WHERE "
-	                   "hwaddr = \'ip-%s\' AND "
-	                   "firstSeen > (cast(strftime('%%s', 'now') as int)-3600);",
-	                   ipaddr);
-	if(querystr == NULL || ret < 0)
-	{
-		logg("Memory allocation failed in find_device_by_recent_mock_hwaddr(\"%s\"): %i",
-		     ipaddr, ret);
-		return -1;
-	}
-
 	// Perform SQL query
-	int network_id = db_query_int(querystr);
-	free(querystr);
-
-	return network_id;
+	return query_int_text("SELECT id FROM network WHERE "
+	                      "hwaddr = 'ip-' || ? AND "
+	                      "firstSeen > (cast(strftime('%s', 'now') as int)-3600);",
+	                      ipaddr);
 }
 
 // Store hostname of device identified by dbID
@@ -194,15 +170,15 @@ static int update_netDB_hostname(const int dbID, const char *hostname)
 	if(hostname == NULL || strlen(hostname) < 1)
 		return SQLITE_OK;
 
-	sqlite3_stmt *query_stmt = NULL;
-	const char querystr[] = "UPDATE network SET name = ? WHERE id = ?;";
+	static const char querystr[] = "UPDATE network SET name = ? WHERE id = ?;";
 
-	int rc = sqlite3_prepare_v2(FTL_db, querystr, -1, &query_stmt, NULL);
-	if(rc != SQLITE_OK)
+	int rc;
+	sqlite3_stmt *query_stmt = db_prepare_cached(querystr);
+	if(query_stmt == NULL)
 	{
-		logg("update_netDB_hostname(%i, \"%s\") - SQL error prepare (%i): %s",
-		     dbID, hostname, rc, sqlite3_errmsg(FTL_db));
-		return rc;
+		logg("update_netDB_hostname(%i, \"%s\") - SQL error prepare: %s",
+		     dbID, hostname, sqlite3_errmsg(FTL_db));
+		return sqlite3_errcode(FTL_db);
 	}
 
 	if(config.debug & DEBUG_DATABASE)
@@ -217,7 +193,7 @@ static int update_netDB_hostname(const int dbID, const char *hostname)
 	{
 		logg("update_netDB_hostname(%i, \"%s\"): Failed to bind hostname (error %d): %s",
 		     dbID, hostname, rc, sqlite3_errmsg(FTL_db));
-		sqlite3_reset(query_stmt);
+		db_release_stmt(query_stmt);
 		return rc;
 	}
 
@@ -226,13 +202,13 @@ static int update_netDB_hostname(const int dbID, const char *hostname)
 	{
 		logg("update_netDB_hostname(%i, \"%s\"): Failed to bind dbID (error %d): %s",
 		     dbID, hostname, rc, sqlite3_errmsg(FTL_db));
-		sqlite3_reset(query_stmt);
+		db_release_stmt(query_stmt);
 		return rc;
 	}
 
 	// Perform step
 	sqlite3_step(query_stmt);
-	sqlite3_finalize(query_stmt);
+	db_release_stmt(query_stmt);
 
 	return SQLITE_OK;
 }
@@ -246,10 +222,15 @@ static int update_netDB_lastQuery(const int dbID, const clientsData* client)
 	if(client->lastQuery < 1)
 		return SQLITE_OK;
 
-	return dbquery("UPDATE network "\
-	               "SET lastQuery = MAX(lastQuery, %ld) "\
-	               "WHERE id = %i;",
-	               client->lastQuery, dbID);
+	sqlite3_stmt *stmt = db_prepare_cached("UPDATE network "
+	                                       "SET lastQuery = MAX(lastQuery, ?) "
+	                                       "WHERE id = ?;");
+	if(stmt == NULL)
+		return sqlite3_errcode(FTL_db);
+
+	sqlite3_bind_int64(stmt, 1, client->lastQuery);
+	sqlite3_bind_int(stmt, 2, dbID);
+	return db_step_stmt(stmt);
 }
 
 
@@ -264,10 +245,15 @@ static int update_netDB_numQueries(const int dbID, clientsData* client)
 	int numQueries = client->numQueriesARP;
 	client->numQueriesARP = 0;
 
-	return dbquery("UPDATE network "\
-	              "SET numQueries = numQueries + %u "\
-	              "WHERE id = %i;",
-	              numQueries, dbID);
+	sqlite3_stmt *stmt = db_prepare_cached("UPDATE network "
+	                                       "SET numQueries = numQueries + ? "
+	                                       "WHERE id = ?;");
+	if(stmt == NULL)
+		return sqlite3_errcode(FTL_db);
+
+	sqlite3_bind_int(stmt, 1, numQueries);
+	sqlite3_bind_int(stmt, 2, dbID);
+	return db_step_stmt(stmt);
 }
 
 
@@ -278,9 +264,14 @@ static int update_netDB_numQueries(const int dbID, clientsData* client)
 // lastQuery timestamp to be updated
 static int add_netDB_network_address(const int dbID, const char* ipaddr)
 {
-	return dbquery("INSERT OR REPLACE INTO network_addresses "\
-	               "(network_id,ip,lastSeen) VALUES (%i,\'%s\',(cast(strftime('%%s', 'now') as int)));",
-	               dbID, ipaddr);
+	sqlite3_stmt *stmt = db_prepare_cached("INSERT OR REPLACE INTO network_addresses "
+	                                       "(network_id,ip,lastSeen) VALUES (?,?,(cast(strftime('%s', 'now') as int)));");
+	if(stmt == NULL)
+		return sqlite3_errcode(FTL_db);
+
+	sqlite3_bind_int(stmt, 1, dbID);
+	sqlite3_bind_text(stmt, 2, ipaddr, -1, SQLITE_STATIC);
+	return db_step_stmt(stmt);
 }
 
 // Parse kernel's neighbor cache
@@ -394,17 +385,7 @@ void parse_neighbor_cache(void)
 		// only the changed to the database are collected for latter
 		// commitment. Read-only access such as this SELECT command will be
 		// executed immediately on the database.
-		char* querystr = NULL;
-		rc = asprintf(&querystr, "SELECT id FROM network WHERE hwaddr = \'%s\';", hwaddr);
-		if(querystr == NULL || rc < 0)
-		{
-			logg("Memory allocation failed in parse_arp_cache(): %i", rc);
-			break;
-		}
-
-		// Perform SQL query
-		int dbID = db_query_int(querystr);
-		free(querystr);
+		int dbID = query_int_text("SELECT id FROM network WHERE hwaddr = ?;", hwaddr);
 
 		if(dbID == DB_FAILED)
 		{
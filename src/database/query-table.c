@@ -23,6 +23,8 @@
 #include "config.h"
 // getstr()
 #include "shmem.h"
+// toplist_update()
+#include "toplist.h"
 
 static bool saving_failed_before = false;
 
@@ -44,23 +46,120 @@ int get_number_of_queries_in_DB(void)
 	return result;
 }
 
-void DB_save_queries(void)
+// A query copied out of shared memory for storing it in the database
+typedef struct {
+	long int queryID;
+	long int dbID;
+	time_t timestamp;
+	int type;
+	int status;
+	char *domain;
+	char *client;
+	char *forward;
+} queryRow;
+
+// Batch of queries to be stored, re-used across runs to avoid reallocations
+static queryRow *batch = NULL;
+static unsigned int batch_size = 0u;
+
+static bool is_blocked(const int status)
 {
-	// Start database timer
-	if(config.debug & DEBUG_DATABASE)
-		timer_start(DATABASE_WRITE_TIMER);
+	return status == QUERY_GRAVITY ||
+	       status == QUERY_BLACKLIST ||
+	       status == QUERY_REGEX ||
+	       status == QUERY_EXTERNAL_BLOCKED_IP ||
+	       status == QUERY_EXTERNAL_BLOCKED_NULL ||
+	       status == QUERY_EXTERNAL_BLOCKED_NXRA ||
+	       status == QUERY_GRAVITY_CNAME ||
+	       status == QUERY_REGEX_CNAME ||
+	       status == QUERY_BLACKLIST_CNAME;
+}
 
-	// Open database
+// Copy all queries not yet stored in the database into the batch buffer. The
+// caller has to hold the shared memory lock. Returns the number of copied
+// queries, *stopID is set to the ID of the first query not looked at
+static unsigned int copy_pending_queries(long int *stopID)
+{
+	unsigned int num = 0u;
+	const time_t currenttimestamp = time(NULL);
+	const long int nextID = counters->queries_first + counters->queries;
+	long int queryID;
+	for(queryID = MAX(counters->queries_first, lastdbindex); queryID < nextID; queryID++)
+	{
+		const queriesData* query = getQuery(queryID, true);
+		if(query->db)
+		{
+			// Skip, already saved in database
+			continue;
+		}
+
+		if(!query->complete && query->timestamp > currenttimestamp-2)
+		{
+			// Break if a brand new query (age < 2 seconds) is not yet completed
+			// giving it a chance to be stored next time
+			break;
+		}
+
+		if(query->privacylevel >= PRIVACY_MAXIMUM)
+		{
+			// Skip, we never store nor count queries recorded
+			// while have been in maximum privacy mode in the database
+			continue;
+		}
+
+		// Grow batch buffer geometrically if needed
+		if(num >= batch_size)
+		{
+			const unsigned int new_size = batch_size > 0u ? 2u*batch_size : 256u;
+			queryRow *new_batch = realloc(batch, new_size*sizeof(queryRow));
+			if(new_batch == NULL)
+				break;
+			batch = new_batch;
+			batch_size = new_size;
+		}
+
+		queryRow *row = &batch[num++];
+		row->queryID = queryID;
+		row->dbID = 0;
+		row->timestamp = query->timestamp;
+		row->type = query->type;
+		row->status = query->status;
+		row->domain = strdup(getDomainString(query));
+		row->client = strdup(getClientIPString(query));
+		row->forward = NULL;
+		if(query->status == QUERY_FORWARDED && query->upstreamID > -1)
+		{
+			// Get forward pointer
+			const upstreamsData* upstream = getUpstream(query->upstreamID, true);
+			row->forward = strdup(getstr(upstream->ippos));
+		}
+	}
+
+	*stopID = queryID;
+	return num;
+}
+
+static void free_batch(const unsigned int num)
+{
+	for(unsigned int i = 0; i < num; i++)
+	{
+		free(batch[i].domain);
+		free(batch[i].client);
+		if(batch[i].forward != NULL)
+			free(batch[i].forward);
+	}
+}
+
+// Write the copied queries to the database. Returns the number of stored
+// queries or -1 on error (nothing has been stored in this case)
+static int store_batch(const unsigned int num)
+{
 	if(!dbopen())
 	{
 		logg("Failed to open long-term database when trying to store queries");
-		return;
+		return -1;
 	}
 
-	unsigned int saved = 0;
-	bool error = false;
-	sqlite3_stmt* stmt = NULL;
-
 	int rc = dbquery("BEGIN TRANSACTION IMMEDIATE");
 	if( rc != SQLITE_OK )
 	{
@@ -77,13 +176,15 @@ void DB_save_queries(void)
 		}
 
 		logg("%s: Storing queries in long-term database failed: %s", text, sqlite3_errstr(rc));
+		saving_failed_before = true;
 		dbclose();
-		return;
+		return -1;
 	}
 
-	rc = sqlite3_prepare_v2(FTL_db, "INSERT INTO queries VALUES (NULL,?,?,?,?,?,?)", -1, &stmt, NULL);
-	if( rc != SQLITE_OK )
+	sqlite3_stmt *stmt = db_prepare_cached("INSERT INTO queries VALUES (NULL,?,?,?,?,?,?)");
+	if( stmt == NULL )
 	{
+		rc = sqlite3_errcode(FTL_db);
 		const char *text, *spaces;
 		if( rc == SQLITE_BUSY )
 		{
@@ -103,67 +204,39 @@ void DB_save_queries(void)
 		logg("%s  Keeping queries in memory for later new attempt", spaces);
 		saving_failed_before = true;
 		dbclose();
-		return;
+		return -1;
 	}
 
 	// Get last ID stored in the database
 	long int lastID = get_max_query_ID();
 
 	int total = 0, blocked = 0;
-	time_t currenttimestamp = time(NULL);
 	time_t newlasttimestamp = 0;
-	long int queryID;
-	for(queryID = MAX(0, lastdbindex); queryID < counters->queries; queryID++)
+	unsigned int saved = 0;
+	for(saved = 0; saved < num; saved++)
 	{
-		queriesData* query = getQuery(queryID, true);
-		if(query->db != 0)
-		{
-			// Skip, already saved in database
-			continue;
-		}
-
-		if(!query->complete && query->timestamp > currenttimestamp-2)
-		{
-			// Break if a brand new query (age < 2 seconds) is not yet completed
-			// giving it a chance to be stored next time
-			break;
-		}
-
-		if(query->privacylevel >= PRIVACY_MAXIMUM)
-		{
-			// Skip, we never store nor count queries recorded
-			// while have been in maximum privacy mode in the database
-			continue;
-		}
+		queryRow *row = &batch[saved];
 
 		// TIMESTAMP
-		sqlite3_bind_int(stmt, 1, query->timestamp);
+		sqlite3_bind_int(stmt, 1, row->timestamp);
 
 		// TYPE
-		sqlite3_bind_int(stmt, 2, query->type);
+		sqlite3_bind_int(stmt, 2, row->type);
 
 		// STATUS
-		sqlite3_bind_int(stmt, 3, query->status);
+		sqlite3_bind_int(stmt, 3, row->status);
 
 		// DOMAIN
-		const char *domain = getDomainString(query);
-		sqlite3_bind_text(stmt, 4, domain, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, row->domain, -1, SQLITE_STATIC);
 
 		// CLIENT
-		const char *client = getClientIPString(query);
-		sqlite3_bind_text(stmt, 5, client, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 5, row->client, -1, SQLITE_STATIC);
 
 		// FORWARD
-		if(query->status == QUERY_FORWARDED && query->upstreamID > -1)
-		{
-			// Get forward pointer
-			const upstreamsData* upstream = getUpstream(query->upstreamID, true);
-			sqlite3_bind_text(stmt, 6, getstr(upstream->ippos), -1, SQLITE_STATIC);
-		}
+		if(row->forward != NULL)
+			sqlite3_bind_text(stmt, 6, row->forward, -1, SQLITE_STATIC);
 		else
-		{
 			sqlite3_bind_null(stmt, 6);
-		}
 
 		// Step and check if successful
 		rc = sqlite3_step(stmt);
@@ -173,49 +246,33 @@ void DB_save_queries(void)
 		if( rc != SQLITE_DONE )
 		{
 			logg("Encountered error while trying to store queries in long-term database: %s", sqlite3_errstr(rc));
-			error = true;
 			break;
 		}
 
-		saved++;
-		// Mark this query as saved in the database by setting the corresponding ID
-		query->db = ++lastID;
+		// Remember the ID this query got in the database
+		row->dbID = ++lastID;
 
 		// Total counter information (delta computation)
 		total++;
-		if(query->status == QUERY_GRAVITY ||
-		   query->status == QUERY_BLACKLIST ||
-		   query->status == QUERY_REGEX ||
-		   query->status == QUERY_EXTERNAL_BLOCKED_IP ||
-		   query->status == QUERY_EXTERNAL_BLOCKED_NULL ||
-		   query->status == QUERY_EXTERNAL_BLOCKED_NXRA ||
-		   query->status == QUERY_GRAVITY_CNAME ||
-		   query->status == QUERY_REGEX_CNAME ||
-		   query->status == QUERY_BLACKLIST_CNAME)
+		if(is_blocked(row->status))
 			blocked++;
 
 		// Update lasttimestamp variable with timestamp of the latest stored query
-		if(query->timestamp > newlasttimestamp)
-			newlasttimestamp = query->timestamp;
+		if(row->timestamp > newlasttimestamp)
+			newlasttimestamp = row->timestamp;
 	}
 
-	if((rc = sqlite3_finalize(stmt)) != SQLITE_OK)
-	{
-		logg("Statement finalization failed when trying to store queries to long-term database: %s",
-		     sqlite3_errstr(rc));
-
-		if( rc == SQLITE_BUSY )
-		{
-			logg("Keeping queries in memory for later new attempt");
-			saving_failed_before = true;
-		}
-		else
-		{
-			database = false;
-		}
+	// Hand the statement back to the cache for the next run
+	db_release_stmt(stmt);
 
+	// Roll back if not all queries could be stored so that they will be
+	// retried as a whole next time
+	if(saved < num)
+	{
+		dbquery("ROLLBACK");
+		saving_failed_before = true;
 		dbclose();
-		return;
+		return -1;
 	}
 
 	// Finish prepared statement
@@ -235,14 +292,12 @@ void DB_save_queries(void)
 		}
 
 		dbclose();
-		return;
+		return -1;
 	}
 
-	// Store index for next loop interation round and update last time stamp
-	// in the database only if all queries have been saved successfully
-	if(saved > 0 && !error)
+	// Update last time stamp in the database
+	if(saved > 0)
 	{
-		lastdbindex = queryID;
 		db_set_FTL_property(DB_LASTTIMESTAMP, newlasttimestamp);
 		db_update_counters(total, blocked);
 	}
@@ -250,10 +305,67 @@ void DB_save_queries(void)
 	// Close database
 	dbclose();
 
-	if(config.debug & DEBUG_DATABASE || saving_failed_before)
+	return saved;
+}
+
+// Store all new queries in the long-term database. The shared memory lock is
+// only held while copying the queries and while marking them as saved
+// afterwards but not during the (potentially slow) database transaction
+void DB_save_queries(void)
+{
+	// Start database timer
+	if(config.debug & DEBUG_DATABASE)
+		timer_start(DATABASE_WRITE_TIMER);
+
+	// Copy pending queries under the lock
+	if(config.debug & DEBUG_DATABASE)
+		timer_start(DATABASE_LOCK_TIMER);
+	lock_shm_read();
+	long int stopID = 0;
+	const long int startindex = lastdbindex;
+	const unsigned int num = copy_pending_queries(&stopID);
+	unlock_shm_read();
+	double locked = 0.0;
+	if(config.debug & DEBUG_DATABASE)
+		locked = timer_elapsed_msec(DATABASE_LOCK_TIMER);
+
+	// Store queries without holding the lock
+	const int saved = num > 0u ? store_batch(num) : 0;
+
+	if(saved > 0)
+	{
+		// Mark queries as saved in the database by setting the
+		// corresponding ID. Queries may have been removed by the
+		// garbage collector in the meantime, skip them
+		if(config.debug & DEBUG_DATABASE)
+			timer_start(DATABASE_LOCK_TIMER);
+		lock_shm();
+		// The garbage collector may have shifted all IDs (including
+		// lastdbindex) down while we were not holding the lock
+		const long int offset = startindex - lastdbindex;
+		for(int i = 0; i < saved; i++)
+		{
+			const long int queryID = batch[i].queryID - offset;
+			if(queryID < counters->queries_first)
+				continue;
+			queriesData* query = getQuery(queryID, true);
+			if(query != NULL)
+				query->db = batch[i].dbID != 0;
+		}
+
+		// Store index for next loop interation round
+		lastdbindex = stopID - offset;
+		unlock_shm();
+		if(config.debug & DEBUG_DATABASE)
+			locked += timer_elapsed_msec(DATABASE_LOCK_TIMER);
+	}
+	free_batch(num);
+
+	if(config.debug & DEBUG_DATABASE || (saving_failed_before && saved > 0))
 	{
-		logg("Notice: Queries stored in long-term database: %u (took %.1f ms, last SQLite ID %li)", saved, timer_elapsed_msec(DATABASE_WRITE_TIMER), lastID);
-		if(saving_failed_before)
+		logg("Notice: Queries stored in long-term database: %i (took %.1f ms, shared memory locked for %.1f ms)",
+		     saved > 0 ? saved : 0, timer_elapsed_msec(DATABASE_WRITE_TIMER), locked);
+		if(saving_failed_before && saved > 0)
 		{
 			logg("        Queries from earlier attempt(s) stored successfully");
 			saving_failed_before = false;
@@ -405,7 +517,7 @@ void DB_read_queries(void)
 		memory_check(QUERIES);
 
 		// Set index for this query
-		const int queryIndex = counters->queries;
+		const int queryIndex = counters->queries_first + counters->queries;
 
 		// Store this query in memory
 		queriesData* query = getQuery(queryIndex, false);
@@ -416,8 +528,8 @@ void DB_read_queries(void)
 		query->domainID = domainID;
 		query->clientID = clientID;
 		query->upstreamID = upstreamID;
-		query->timeidx = timeidx;
-		query->db = dbid;
+		setQueryTimeIdx(query, timeidx);
+		query->db = dbid != 0;
 		query->id = 0;
 		query->complete = true; // Mark as all information is available
 		query->response = 0;
@@ -425,6 +537,9 @@ void DB_read_queries(void)
 		query->reply = REPLY_UNKNOWN;
 		query->CNAME_domainID = -1;
 
+		// Add query to the lists of queries of its domain and client
+		add_query_postings(queryIndex);
+
 		// Set lastQuery timer for network table
 		clientsData* client = getClient(clientID, true);
 		client->lastQuery = queryTimeStamp;
@@ -465,6 +580,8 @@ void DB_read_queries(void)
 				domainsData* domain = getDomain(domainID, true);
 				domain->blockedcount++;
 				client->blockedcount++;
+				toplist_update(TOPLIST_ADS, domainID);
+				toplist_update(TOPLIST_CLIENTS_BLOCKED, clientID);
 				// Update overTime data structure
 				overTime[timeidx].blocked++;
 				break;
@@ -492,7 +609,7 @@ void DB_read_queries(void)
 
 	// Update lastdbindex so that the next call to DB_save_queries()
 	// skips the queries that we just imported from the database
-	lastdbindex = counters->queries;
+	lastdbindex = counters->queries_first + counters->queries;
 
 	if( rc != SQLITE_DONE ){
 		logg("DB_read_queries() - SQL error step: %s", sqlite3_errstr(rc));
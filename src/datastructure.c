@@ -13,6 +13,8 @@
 #include "memory.h"
 #include "shmem.h"
 #include "log.h"
+// toplist_update()
+#include "toplist.h"
 // enum REGEX
 #include "regex_r.h"
 #include "database/gravity-db.h"
@@ -82,28 +84,33 @@ int findUpstreamID(const char * upstreamString, const bool count)
 	return upstreamID;
 }
 
-int findDomainID(const char *domainString, const bool count)
+// Hash index callback: does the domain with the given ID match the string?
+static bool domain_matches(const int domainID, const void *domainString)
 {
-	for(int domainID = 0; domainID < counters->domains; domainID++)
-	{
-		// Get domain pointer
-		domainsData* domain = getDomain(domainID, true);
+	// Get domain pointer
+	const domainsData* domain = getDomain(domainID, true);
 
-		// Check if the returned pointer is valid before trying to access it
-		if(domain == NULL)
-			continue;
+	// Check if the returned pointer is valid before trying to access it
+	if(domain == NULL)
+		return false;
 
-		// Quick test: Does the domain start with the same character?
-		if(getstr(domain->domainpos)[0] != domainString[0])
-			continue;
+	return strcmp(getstr(domain->domainpos), domainString) == 0;
+}
 
-		// If so, compare the full domain using strcmp
-		if(strcmp(getstr(domain->domainpos), domainString) == 0)
+int findDomainID(const char *domainString, const bool count)
+{
+	// Look up domain in the hash index. The domain string has already
+	// been converted to lower case by our callers
+	const uint32_t domainhash = hashStr(domainString);
+	const int knownID = lookup_hash(DOMAINS, domainhash, domain_matches, domainString);
+	if(knownID > -1)
+	{
+		if(count)
 		{
-			if(count)
-				domain->count++;
-			return domainID;
+			getDomain(knownID, true)->count++;
+			toplist_update(TOPLIST_DOMAINS, knownID);
 		}
+		return knownID;
 	}
 
 	// If we did not return until here, then this domain is not known
@@ -128,44 +135,54 @@ int findDomainID(const char *domainString, const bool count)
 	domain->count = count ? 1 : 0;
 	// Set blocked counter to zero
 	domain->blockedcount = 0;
+	// No queries recorded so far
+	domain->queries.first = domain->queries.last = -1;
+	// Not yet in any top list
+	domain->in_toplists = 0;
 	// Store domain name - no need to check for NULL here as it doesn't harm
 	domain->domainpos = addstr(domainString);
+	// Store hash and add domain to the hash index
+	domain->domainhash = domainhash;
+	insert_hash(DOMAINS, domainhash, domainID);
 	// Increase counter by one
 	counters->domains++;
 
+	if(count)
+		toplist_update(TOPLIST_DOMAINS, domainID);
+
 	return domainID;
 }
 
-int findClientID(const char *clientIP, const bool count)
+// Look up a domain in the hash index without adding it. This does not
+// modify shared memory and is, hence, safe to call under the read lock
+int lookupDomainID(const char *domainString)
 {
-	// Compare content of client against known client IP addresses
-	for(int clientID=0; clientID < counters->clients; clientID++)
-	{
-		// Get client pointer
-		clientsData* client = getClient(clientID, true);
+	return lookup_hash(DOMAINS, hashStr(domainString), domain_matches, domainString);
+}
 
-		// Check if the returned pointer is valid before trying to access it
-		if(client == NULL)
-			continue;
+// Key used for looking up clients in the hash index
+typedef struct {
+	sa_family_t family;
+	struct in6_addr addr;
+} clientKey;
 
-		// Quick test: Does the clients IP start with the same character?
-		if(getstr(client->ippos)[0] != clientIP[0])
-			continue;
+// Hash index callback: does the client with the given ID have this address?
+static bool client_matches(const int clientID, const void *key)
+{
+	// Get client pointer
+	const clientsData* client = getClient(clientID, true);
+	const clientKey *ckey = key;
 
-		// If so, compare the full IP using strcmp
-		if(strcmp(getstr(client->ippos), clientIP) == 0)
-		{
-			// Add one if count == true (do not add one, e.g., during ARP table processing)
-			if(count) client->count++;
-			return clientID;
-		}
-	}
+	// Check if the returned pointer is valid before trying to access it
+	if(client == NULL)
+		return false;
 
-	// Return -1 (= not found) if count is false because we do not want to create a new client here
-	if(!count)
-		return -1;
+	return client->family == ckey->family &&
+	       memcmp(&client->addr, &ckey->addr, sizeof(ckey->addr)) == 0;
+}
 
-	// If we did not return until here, then this client is definitely new
+static int add_client(const char *clientIP, const clientKey *key, const uint32_t addrhash)
+{
 	// Store ID
 	const int clientID = counters->clients;
 
@@ -186,6 +203,10 @@ int findClientID(const char *clientIP, const bool count)
 	client->count = 1;
 	// Initialize blocked count to zero
 	client->blockedcount = 0;
+	// No queries recorded so far
+	client->queries.first = client->queries.last = -1;
+	// Not yet in any top list
+	client->in_toplists = 0;
 	// Store client IP - no need to check for NULL here as it doesn't harm
 	client->ippos = addstr(clientIP);
 	// Initialize client hostname
@@ -205,8 +226,17 @@ int findClientID(const char *clientIP, const bool count)
 	for(int i = 0; i < OVERTIME_SLOTS; i++)
 		client->overTime[i] = 0;
 
+	// Store binary address and add client to the hash index
+	client->family = key->family;
+	client->addr = key->addr;
+	client->addrhash = addrhash;
+	if(key->family != AF_UNSPEC)
+		insert_hash(CLIENTS, addrhash, clientID);
+
 	// Increase counter by one
 	counters->clients++;
+	counters->active_clients++;
+	toplist_update(TOPLIST_CLIENTS, clientID);
 
 	// Allocate regex substructure
 	allocate_regex_client_enabled(client, clientID);
@@ -214,25 +244,127 @@ int findClientID(const char *clientIP, const bool count)
 	return clientID;
 }
 
-int findCacheID(int domainID, int clientID)
+// Find client by its binary address as handed over by dnsmasq (family is
+// either AF_INET or AF_INET6 and addr points to a struct in_addr or a
+// struct in6_addr, respectively)
+int findClientIDbyAddr(const int family, const void *addr, const bool count)
 {
-	// Compare content of client against known client IP addresses
-	for(int cacheID = 0; cacheID < counters->dns_cache_size; cacheID++)
+	// Prepare lookup key. IPv4 addresses are stored as IPv4-mapped
+	// IPv6 addresses (::ffff:a.b.c.d)
+	clientKey key = { .family = family };
+	if(family == AF_INET)
 	{
-		// Get cache pointer
-		DNSCacheData* dns_cache = getDNSCache(cacheID, true);
+		memset(&key.addr, 0, sizeof(key.addr));
+		key.addr.s6_addr[10] = 0xff;
+		key.addr.s6_addr[11] = 0xff;
+		memcpy(&key.addr.s6_addr[12], addr, sizeof(struct in_addr));
+	}
+	else
+		memcpy(&key.addr, addr, sizeof(key.addr));
+
+	// Look up client in the hash index
+	const uint32_t addrhash = hashBytes(&key.addr, sizeof(key.addr));
+	const int clientID = lookup_hash(CLIENTS, addrhash, client_matches, &key);
+	if(clientID > -1)
+	{
+		// Add one if count == true (do not add one, e.g., during ARP table processing)
+		if(count && ++getClient(clientID, true)->count == 1)
+			counters->active_clients++;
+		if(count)
+			toplist_update(TOPLIST_CLIENTS, clientID);
+		return clientID;
+	}
+
+	// Return -1 (= not found) if count is false because we do not want to create a new client here
+	if(!count)
+		return -1;
+
+	// If we did not return until here, then this client is definitely new.
+	// Only now we need the textual representation of its address
+	char clientIP[INET6_ADDRSTRLEN] = { 0 };
+	inet_ntop(family, addr, clientIP, sizeof(clientIP));
+
+	return add_client(clientIP, &key, addrhash);
+}
+
+// Look up a client by its textual IP address without adding it. Returns -1
+// if the client is unknown or clientIP is not a valid IP address. This does
+// not modify shared memory and is, hence, safe to call under the read lock
+int lookupClientID(const char *clientIP)
+{
+	struct in_addr addr4;
+	struct in6_addr addr6;
+	if(inet_pton(AF_INET, clientIP, &addr4) == 1)
+		return findClientIDbyAddr(AF_INET, &addr4, false);
+	else if(inet_pton(AF_INET6, clientIP, &addr6) == 1)
+		return findClientIDbyAddr(AF_INET6, &addr6, false);
+
+	return -1;
+}
+
+int findClientID(const char *clientIP, const bool count)
+{
+	// Try to convert the textual address into its binary form
+	struct in_addr addr4;
+	struct in6_addr addr6;
+	if(inet_pton(AF_INET, clientIP, &addr4) == 1)
+		return findClientIDbyAddr(AF_INET, &addr4, count);
+	else if(inet_pton(AF_INET6, clientIP, &addr6) == 1)
+		return findClientIDbyAddr(AF_INET6, &addr6, count);
+
+	// This is not a valid IP address. Such clients are not part of the
+	// hash index so we compare against all other clients of this kind
+	for(int clientID=0; clientID < counters->clients; clientID++)
+	{
+		// Get client pointer
+		clientsData* client = getClient(clientID, true);
 
 		// Check if the returned pointer is valid before trying to access it
-		if(dns_cache == NULL)
+		if(client == NULL || client->family != AF_UNSPEC)
 			continue;
 
-		if(dns_cache->domainID == domainID &&
-		   dns_cache->clientID == clientID)
+		if(strcmp(getstr(client->ippos), clientIP) == 0)
 		{
-			return cacheID;
+			// Add one if count == true (do not add one, e.g., during ARP table processing)
+			if(count && ++client->count == 1)
+				counters->active_clients++;
+			if(count)
+				toplist_update(TOPLIST_CLIENTS, clientID);
+			return clientID;
 		}
 	}
 
+	// Return -1 (= not found) if count is false because we do not want to create a new client here
+	if(!count)
+		return -1;
+
+	const clientKey key = { .family = AF_UNSPEC };
+	return add_client(clientIP, &key, 0u);
+}
+
+// Hash index callback: does the cache entry belong to the domain/client pair?
+static bool dns_cache_matches(const int cacheID, const void *key)
+{
+	// Get cache pointer
+	const DNSCacheData* dns_cache = getDNSCache(cacheID, true);
+	const int *pair = key;
+
+	// Check if the returned pointer is valid before trying to access it
+	if(dns_cache == NULL)
+		return false;
+
+	return dns_cache->domainID == pair[0] && dns_cache->clientID == pair[1];
+}
+
+int findCacheID(int domainID, int clientID, const bool create)
+{
+	// Look up domain/client pair in the hash index
+	const int pair[2] = { domainID, clientID };
+	const uint32_t hash = hashPair(domainID, clientID);
+	const int knownID = lookup_hash(DNS_CACHE, hash, dns_cache_matches, pair);
+	if(knownID > -1 || !create)
+		return knownID;
+
 	// Get ID of new cache entry
 	const int cacheID = counters->dns_cache_size;
 
@@ -255,6 +387,9 @@ int findCacheID(int domainID, int clientID)
 	dns_cache->clientID = clientID;
 	dns_cache->force_reply = 0u;
 
+	// Add cache entry to the hash index
+	insert_hash(DNS_CACHE, hash, cacheID);
+
 	// Increase counter by one
 	counters->dns_cache_size++;
 
@@ -384,6 +519,9 @@ void FTL_reload_all_domainlists(void)
 	// Reset number of blocked domains
 	counters->gravity = gravityDB_count(GRAVITY_TABLE);
 
+	// Load domain lists into memory (if enabled)
+	gravityDB_build_index();
+
 	// Read and compile possible regex filters
 	// only after having called gravityDB_open()
 	read_regex_from_database();
@@ -15,12 +15,17 @@
 
 // enum privacy_level
 #include "enums.h"
+// struct in6_addr
+#include <netinet/in.h>
 
 void strtolower(char *str);
 int findUpstreamID(const char * upstream, const bool count);
 int findDomainID(const char *domain, const bool count);
 int findClientID(const char *client, const bool count);
-int findCacheID(int domainID, int clientID);
+int findClientIDbyAddr(const int family, const void *addr, const bool count);
+int lookupDomainID(const char *domain);
+int lookupClientID(const char *client);
+int findCacheID(int domainID, int clientID, const bool create);
 bool isValidIPv4(const char *addr);
 bool isValidIPv6(const char *addr);
 
@@ -29,23 +34,37 @@ void FTL_reset_per_client_domain_data(void);
 
 typedef struct {
 	unsigned char magic;
-	enum query_status status;
-	enum query_types type;
-	enum privacy_level privacylevel;
-	enum reply_type reply;
-	enum dnssec_status dnssec;
-	time_t timestamp;
+	enum query_status status : 4;
+	enum query_types type : 4;
+	enum reply_type reply : 4;
+	enum dnssec_status dnssec : 3;
+	bool db : 1; // set once the query has been stored in the long-term database
+	enum privacy_level privacylevel : 2;
+	bool whitelisted : 1;
+	bool complete : 1;
+	uint16_t timeidx; // overTime slot plus offset, wraps around (see getQueryTimeIdx())
+	uint32_t timestamp; // seconds since the epoch, unsigned 32 bit is sufficient until 2106
 	int domainID;
 	int clientID;
 	int upstreamID;
 	int id; // the ID is a (signed) int in dnsmasq, so no need for a long int here
 	int CNAME_domainID; // only valid if query has a CNAME blocking status
-	unsigned long response; // saved in units of 1/10 milliseconds (1 = 0.1ms, 2 = 0.2ms, 2500 = 250.0ms, etc.)
-	int64_t db;
-	unsigned int timeidx;
-	bool whitelisted;
-	bool complete;
+	uint32_t response; // saved in units of 1/10 milliseconds (1 = 0.1ms, 2 = 0.2ms, 2500 = 250.0ms, etc.)
 } queriesData;
+// Queries make up the bulk of the shared memory, keep each record small
+_Static_assert(sizeof(queriesData) == 36, "Unexpected size of queriesData");
+// Each enum (including its _MAX value) has to fit into its bitfield above
+_Static_assert(QUERY_STATUS_MAX < (1 << 4), "enum query_status does not fit into queriesData.status");
+_Static_assert(TYPE_MAX < (1 << 4), "enum query_types does not fit into queriesData.type");
+_Static_assert(REPLY_OTHER < (1 << 4), "enum reply_type does not fit into queriesData.reply");
+_Static_assert(DNSSEC_ABANDONED < (1 << 3), "enum dnssec_status does not fit into queriesData.dnssec");
+_Static_assert(PRIVACY_MAXIMUM < (1 << 2), "enum privacy_level does not fit into queriesData.privacylevel");
+
+// Posting list of the queries of a domain or client, see add_query_postings()
+typedef struct {
+	int first;
+	int last;
+} postingList;
 
 typedef struct {
 	unsigned char magic;
@@ -60,6 +79,7 @@ typedef struct {
 	unsigned char magic;
 	bool new;
 	bool found_group;
+	unsigned char in_toplists; // bitmask of top lists this client is a candidate in
 	int count;
 	int blockedcount;
 	int overTime[OVERTIME_SLOTS];
@@ -68,13 +88,23 @@ typedef struct {
 	size_t ippos;
 	size_t namepos;
 	time_t lastQuery;
+	// Binary address used for the hash index (IPv4 addresses are stored as
+	// IPv4-mapped IPv6 addresses). family is AF_UNSPEC for clients whose
+	// textual representation is not a valid IP address
+	sa_family_t family;
+	struct in6_addr addr;
+	uint32_t addrhash;
+	postingList queries;
 } clientsData;
 
 typedef struct {
 	unsigned char magic;
+	unsigned char in_toplists; // bitmask of top lists this domain is a candidate in
 	size_t domainpos;
 	int count;
 	int blockedcount;
+	uint32_t domainhash;
+	postingList queries;
 } domainsData;
 
 typedef struct {
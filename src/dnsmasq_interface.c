@@ -38,6 +38,8 @@
 #include "args.h"
 // handle_realtime_signals()
 #include "signals.h"
+// toplist_update()
+#include "toplist.h"
 
 static void print_flags(const unsigned int flags);
 static void save_reply_type(const unsigned int flags, const union all_addr *addr,
@@ -129,7 +131,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 	queriesData* query  = getQuery(queryID,   true);
 	domainsData* domain = getDomain(domainID, true);
 	clientsData* client = getClient(clientID, true);
-	unsigned int cacheID = findCacheID(domainID, clientID);
+	unsigned int cacheID = findCacheID(domainID, clientID, true);
 	DNSCacheData *dns_cache = getDNSCache(cacheID, true);
 	if(query == NULL || domain == NULL || client == NULL || dns_cache == NULL)
 	{
@@ -365,6 +367,7 @@ bool _FTL_CNAME(const char *domain, const struct crec *cpp, const int id, const
 	{
 		domainsData* head_domain = getDomain(query->domainID, true);
 		head_domain->blockedcount++;
+		toplist_update(TOPLIST_ADS, query->domainID);
 
 		// Store query response as CNAME type
 		struct timeval response;
@@ -380,8 +383,8 @@ bool _FTL_CNAME(const char *domain, const struct crec *cpp, const int id, const
 		else if(query->status == QUERY_REGEX)
 		{
 			// Get parent and child DNS cache entries
-			unsigned int parent_cacheID = findCacheID(domainID, query->clientID);
-			unsigned int child_cacheID = findCacheID(query->domainID, query->clientID);
+			unsigned int parent_cacheID = findCacheID(domainID, query->clientID, true);
+			unsigned int child_cacheID = findCacheID(query->domainID, query->clientID, true);
 
 			// Get cache pointers
 			DNSCacheData *parent_dns_cache = getDNSCache(parent_cacheID, true);
@@ -469,7 +472,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 
 	// Ensure we have enough space in the queries struct
 	memory_check(QUERIES);
-	const int queryID = counters->queries;
+	const int queryID = counters->queries_first + counters->queries;
 
 	// If domain is "pi.hole" we skip this query
 	if(strcasecmp(name, "pi.hole") == 0)
@@ -482,18 +485,16 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	char *domainString = strdup(name);
 	strtolower(domainString);
 
-	// Get client IP address
-	char dest[ADDRSTRLEN];
-	inet_ntop((flags & F_IPV4) ? AF_INET : AF_INET6, addr, dest, ADDRSTRLEN);
-	char *clientIP = strdup(dest);
-	strtolower(clientIP);
+	// Get client address family. Clients are identified by their binary
+	// address, the textual form is only needed for new clients
+	const int family = (flags & F_IPV4) ? AF_INET : AF_INET6;
 
 	// Check if user wants to skip queries coming from localhost
 	if(config.ignore_localhost &&
-	   (strcmp(clientIP, "127.0.0.1") == 0 || strcmp(clientIP, "::1") == 0))
+	   ((family == AF_INET && addr->addr4.s_addr == htonl(INADDR_LOOPBACK)) ||
+	    (family == AF_INET6 && IN6_IS_ADDR_LOOPBACK(&addr->addr6))))
 	{
 		free(domainString);
-		free(clientIP);
 		unlock_shm();
 		return false;
 	}
@@ -501,6 +502,8 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Log new query if in debug mode
 	if(config.debug & DEBUG_QUERIES)
 	{
+		char clientIP[ADDRSTRLEN];
+		inet_ntop(family, addr, clientIP, ADDRSTRLEN);
 		const char *protostr = (proto == UDP) ? "UDP" : "TCP";
 		logg("**** new %s %s \"%s\" from %s (ID %i, FTL %i, %s:%i)",
 		     protostr, types, domainString, clientIP, id, queryID, file, line);
@@ -520,7 +523,6 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 		// Don't process this query further here, we already counted it
 		if(config.debug & DEBUG_QUERIES) logg("Notice: Skipping new query: %s (%i)", types, id);
 		free(domainString);
-		free(clientIP);
 		unlock_shm();
 		return false;
 	}
@@ -528,8 +530,8 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Go through already knows domains and see if it is one of them
 	const int domainID = findDomainID(domainString, true);
 
-	// Go through already knows clients and see if it is one of them
-	const int clientID = findClientID(clientIP, true);
+	// Look up client by its binary address (creates a new client if unknown)
+	const int clientID = findClientIDbyAddr(family, addr, true);
 
 	// Save everything
 	queriesData* query = getQuery(queryID, false);
@@ -538,7 +540,6 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 		// Encountered memory error, skip query
 		// Free allocated memory
 		free(domainString);
-		free(clientIP);
 		// Release thread lock
 		unlock_shm();
 		return false;
@@ -550,11 +551,13 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	query->status = QUERY_UNKNOWN;
 	query->domainID = domainID;
 	query->clientID = clientID;
-	query->timeidx = timeidx;
-	// Initialize database rowID with zero, will be set when the query is stored in the long-term DB
-	query->db = 0;
+	setQueryTimeIdx(query, timeidx);
+	// Will be set when the query is stored in the long-term database
+	query->db = false;
 	query->id = id;
 	query->complete = false;
+	// Only the lower 32 bits of the start time are kept, the response time
+	// computed later as difference is still exact (modulo 2^32)
 	query->response = converttimeval(request);
 	// Initialize reply type
 	query->reply = REPLY_UNKNOWN;
@@ -567,6 +570,12 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// generated) is stored in the queries structure
 	query->privacylevel = config.privacylevel;
 
+	// Add query to the index of dnsmasq IDs so that subsequent events
+	// concerning this query can be attributed to it
+	insert_query_id(queryID);
+	// Add query to the lists of queries of its domain and client
+	add_query_postings(queryID);
+
 	// Increase DNS queries counter
 	counters->queries++;
 	// Count this query as unknown as long as no reply has
@@ -583,7 +592,6 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 		// Encountered memory error, skip query
 		// Free allocated memory
 		free(domainString);
-		free(clientIP);
 		// Release thread lock
 		unlock_shm();
 		return false;
@@ -600,7 +608,6 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 
 	// Free allocated memory
 	free(domainString);
-	free(clientIP);
 
 	// Release thread lock
 	unlock_shm();
@@ -653,31 +660,11 @@ void _FTL_get_blocking_metadata(union all_addr **addrp, unsigned int *flags, con
 
 static int findQueryID(const int id)
 {
-	// Loop over all queries - we loop in reverse order (start from the most recent query and
-	// continuously walk older queries while trying to find a match. Ideally, we should always
-	// find the correct query with zero iterations, but it may happen that queries are processed
-	// asynchronously, e.g. for slow upstream relies to a huge amount of requests.
-	// We iterate from the most recent query down to at most MAXITER queries in the past to avoid
-	// iterating through the entire array of queries
-	// MAX(0, a) is used to return 0 in case a is negative (negative array indices are harmful)
-	const int until = MAX(0, counters->queries-MAXITER);
-	const int start = MAX(0, counters->queries-1);
-
-	// Check UUIDs of queries
-	for(int i = start; i >= until; i--)
-	{
-		const queriesData* query = getQuery(i, true);
-
-		// Check if the returned pointer is valid before trying to access it
-		if(query == NULL)
-			continue;
-
-		if(query->id == id)
-			return i;
-	}
-
-	// If not found
-	return -1;
+	// Look up the query in the index of dnsmasq IDs. This index covers all
+	// queries in memory (not only the most recent ones) so we can match even
+	// very late replies, e.g., from a slow upstream server under heavy load
+	// Returns -1 if not found
+	return lookup_query_id(id);
 }
 
 void _FTL_forwarded(const unsigned int flags, const char *name, const union all_addr *addr, const int id,
@@ -736,7 +723,7 @@ void _FTL_forwarded(const unsigned int flags, const char *name, const union all_
 	query->upstreamID = upstreamID;
 
 	// Get time index for this query
-	const unsigned int timeidx = query->timeidx;
+	const unsigned int timeidx = getQueryTimeIdx(query);
 
 	if(query->status == QUERY_CACHE)
 	{
@@ -922,7 +909,7 @@ void _FTL_reply(const unsigned short flags, const char *name, const union all_ad
 		counters->unknown--;
 
 		// Get time index
-		const unsigned int timeidx = query->timeidx;
+		const unsigned int timeidx = getQueryTimeIdx(query);
 
 		// Check whether this query was blocked
 		if(strcmp(answer, "(NXDOMAIN)") == 0 ||
@@ -1124,7 +1111,7 @@ static void query_externally_blocked(const int queryID, const enum query_status
 	}
 
 	// Get time index
-	const unsigned int timeidx = query->timeidx;
+	const unsigned int timeidx = getQueryTimeIdx(query);
 
 	// If query is already known to be externally blocked,
 	// then we have nothing to do here
@@ -1238,7 +1225,7 @@ void _FTL_cache(const unsigned int flags, const char *name, const union all_addr
 		counters->unknown--;
 
 		// Get time index
-		const unsigned int timeidx = query->timeidx;
+		const unsigned int timeidx = getQueryTimeIdx(query);
 
 		query->status = requesttype;
 
@@ -1305,11 +1292,17 @@ static void query_blocked(queriesData* query, domainsData* domain, clientsData*
 
 	// Count as blocked query
 	counters->blocked++;
-	overTime[query->timeidx].blocked++;
+	overTime[getQueryTimeIdx(query)].blocked++;
 	if(domain != NULL)
+	{
 		domain->blockedcount++;
+		toplist_update(TOPLIST_ADS, query->domainID);
+	}
 	if(client != NULL)
+	{
 		client->blockedcount++;
+		toplist_update(TOPLIST_CLIENTS_BLOCKED, query->clientID);
+	}
 
 	// Update status
 	query->status = new_status;
@@ -10,6 +10,8 @@
 
 #include "FTL.h"
 #include "gc.h"
+// INT_MAX
+#include <limits.h>
 #include "shmem.h"
 #include "timers.h"
 #include "config.h"
@@ -22,9 +24,191 @@
 #include "signals.h"
 // data getter functions
 #include "datastructure.h"
+// toplist_rebuild()
+#include "toplist.h"
 
 bool doGC = false;
 
+// Query IDs increase monotonically. Once they reached half of their range,
+// we shift them down by a multiple of the ring buffer size. This keeps the
+// slot of every query (the ID modulo the buffer size) unchanged
+static void rebase_query_IDs(void)
+{
+	if(counters->queries_first < INT_MAX/2)
+		return;
+
+	const int offset = counters->queries_first - counters->queries_first % counters->queries_MAX;
+	counters->queries_first -= offset;
+	counters->queries_rebased += offset;
+	lastdbindex -= offset;
+	rebuild_index(QUERIES);
+	rebase_query_postings(offset);
+
+	logg("Notice: Query IDs have been shifted down by %i", offset);
+}
+
+// Remove a single expired query and adjust all counters it contributed to
+static void remove_query(queriesData *query, const int queryID)
+{
+	// Adjust client counter
+	clientsData* client = getClient(query->clientID, true);
+	if(client != NULL && --client->count == 0)
+		counters->active_clients--;
+
+	// Adjust total counters and total over time data
+	const unsigned int timeidx = getQueryTimeIdx(query);
+	overTime[timeidx].total--;
+	if(client != NULL)
+		client->overTime[timeidx]--;
+
+	// Adjust domain counter (no overTime information)
+	domainsData* domain = getDomain(query->domainID, true);
+	if(domain != NULL)
+		domain->count--;
+
+	// Get upstream pointer
+	upstreamsData* upstream = getUpstream(query->upstreamID, true);
+
+	// Change other counters according to status of this query
+	switch(query->status)
+	{
+		case QUERY_UNKNOWN:
+			// Unknown (?)
+			counters->unknown--;
+			break;
+		case QUERY_FORWARDED:
+			// Forwarded to an upstream DNS server
+			// Adjust counters
+			counters->forwarded--;
+			if(upstream != NULL)
+				upstream->count--;
+			overTime[timeidx].forwarded--;
+			break;
+		case QUERY_CACHE:
+			// Answered from local cache _or_ local config
+			counters->cached--;
+			overTime[timeidx].cached--;
+			break;
+		case QUERY_GRAVITY: // Blocked by Pi-hole's blocking lists (fall through)
+		case QUERY_BLACKLIST: // Exact blocked (fall through)
+		case QUERY_REGEX: // Regex blocked (fall through)
+		case QUERY_EXTERNAL_BLOCKED_IP: // Blocked by upstream provider (fall through)
+		case QUERY_EXTERNAL_BLOCKED_NXRA: // Blocked by upstream provider (fall through)
+		case QUERY_EXTERNAL_BLOCKED_NULL: // Blocked by upstream provider (fall through)
+		case QUERY_GRAVITY_CNAME: // Gravity domain in CNAME chain (fall through)
+		case QUERY_BLACKLIST_CNAME: // Exactly blacklisted domain in CNAME chain (fall through)
+		case QUERY_REGEX_CNAME: // Regex blacklisted domain in CNAME chain (fall through)
+			counters->blocked--;
+			overTime[timeidx].blocked--;
+			if(domain != NULL)
+				domain->blockedcount--;
+			if(client != NULL)
+				client->blockedcount--;
+			break;
+		case QUERY_STATUS_MAX: // fall through
+		default:
+			/* That cannot happen */
+			break;
+	}
+
+	// Update reply counters
+	switch(query->reply)
+	{
+		case REPLY_NODATA: // NODATA(-IPv6)
+			counters->reply_NODATA--;
+			break;
+
+		case REPLY_NXDOMAIN: // NXDOMAIN
+			counters->reply_NXDOMAIN--;
+			break;
+
+		case REPLY_CNAME: // <CNAME>
+			counters->reply_CNAME--;
+			break;
+
+		case REPLY_IP: // valid IP
+			counters->reply_IP--;
+			break;
+
+		case REPLY_DOMAIN: // reverse lookup
+			counters->reply_domain--;
+			break;
+
+		case REPLY_RRNAME: // fall through
+		case REPLY_SERVFAIL: // fall through
+		case REPLY_REFUSED: // fall through
+		case REPLY_NOTIMP: // fall through
+		case REPLY_OTHER: // fall through
+		case REPLY_UNKNOWN: // fall through
+		default:
+			break;
+	}
+
+	// Update type counters
+	if(query->type >= TYPE_A && query->type < TYPE_MAX)
+	{
+		counters->querytype[query->type-1]--;
+		overTime[timeidx].querytypedata[query->type-1]--;
+	}
+
+	// Remove query from the index of dnsmasq IDs and free its slot in
+	// the ring buffer
+	remove_query_id(queryID);
+	remove_query_postings(queryID);
+	memset(query, 0, sizeof(queriesData));
+}
+
+// State of the currently running GC. Expired queries are removed in
+// batches so that the shared memory lock is never held for long
+static bool GC_running = false;
+static time_t GC_mintime = 0;
+// Number of steps done after all expired queries were removed
+static unsigned int GC_step = 0;
+static int GC_removed = 0;
+static unsigned int GC_batches = 0;
+static double GC_longest_batch = 0.0;
+
+// Remove the next batch of expired queries. Returns true when there are no
+// more expired queries left. Has to be called with the lock held
+static bool GC_batch(void)
+{
+	int removed = 0;
+	bool done = true;
+	const int first = counters->queries_first;
+	for(int queryID = first; queryID < first + counters->queries; queryID++)
+	{
+		queriesData* query = getQuery(queryID, true);
+		if(query == NULL)
+			continue;
+
+		// Test if this query is too new
+		if(query->timestamp > GC_mintime)
+			break;
+
+		// Stop if this batch is exhausted, we continue here next time.
+		// Each batch removes at least one query to guarantee progress
+		if(removed > 0 &&
+		   ((config.gc_batch_size > 0 && removed >= (int)config.gc_batch_size) ||
+		    (config.gc_batch_time > 0 && timer_elapsed_msec(GC_BATCH_TIMER)*1e3 >= config.gc_batch_time)))
+		{
+			done = false;
+			break;
+		}
+
+		remove_query(query, queryID);
+		removed++;
+	}
+
+	// Advance the start of the ring buffer past the removed queries.
+	// The remaining queries keep their IDs so there is no need to
+	// move them or to update the database index
+	counters->queries_first += removed;
+	counters->queries -= removed;
+	GC_removed += removed;
+
+	return done;
+}
+
 time_t lastGCrun = 0;
 void *GC_thread(void *val)
 {
@@ -36,177 +220,92 @@ void *GC_thread(void *val)
 	lastGCrun = time(NULL) - time(NULL)%GCinterval;
 	while(!killed)
 	{
-		if(time(NULL) - GCdelay - lastGCrun >= GCinterval || doGC)
+		if(!GC_running && (time(NULL) - GCdelay - lastGCrun >= GCinterval || doGC))
 		{
 			doGC = false;
 			// Update lastGCrun timer
 			lastGCrun = time(NULL) - GCdelay - (time(NULL) - GCdelay)%GCinterval;
 
-			// Lock FTL's data structure, since it is likely that it will be changed here
-			// Requests should not be processed/answered when data is about to change
-			lock_shm();
-
 			// Get minimum time stamp to keep
-			time_t mintime = (time(NULL) - GCdelay) - MAXLOGAGE*3600;
+			GC_mintime = (time(NULL) - GCdelay) - MAXLOGAGE*3600;
 
 			// Align to the start of the next hour. This will also align with
 			// the oldest overTime interval after GC is done.
-			mintime -= mintime % 3600;
-			mintime += 3600;
+			GC_mintime -= GC_mintime % 3600;
+			GC_mintime += 3600;
+
+			GC_running = true;
+			GC_step = 0;
+			GC_removed = 0;
+			GC_batches = 0;
+			GC_longest_batch = 0.0;
 
 			if(config.debug & DEBUG_GC)
 			{
 				timer_start(GC_TIMER);
 				char timestring[84] = "";
-				get_timestr(timestring, mintime);
-				logg("GC starting, mintime: %s (%lu)", timestring, mintime);
+				get_timestr(timestring, GC_mintime);
+				logg("GC starting, mintime: %s (%lu)", timestring, GC_mintime);
 			}
+		}
 
-			// Process all queries
-			int removed = 0;
-			for(long int i=0; i < counters->queries; i++)
-			{
-				queriesData* query = getQuery(i, true);
-				if(query == NULL)
-					continue;
-
-				// Test if this query is too new
-				if(query->timestamp > mintime)
-					break;
-
-				// Adjust client counter
-				clientsData* client = getClient(query->clientID, true);
-				if(client != NULL)
-					client->count--;
-
-				// Adjust total counters and total over time data
-				const int timeidx = query->timeidx;
-				overTime[timeidx].total--;
-				if(client != NULL)
-					client->overTime[timeidx]--;
-
-				// Adjust domain counter (no overTime information)
-				domainsData* domain = getDomain(query->domainID, true);
-				if(domain != NULL)
-					domain->count--;
-
-				// Get upstream pointer
-				upstreamsData* upstream = getUpstream(query->upstreamID, true);
-
-				// Change other counters according to status of this query
-				switch(query->status)
-				{
-					case QUERY_UNKNOWN:
-						// Unknown (?)
-						counters->unknown--;
-						break;
-					case QUERY_FORWARDED:
-						// Forwarded to an upstream DNS server
-						// Adjust counters
-						counters->forwarded--;
-						if(upstream != NULL)
-							upstream->count--;
-						overTime[timeidx].forwarded--;
-						break;
-					case QUERY_CACHE:
-						// Answered from local cache _or_ local config
-						counters->cached--;
-						overTime[timeidx].cached--;
-						break;
-					case QUERY_GRAVITY: // Blocked by Pi-hole's blocking lists (fall through)
-					case QUERY_BLACKLIST: // Exact blocked (fall through)
-					case QUERY_REGEX: // Regex blocked (fall through)
-					case QUERY_EXTERNAL_BLOCKED_IP: // Blocked by upstream provider (fall through)
-					case QUERY_EXTERNAL_BLOCKED_NXRA: // Blocked by upstream provider (fall through)
-					case QUERY_EXTERNAL_BLOCKED_NULL: // Blocked by upstream provider (fall through)
-					case QUERY_GRAVITY_CNAME: // Gravity domain in CNAME chain (fall through)
-					case QUERY_BLACKLIST_CNAME: // Exactly blacklisted domain in CNAME chain (fall through)
-					case QUERY_REGEX_CNAME: // Regex blacklisted domain in CNAME chain (fall through)
-						counters->blocked--;
-						overTime[timeidx].blocked--;
-						if(domain != NULL)
-							domain->blockedcount--;
-						if(client != NULL)
-							client->blockedcount--;
-						break;
-					case QUERY_STATUS_MAX: // fall through
-					default:
-						/* That cannot happen */
-						break;
-				}
+		if(GC_running)
+		{
+			// Lock FTL's data structure, since it is likely that it will be changed here
+			// Requests should not be processed/answered when data is about to change
+			lock_shm();
+			timer_start(GC_BATCH_TIMER);
 
-				// Update reply counters
-				switch(query->reply)
+			bool done = false;
+			if(GC_step == 0)
+			{
+				// The overTime slots can only be moved once all queries
+				// counted in them have been removed
+				if(GC_batch())
 				{
-					case REPLY_NODATA: // NODATA(-IPv6)
-						counters->reply_NODATA--;
-						break;
-
-					case REPLY_NXDOMAIN: // NXDOMAIN
-						counters->reply_NXDOMAIN--;
-						break;
-
-					case REPLY_CNAME: // <CNAME>
-						counters->reply_CNAME--;
-						break;
-
-					case REPLY_IP: // valid IP
-						counters->reply_IP--;
-						break;
-
-					case REPLY_DOMAIN: // reverse lookup
-						counters->reply_domain--;
-						break;
-
-					case REPLY_RRNAME: // fall through
-					case REPLY_SERVFAIL: // fall through
-					case REPLY_REFUSED: // fall through
-					case REPLY_NOTIMP: // fall through
-					case REPLY_OTHER: // fall through
-					case REPLY_UNKNOWN: // fall through
-					default:
-						break;
+					moveOverTimeMemory(GC_mintime);
+					rebase_query_IDs();
+					GC_step++;
 				}
+			}
+			else if(GC_step == 1)
+			{
+				// Remove strings no longer in use (e.g. old host names).
+				// This walks all domains, clients and upstreams so it
+				// gets a batch of its own
+				compact_strings();
+				GC_step++;
+			}
+			else
+			{
+				// Counters went down, recompute the top lists exactly.
+				// Each list is rebuilt in a batch of its own
+				toplist_rebuild(GC_step - 2);
+				done = ++GC_step > TOPLISTS + 1;
+			}
 
-				// Update type counters
-				if(query->type >= TYPE_A && query->type < TYPE_MAX)
-				{
-					counters->querytype[query->type-1]--;
-					overTime[timeidx].querytypedata[query->type-1]--;
-				}
+			const double elapsed = timer_elapsed_msec(GC_BATCH_TIMER);
 
-				// Count removed queries
-				removed++;
+			// Release thread lock
+			unlock_shm();
 
-			}
+			GC_batches++;
+			if(elapsed > GC_longest_batch)
+				GC_longest_batch = elapsed;
 
-			// Only perform memory operations when we actually removed queries
-			if(removed > 0)
+			if(!done)
 			{
-				// Move memory forward to keep only what we want
-				// Note: for overlapping memory blocks, memmove() is a safer approach than memcpy()
-				// Example: (I = now invalid, X = still valid queries, F = free space)
-				//   Before: IIIIIIXXXXFF
-				//   After:  XXXXFFFFFFFF
-				memmove(getQuery(0, true), getQuery(removed, true), (counters->queries - removed)*sizeof(queriesData));
-
-				// Update queries counter
-				counters->queries -= removed;
-				// Update DB index as total number of queries reduced
-				lastdbindex -= removed;
-
-				// ensure remaining memory is zeroed out (marked as "F" in the above example)
-				memset(getQuery(counters->queries, true), 0, (counters->queries_MAX - counters->queries)*sizeof(queriesData));
+				// Give the resolver a chance to obtain the lock before
+				// continuing with the next batch
+				sleepms(1);
+				continue;
 			}
 
-			// Determine if overTime memory needs to get moved
-			moveOverTimeMemory(mintime);
-
+			GC_running = false;
 			if(config.debug & DEBUG_GC)
-				logg("Notice: GC removed %i queries (took %.2f ms)", removed, timer_elapsed_msec(GC_TIMER));
-
-			// Release thread lock
-			unlock_shm();
+				logg("Notice: GC removed %i queries in %u batch%s (took %.2f ms, longest lock hold %.3f ms)",
+				     GC_removed, GC_batches, GC_batches == 1 ? "" : "es",
+				     timer_elapsed_msec(GC_TIMER), GC_longest_batch);
 
 			// After storing data in the database for the next time,
 			// we should scan for old entries, which will then be deleted
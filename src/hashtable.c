@@ -0,0 +1,150 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2020 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Open-addressing hash table routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "hashtable.h"
+
+// 32 bit FNV-1a hash of a zero-terminated string
+uint32_t __attribute__((pure)) hashStr(const char *str)
+{
+	uint32_t hash = 2166136261u;
+	while(*str)
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// 32 bit FNV-1a hash of arbitrary binary data
+uint32_t __attribute__((pure)) hashBytes(const void *data, const size_t len)
+{
+	const unsigned char *bytes = data;
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Hash of a pair of IDs packed into a single 64 bit key. The key is mixed
+// using the finalizer of MurmurHash3 so that consecutive IDs do not end up
+// in consecutive slots (which would cause long probing sequences)
+uint32_t __attribute__((const)) hashPair(const int a, const int b)
+{
+	uint64_t key = ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return (uint32_t)key;
+}
+
+// Return the number of slots needed to index the given number of elements.
+// We use a power of two (so the slot can be computed using a bitmask) and
+// keep the load factor at or below 50% so that linear probing terminates
+// quickly and always finds an empty slot
+size_t __attribute__((const)) hashtable_size(const size_t elements)
+{
+	size_t size = 1u;
+	while(size < 2*elements)
+		size <<= 1;
+	return size;
+}
+
+// Return the ID of the object matching the key or -1 if not found
+int hashtable_find(const hashSlot *table, const size_t size, const uint32_t hash,
+                   hashMatchFunc match, const void *key)
+{
+	if(table == NULL || size == 0)
+		return -1;
+
+	const size_t mask = size - 1;
+	for(size_t i = hash & mask; table[i].idx != 0; i = (i + 1) & mask)
+	{
+		// Only compare the actual key if the full hash matches
+		if(table[i].hash == hash && match(table[i].idx - 1, key))
+			return table[i].idx - 1;
+	}
+
+	// Reached an empty slot, the key is not in the table
+	return -1;
+}
+
+// Store an ID in the first free slot of its probe sequence
+void hashtable_insert(hashSlot *table, const size_t size, const uint32_t hash, const int ID)
+{
+	if(table == NULL || size == 0)
+		return;
+
+	const size_t mask = size - 1;
+	size_t i = hash & mask;
+	while(table[i].idx != 0)
+		i = (i + 1) & mask;
+
+	table[i].hash = hash;
+	table[i].idx = ID + 1;
+}
+
+// Store an ID, replacing the ID of an already indexed object with the same key
+void hashtable_upsert(hashSlot *table, const size_t size, const uint32_t hash, const int ID,
+                      hashMatchFunc match, const void *key)
+{
+	if(table == NULL || size == 0)
+		return;
+
+	const size_t mask = size - 1;
+	size_t i = hash & mask;
+	while(table[i].idx != 0)
+	{
+		if(table[i].hash == hash && match(table[i].idx - 1, key))
+			break;
+		i = (i + 1) & mask;
+	}
+
+	table[i].hash = hash;
+	table[i].idx = ID + 1;
+}
+
+// Remove an ID from the table. The following entries of the same cluster
+// are shifted backwards where possible so that no probe sequence is
+// interrupted by the slot becoming empty (no tombstones needed)
+void hashtable_remove(hashSlot *table, const size_t size, const uint32_t hash, const int ID)
+{
+	if(table == NULL || size == 0)
+		return;
+
+	const size_t mask = size - 1;
+	size_t i = hash & mask;
+	while(table[i].idx != (unsigned int)ID + 1)
+	{
+		// ID is not in the table
+		if(table[i].idx == 0)
+			return;
+		i = (i + 1) & mask;
+	}
+
+	for(size_t j = (i + 1) & mask; table[j].idx != 0; j = (j + 1) & mask)
+	{
+		// Entries whose home slot lies cyclically in (i, j] have to
+		// stay where they are, all others can fill the hole at i
+		const size_t home = table[j].hash & mask;
+		if(i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		table[i] = table[j];
+		i = j;
+	}
+
+	table[i].hash = 0u;
+	table[i].idx = 0u;
+}
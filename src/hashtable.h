@@ -0,0 +1,41 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2020 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Hash table prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef HASHTABLE_H
+#define HASHTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A single slot of an open-addressing hash table. The hash of the key is
+// stored alongside the ID so that we only have to dereference the actual
+// object (and compare its key) when the full 32 bit hash already matches.
+// ID + 1 is stored in idx so that zero-initialized (e.g., freshly created
+// shared) memory corresponds to an empty table
+typedef struct {
+	uint32_t hash;
+	unsigned int idx;
+} hashSlot;
+
+// Callback checking if the object with the given ID matches the key
+typedef bool (*hashMatchFunc)(const int ID, const void *key);
+
+uint32_t hashStr(const char *str) __attribute__((pure));
+uint32_t hashBytes(const void *data, const size_t len) __attribute__((pure));
+uint32_t hashPair(const int a, const int b) __attribute__((const));
+size_t hashtable_size(const size_t elements) __attribute__((const));
+int hashtable_find(const hashSlot *table, const size_t size, const uint32_t hash,
+                   hashMatchFunc match, const void *key);
+void hashtable_insert(hashSlot *table, const size_t size, const uint32_t hash, const int ID);
+void hashtable_upsert(hashSlot *table, const size_t size, const uint32_t hash, const int ID,
+                      hashMatchFunc match, const void *key);
+void hashtable_remove(hashSlot *table, const size_t size, const uint32_t hash, const int ID);
+
+#endif //HASHTABLE_H
@@ -78,6 +78,7 @@ int main (int argc, char* argv[])
 		DB_read_queries();
 
 	log_counter_info();
+	log_hugepage_usage();
 	check_setupVarsconf();
 
 	// Check for availability of advanced capabilities
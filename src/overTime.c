@@ -118,6 +118,18 @@ unsigned int getOverTimeID(time_t timestamp)
 	return (unsigned int) id;
 }
 
+void setQueryTimeIdx(queriesData *query, const unsigned int timeidx)
+{
+	// Only the lower 16 bits are stored, this is fine as long as there are
+	// fewer than 65536 overTime slots (the difference is taken modulo 2^16)
+	query->timeidx = (uint16_t)(timeidx + counters->overTime_offset);
+}
+
+unsigned int __attribute__((pure)) getQueryTimeIdx(const queriesData *query)
+{
+	return (uint16_t)(query->timeidx - counters->overTime_offset);
+}
+
 // This routine is called by garbage collection to rearrange the overTime structure for the next hour
 void moveOverTimeMemory(const time_t mintime)
 {
@@ -158,27 +170,9 @@ void moveOverTimeMemory(const time_t mintime)
 		        &overTime[moveOverTime],
 		        remainingSlots*sizeof(*overTime));
 
-		// Correct time indices of queries. This is necessary because we just moved the slot this index points to
-		for(int queryID = 0; queryID < counters->queries; queryID++)
-		{
-			// Get query pointer
-			queriesData* query = getQuery(queryID, true);
-			if(query == NULL)
-				continue;
-
-			// Check if the index would become negative if we adjusted it
-			if(((int)query->timeidx - (int)moveOverTime) < 0)
-			{
-				// This should never happen, but we print a warning if it still happens
-				// We don't do anything in this case
-				logg("WARN: moveOverTimeMemory(): overTime time index correction failed (%i: %u / %u)",
-				     queryID, query->timeidx, moveOverTime);
-			}
-			else
-			{
-				query->timeidx -= moveOverTime;
-			}
-		}
+		// Queries store absolute slot numbers, we only need to record how
+		// far the slots have been moved instead of correcting all queries
+		counters->overTime_offset += moveOverTime;
 
 		// Move client-specific overTime memory
 		for(int clientID = 0; clientID < counters->clients; clientID++)
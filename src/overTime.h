@@ -25,6 +25,14 @@ unsigned int getOverTimeID(const time_t timestamp);
  */
 void moveOverTimeMemory(const time_t mintime);
 
+/**
+ * Queries store the absolute number of the overTime slot they were counted
+ * in as GC shifts the overTime slots. These routines translate between the
+ * absolute number and the current index of the slot.
+ */
+void setQueryTimeIdx(queriesData *query, const unsigned int timeidx);
+unsigned int getQueryTimeIdx(const queriesData *query) __attribute__((pure));
+
 typedef struct {
 	unsigned char magic;
 	time_t timestamp;
@@ -23,12 +23,42 @@
 // add_per_client_regex_client()
 #include "shmem.h"
 #include "database/message-table.h"
+#include "hashtable.h"
+#include "regexset.h"
 
 static regex_t *regex[2] = { NULL };
 static bool *regex_available[2] = { NULL };
 static int *regex_id[2] = { NULL };
 static char **regexbuffer[2] = { NULL };
 
+// Wildcard filters matching a domain and all of its subdomains are not
+// compiled but looked up by the domain suffix. Filters with the same suffix
+// are chained using next
+typedef struct {
+	char *suffix;
+	int index;
+	int next;
+} suffixFilter;
+
+static bool *regex_is_suffix[2] = { NULL };
+static suffixFilter *suffixes[2] = { NULL };
+static int num_suffixes[2] = { 0 };
+static hashSlot *suffix_table[2] = { NULL };
+static size_t suffix_table_size[2] = { 0 };
+static __thread const suffixFilter *match_suffixes = NULL;
+
+// Filters using only the syntax supported by regexset.c are matched all at
+// once instead of one after another using regexec()
+static regexSet *regexsets[2] = { NULL };
+
+// Bitsets of the remaining filters which have to be matched by regexec().
+// They are only tried if the domain contains the literal they require (if
+// any) and are enabled for the client
+static uint64_t *regex_exec[2] = { NULL };
+static literalSet *prefilters[2] = { NULL };
+static uint64_t *regex_prefiltered[2] = { NULL };
+static uint64_t *regex_candidates[2] = { NULL };
+
 const char *regextype[] = { "blacklist", "whitelist" };
 
 /* Compile regular expressions into data structures that can be used with
@@ -58,68 +88,227 @@ static bool compile_regex(const char *regexin, const int index, const unsigned c
 	return true;
 }
 
+// Check if a regex matches exactly a domain and all of its subdomains, i.e.
+// has the form (\.|^)example\.com$ as created by the web interface for
+// wildcard entries. Returns the (lowercase) domain or NULL otherwise
+static char *regex_to_suffix(const char *regexin)
+{
+	const char *p;
+	if(strncmp(regexin, "(\\.|^)", 6u) == 0 || strncmp(regexin, "(^|\\.)", 6u) == 0)
+		p = regexin + 6u;
+	else
+		return NULL;
+
+	char *suffix = calloc(strlen(p) + 1u, sizeof(char));
+	if(suffix == NULL)
+		return NULL;
+
+	size_t len = 0u;
+	for(; *p != '\0' && *p != '$'; p++)
+	{
+		if(p[0] == '\\' && p[1] == '.')
+		{
+			// Escaped dot, labels must not be empty
+			if(len == 0u || suffix[len-1] == '.')
+				break;
+			suffix[len++] = '.';
+			p++;
+		}
+		else if(isalnum((unsigned char)*p) || *p == '-' || *p == '_')
+			suffix[len++] = tolower((unsigned char)*p);
+		else
+			break;
+	}
+
+	// The domain has to be followed by the end anchor and nothing else
+	if(len == 0u || suffix[len-1] == '.' || p[0] != '$' || p[1] != '\0')
+	{
+		free(suffix);
+		return NULL;
+	}
+
+	return suffix;
+}
+
+static bool suffix_matches(const int ID, const void *key)
+{
+	return strcmp(match_suffixes[ID].suffix, key) == 0;
+}
+
+// Store a wildcard filter in the suffix table
+static void add_suffix(char *suffix, const int index, const unsigned char regexid)
+{
+	// The table is sized for all filters of this type when reading them
+	const int ID = num_suffixes[regexid]++;
+	const uint32_t hash = hashStr(suffix);
+	match_suffixes = suffixes[regexid];
+	suffixes[regexid][ID].suffix = suffix;
+	suffixes[regexid][ID].index = index;
+	suffixes[regexid][ID].next = hashtable_find(suffix_table[regexid], suffix_table_size[regexid],
+	                                            hash, suffix_matches, suffix);
+	hashtable_upsert(suffix_table[regexid], suffix_table_size[regexid], hash, ID, suffix_matches, suffix);
+}
+
+// Remember the literal a filter requires to skip it quickly for domains not
+// containing this literal
+static void add_prefilter(const char *regexin, const int index, const unsigned char regexid)
+{
+	char *literal = regex_required_literal(regexin);
+	if(literal == NULL)
+		return;
+
+	if(prefilters[regexid] == NULL)
+		prefilters[regexid] = literalset_new();
+
+	if(!literalset_add(prefilters[regexid], literal, index))
+	{
+		free(literal);
+		return;
+	}
+
+	regex_prefiltered[regexid][index/64] |= 1ULL << (index%64);
+	if(config.debug & DEBUG_REGEX)
+		logg("Prefiltering %s regex %i by required literal \"%s\"", regextype[regexid], index, literal);
+	free(literal);
+}
+
+static bool regex_enabled(const int clientID, const int index, const unsigned char regexid)
+{
+	int regexID = index;
+	if(regexid == REGEX_WHITELIST)
+		regexID += counters->num_regex[REGEX_BLACKLIST];
+
+	return get_per_client_regex(clientID, regexID);
+}
+
+// Log why filters were not tried (regex debug mode only)
+static void log_skipped_regex(const int word, const uint64_t enabled, const int num_regex,
+                              const int clientID, const unsigned char regexid)
+{
+	for(int index = 64*word; index < 64*(word + 1) && index < num_regex; index++)
+	{
+		const uint64_t bit = 1ULL << (index%64);
+		if(regex_is_suffix[regexid][index])
+			continue;
+		else if(!regex_available[regexid][index])
+			logg("Regex %s (DB ID %d) \"%s\" is NOT AVAILABLE",
+			     regextype[regexid], regex_id[regexid][index],
+			     regexbuffer[regexid][index]);
+		else if(regex_exec[regexid][word] & bit && !(enabled & bit))
+		{
+			clientsData* client = getClient(clientID, true);
+			logg("Regex %s (DB ID %d) \"%s\" NOT ENABLED for client %s",
+			     regextype[regexid], regex_id[regexid][index],
+			     regexbuffer[regexid][index], getstr(client->ippos));
+		}
+	}
+}
+
+// Find the first wildcard filter enabled for this client which matches the
+// domain or any of its parent domains. Returns its index or -1
+static int match_suffix(const char *input, const int clientID, const unsigned char regexid)
+{
+	if(num_suffixes[regexid] == 0)
+		return -1;
+
+	int match = -1;
+	match_suffixes = suffixes[regexid];
+	for(const char *suffix = input; suffix != NULL; suffix = strchr(suffix, '.'))
+	{
+		if(*suffix == '.')
+			suffix++;
+
+		int ID = hashtable_find(suffix_table[regexid], suffix_table_size[regexid],
+		                        hashStr(suffix), suffix_matches, suffix);
+		for(; ID > -1; ID = suffixes[regexid][ID].next)
+		{
+			const int index = suffixes[regexid][ID].index;
+			if((match == -1 || index < match) && regex_enabled(clientID, index, regexid))
+				match = index;
+		}
+	}
+
+	return match;
+}
+
 int match_regex(const char *input, const int clientID, const unsigned char regexid)
 {
 	int match_idx = -1;
 
 	// Start matching timer
 	timer_start(REGEX_TIMER);
-	for(int index = 0; index < counters->num_regex[regexid]; index++)
+
+	// Wildcard filters are looked up by the suffixes of the domain, most
+	// other filters are matched in a single pass. Only the remaining filters
+	// coming before the first match have to be tried one by one
+	const uint64_t *enabled = get_per_client_regex_bits(clientID, regexid);
+	const int suffix_idx = match_suffix(input, clientID, regexid);
+	const int set_idx = regexset_match(regexsets[regexid], input, enabled);
+	int first_idx = suffix_idx;
+	if(set_idx > -1 && (first_idx == -1 || set_idx < first_idx))
+		first_idx = set_idx;
+	const int num_regex = first_idx > -1 ? first_idx : counters->num_regex[regexid];
+	if(prefilters[regexid] != NULL && num_regex > 0)
 	{
-		// Only check regex which have been successfully compiled ...
-		if(!regex_available[regexid][index])
-		{
-			if(config.debug & DEBUG_REGEX)
-				logg("Regex %s (DB ID %d) \"%s\" is NOT AVAILABLE",
-				     regextype[regexid], regex_id[regexid][index],
-					 regexbuffer[regexid][index]);
+		memset(regex_candidates[regexid], 0, (num_regex + 63)/64*sizeof(uint64_t));
+		literalset_match(prefilters[regexid], input, regex_candidates[regexid]);
+	}
 
-			continue;
-		}
-		// ... and are enabled for this client
-		int regexID = index;
-		if(regexid == REGEX_WHITELIST)
-			regexID += counters->num_regex[REGEX_BLACKLIST];
+	// Walk the filters 64 at a time, skipping all those which do not have
+	// to be tried at once
+	for(int word = 0; enabled != NULL && 64*word < num_regex && match_idx == -1; word++)
+	{
+		uint64_t todo = regex_exec[regexid][word] & enabled[word] &
+		                (regex_candidates[regexid][word] | ~regex_prefiltered[regexid][word]);
+		if(num_regex - 64*word < 64)
+			todo &= (1ULL << (num_regex - 64*word)) - 1u;
+
+		if(config.debug & DEBUG_REGEX)
+			log_skipped_regex(word, enabled[word], num_regex, clientID, regexid);
 
-		if(!get_per_client_regex(clientID, regexID))
+		for(; todo != 0u; todo &= todo - 1u)
 		{
-			if(config.debug & DEBUG_REGEX)
+			const int index = 64*word + __builtin_ctzll(todo);
+
+			// Try to match the compiled regular expression against input
+			int errcode = regexec(&regex[regexid][index], input, 0, NULL, 0);
+			// regexec() returns zero for a successful match or REG_NOMATCH for failure.
+			// We are only interested in the matching case here.
+			if (errcode == 0)
 			{
-				clientsData* client = getClient(clientID, true);
-				logg("Regex %s (DB ID %d) \"%s\" NOT ENABLED for client %s",
-				     regextype[regexid], regex_id[regexid][index],
-				     regexbuffer[regexid][index], getstr(client->ippos));
+				// Match, return true
+				match_idx = regex_id[regexid][index];
+
+				// Print match message when in regex debug mode
+				if(config.debug & DEBUG_REGEX)
+				{
+					logg("Regex %s (DB ID %i) >> MATCH: \"%s\" vs. \"%s\"",
+					     regextype[regexid], regex_id[regexid][index],
+					     input, regexbuffer[regexid][index]);
+				}
+				break;
 			}
 
-			continue;
-		}
-
-		// Try to match the compiled regular expression against input
-		int errcode = regexec(&regex[regexid][index], input, 0, NULL, 0);
-		// regexec() returns zero for a successful match or REG_NOMATCH for failure.
-		// We are only interested in the matching case here.
-		if (errcode == 0)
-		{
-			// Match, return true
-			match_idx = regex_id[regexid][index];
-
-			// Print match message when in regex debug mode
+			// Print no match message when in regex debug mode
 			if(config.debug & DEBUG_REGEX)
 			{
-				logg("Regex %s (DB ID %i) >> MATCH: \"%s\" vs. \"%s\"",
+				logg("Regex %s (DB ID %i) NO match: \"%s\" vs. \"%s\"",
 				     regextype[regexid], regex_id[regexid][index],
 				     input, regexbuffer[regexid][index]);
 			}
-			break;
 		}
+	}
 
-		// Print no match message when in regex debug mode
-		if(config.debug & DEBUG_REGEX && match_idx > -1)
-		{
-			logg("Regex %s (DB ID %i) NO match: \"%s\" vs. \"%s\"",
-			     regextype[regexid], regex_id[regexid][index],
-				 input, regexbuffer[regexid][index]);
-		}
+	if(match_idx == -1 && first_idx > -1)
+	{
+		match_idx = regex_id[regexid][first_idx];
+
+		if(config.debug & DEBUG_REGEX && first_idx == suffix_idx)
+			logg("Regex %s (DB ID %i) >> MATCH: \"%s\" is (a subdomain of) \"%s\"",
+			     regextype[regexid], match_idx, input, regexbuffer[regexid][first_idx]);
+		else if(config.debug & DEBUG_REGEX)
+			logg("Regex %s (DB ID %i) >> MATCH: \"%s\" vs. \"%s\"",
+			     regextype[regexid], match_idx, input, regexbuffer[regexid][first_idx]);
 	}
 
 	double elapsed = timer_elapsed_msec(REGEX_TIMER);
@@ -153,10 +342,8 @@ static void free_regex(void)
 	{
 		for(int index = 0; index < counters->num_regex[regexid]; index++)
 		{
-			if(!regex_available[regexid][index])
-				continue;
-
-			regfree(&regex[regexid][index]);
+			if(regex_available[regexid][index])
+				regfree(&regex[regexid][index]);
 
 			// Also free buffered regex strings if in regex debug mode
 			if(config.debug & DEBUG_REGEX && regexbuffer[regexid][index] != NULL)
@@ -173,6 +360,50 @@ static void free_regex(void)
 			regex[regexid] = NULL;
 		}
 
+		// Free wildcard filters
+		for(int ID = 0; ID < num_suffixes[regexid]; ID++)
+			free(suffixes[regexid][ID].suffix);
+		num_suffixes[regexid] = 0;
+		if(suffixes[regexid] != NULL)
+		{
+			free(suffixes[regexid]);
+			suffixes[regexid] = NULL;
+		}
+		if(suffix_table[regexid] != NULL)
+		{
+			free(suffix_table[regexid]);
+			suffix_table[regexid] = NULL;
+		}
+		suffix_table_size[regexid] = 0u;
+		if(regex_is_suffix[regexid] != NULL)
+		{
+			free(regex_is_suffix[regexid]);
+			regex_is_suffix[regexid] = NULL;
+		}
+
+		// Free multi-pattern matcher
+		regexset_free(regexsets[regexid]);
+		regexsets[regexid] = NULL;
+		if(regex_exec[regexid] != NULL)
+		{
+			free(regex_exec[regexid]);
+			regex_exec[regexid] = NULL;
+		}
+
+		// Free literal prefilter
+		literalset_free(prefilters[regexid]);
+		prefilters[regexid] = NULL;
+		if(regex_prefiltered[regexid] != NULL)
+		{
+			free(regex_prefiltered[regexid]);
+			regex_prefiltered[regexid] = NULL;
+		}
+		if(regex_candidates[regexid] != NULL)
+		{
+			free(regex_candidates[regexid]);
+			regex_candidates[regexid] = NULL;
+		}
+
 		// Reset counter for number of regex
 		counters->num_regex[regexid] = 0;
 	}
@@ -218,6 +449,15 @@ static void read_regex_table(const enum regex_id regexid)
 	regex[regexid] = calloc(counters->num_regex[regexid], sizeof(regex_t));
 	regex_id[regexid] = calloc(counters->num_regex[regexid], sizeof(int));
 	regex_available[regexid] = calloc(counters->num_regex[regexid], sizeof(bool));
+	regex_is_suffix[regexid] = calloc(counters->num_regex[regexid], sizeof(bool));
+	suffixes[regexid] = calloc(counters->num_regex[regexid], sizeof(suffixFilter));
+	suffix_table_size[regexid] = hashtable_size(counters->num_regex[regexid]);
+	suffix_table[regexid] = calloc(suffix_table_size[regexid], sizeof(hashSlot));
+	regexsets[regexid] = regexset_new(counters->num_regex[regexid]);
+	const size_t words = (counters->num_regex[regexid] + 63)/64;
+	regex_exec[regexid] = calloc(words, sizeof(uint64_t));
+	regex_prefiltered[regexid] = calloc(words, sizeof(uint64_t));
+	regex_candidates[regexid] = calloc(words, sizeof(uint64_t));
 
 	// Buffer strings if in regex debug mode
 	if(config.debug & DEBUG_REGEX)
@@ -249,6 +489,23 @@ static void read_regex_table(const enum regex_id regexid)
 		if(strlen(domain) < 1)
 			continue;
 
+		// Wildcard filters are stored by their domain instead of being
+		// compiled, they are looked up in O(number of labels)
+		char *suffix = regex_to_suffix(domain);
+		if(suffix != NULL)
+		{
+			if(config.debug & DEBUG_REGEX)
+			{
+				logg("Storing %s regex %i (database ID %i) as domain suffix: %s", regextype[regexid], i, rowid, suffix);
+				regexbuffer[regexid][i] = strdup(domain);
+			}
+			add_suffix(suffix, i, regexid);
+			regex_is_suffix[regexid][i] = true;
+			regex_id[regexid][i] = rowid;
+			i++;
+			continue;
+		}
+
 		// Compile this regex
 		if(config.debug & DEBUG_REGEX)
 		{
@@ -257,12 +514,25 @@ static void read_regex_table(const enum regex_id regexid)
 		regex_available[regexid][i] = compile_regex(domain, i, regexid, rowid);
 		regex_id[regexid][i] = rowid;
 
+		// Valid filters are added to the multi-pattern matcher if they
+		// only use the syntax it supports. All others are matched by
+		// regexec() and prefiltered by the literal they require
+		if(regex_available[regexid][i] && !regexset_add(regexsets[regexid], domain, i))
+		{
+			regex_exec[regexid][i/64] |= 1ULL << (i%64);
+			add_prefilter(domain, i, regexid);
+		}
+
 		// Increase counter
 		i++;
 	}
 
 	// Finalize statement and close gravity database handle
 	gravityDB_finalizeTable();
+
+	// Prepare matching all supported filters at once
+	regexset_compile(regexsets[regexid]);
+	literalset_compile(prefilters[regexid]);
 }
 
 void read_regex_from_database(void)
@@ -296,4 +566,10 @@ void read_regex_from_database(void)
 	logg("Compiled %i whitelist and %i blacklist regex filters for %i clients in %.1f msec",
 	     counters->num_regex[REGEX_WHITELIST], counters->num_regex[REGEX_BLACKLIST],
 	     counters->clients, timer_elapsed_msec(REGEX_TIMER));
+	if(num_suffixes[REGEX_WHITELIST] > 0 || num_suffixes[REGEX_BLACKLIST] > 0)
+		logg("   of which %i whitelist and %i blacklist filters are domain wildcards",
+		     num_suffixes[REGEX_WHITELIST], num_suffixes[REGEX_BLACKLIST]);
+	if(regexset_size(regexsets[REGEX_WHITELIST]) > 0 || regexset_size(regexsets[REGEX_BLACKLIST]) > 0)
+		logg("   of which %i whitelist and %i blacklist filters are matched in a single pass",
+		     regexset_size(regexsets[REGEX_WHITELIST]), regexset_size(regexsets[REGEX_BLACKLIST]));
 }
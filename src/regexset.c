@@ -0,0 +1,1245 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2020 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Multi-pattern regex matching
+*
+*  All filters of a set are compiled into one Thompson NFA which is turned
+*  into a DFA lazily while matching. Each DFA state knows which filters have
+*  matched when reaching it so a single pass over the domain tells us about
+*  all filters at once. The cost is proportional to the length of the domain
+*  and (on cache misses only) to the number of active NFA states, but not to
+*  the number of filters.
+*
+*  The supported syntax is POSIX ERE matched case-insensitively: literals,
+*  escaped characters, ".", bracket expressions incl. character classes,
+*  grouping, alternation, anchors, and the *, +, ? and {m,n} quantifiers.
+*  regexset_add() refuses other patterns which have to be matched by regexec()
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "regexset.h"
+#include "hashtable.h"
+#include "memory.h"
+
+// Maximum number of cached DFA states before the cache is flushed
+#define MAX_DFA_STATES 4096
+// Maximum number of NFA states a single filter may create
+#define MAX_FILTER_NFA_STATES 4096
+// Maximum repetition count of {m,n}
+#define MAX_REPEAT 255
+
+enum nfa_type { NFA_CHAR, NFA_SPLIT, NFA_BOL, NFA_EOL, NFA_MATCH };
+enum ast_type { AST_EMPTY, AST_CHAR, AST_CAT, AST_ALT, AST_REPEAT, AST_BOL, AST_EOL };
+
+typedef struct {
+	enum nfa_type type;
+	// Next state(s), -1 if unused
+	int out;
+	int out1;
+	// NFA_CHAR: character set, NFA_MATCH: filter index
+	int arg;
+} nfaState;
+
+typedef struct {
+	enum ast_type type;
+	int left;
+	int right;
+	// AST_CHAR: character set, AST_REPEAT: bounds (max = -1 means infinite)
+	int arg;
+	int min;
+	int max;
+} astNode;
+
+typedef struct {
+	// Important NFA states (sorted) in the NFA pool
+	unsigned int nfa_offset;
+	unsigned int nfa_count;
+	// Filters matching when entering this state in the match pool
+	unsigned int match_offset;
+	unsigned int match_count;
+	// Filters matching if the input ends here, computed lazily
+	int end_offset;
+	unsigned int end_count;
+	int trans[256];
+} dfaState;
+
+typedef struct {
+	int *items;
+	unsigned int count;
+	unsigned int size;
+} intVec;
+
+struct regexSet {
+	int max_filters;
+	int filters;
+	// Character sets (32 byte bitmaps)
+	unsigned char (*charsets)[32];
+	unsigned int num_charsets;
+	unsigned int charsets_size;
+	hashSlot *charset_table;
+	size_t charset_table_size;
+	// NFA
+	nfaState *nfa;
+	unsigned int nfa_count;
+	unsigned int nfa_size;
+	intVec starts;
+	// States reachable from the filter starts without consuming input
+	// (not at the beginning of the input). They are part of every DFA state
+	// and therefore not stored within the states
+	bool *in_start;
+	intVec start_closure;
+	intVec start_seeds[256];
+	intVec empty_matches;
+	// DFA
+	dfaState *dfa;
+	unsigned int dfa_count;
+	hashSlot *dfa_table;
+	size_t dfa_table_size;
+	intVec nfa_pool;
+	intVec match_pool;
+	int initial;
+	unsigned int flushes;
+	// Scratch space
+	unsigned int *mark;
+	unsigned int generation;
+	intVec stack;
+	intVec seeds;
+	intVec list;
+	uint64_t *matched;
+};
+
+static bool vec_push(intVec *vec, const int value)
+{
+	if(vec->count >= vec->size)
+	{
+		const unsigned int new_size = vec->size > 0u ? 2u*vec->size : 16u;
+		int *new_items = realloc(vec->items, new_size*sizeof(int));
+		if(new_items == NULL)
+			return false;
+		vec->items = new_items;
+		vec->size = new_size;
+	}
+	vec->items[vec->count++] = value;
+	return true;
+}
+
+static void vec_free(intVec *vec)
+{
+	if(vec->items != NULL)
+		free(vec->items);
+	vec->items = NULL;
+	vec->count = vec->size = 0u;
+}
+
+/**************************** Parser ****************************/
+
+typedef struct {
+	regexSet *set;
+	const char *p;
+	astNode *nodes;
+	unsigned int count;
+	unsigned int size;
+	bool failed;
+} parser;
+
+static __thread const regexSet *match_set = NULL;
+
+static bool charset_matches(const int ID, const void *key)
+{
+	return memcmp(match_set->charsets[ID], key, 32u) == 0;
+}
+
+// Get (or create) the ID of a character set
+static int add_charset(regexSet *set, const unsigned char bits[32])
+{
+	const uint32_t hash = hashBytes(bits, 32u);
+	match_set = set;
+	int ID = hashtable_find(set->charset_table, set->charset_table_size, hash, charset_matches, bits);
+	if(ID > -1)
+		return ID;
+
+	if(set->num_charsets >= set->charsets_size)
+	{
+		const unsigned int new_size = set->charsets_size > 0u ? 2u*set->charsets_size : 64u;
+		unsigned char (*new_sets)[32] = realloc(set->charsets, new_size*32u);
+		hashSlot *new_table = calloc(hashtable_size(new_size), sizeof(hashSlot));
+		if(new_sets == NULL || new_table == NULL)
+		{
+			if(new_sets != NULL)
+				set->charsets = new_sets;
+			if(new_table != NULL)
+				free(new_table);
+			return -1;
+		}
+		set->charsets = new_sets;
+		set->charsets_size = new_size;
+		if(set->charset_table != NULL)
+			free(set->charset_table);
+		set->charset_table = new_table;
+		set->charset_table_size = hashtable_size(new_size);
+		for(unsigned int i = 0; i < set->num_charsets; i++)
+			hashtable_insert(set->charset_table, set->charset_table_size,
+			                 hashBytes(set->charsets[i], 32u), i);
+	}
+
+	ID = set->num_charsets++;
+	memcpy(set->charsets[ID], bits, 32u);
+	hashtable_insert(set->charset_table, set->charset_table_size, hash, ID);
+	return ID;
+}
+
+static int new_node(parser *ps, const enum ast_type type, const int left, const int right)
+{
+	if(ps->failed)
+		return -1;
+
+	if(ps->count >= ps->size)
+	{
+		const unsigned int new_size = ps->size > 0u ? 2u*ps->size : 32u;
+		astNode *new_nodes = realloc(ps->nodes, new_size*sizeof(astNode));
+		if(new_nodes == NULL)
+		{
+			ps->failed = true;
+			return -1;
+		}
+		ps->nodes = new_nodes;
+		ps->size = new_size;
+	}
+
+	const int ID = ps->count++;
+	ps->nodes[ID].type = type;
+	ps->nodes[ID].left = left;
+	ps->nodes[ID].right = right;
+	ps->nodes[ID].arg = -1;
+	ps->nodes[ID].min = ps->nodes[ID].max = 0;
+	return ID;
+}
+
+static inline void set_bit(unsigned char bits[32], const unsigned char c)
+{
+	bits[c/8] |= 1u << (c%8);
+}
+
+static inline bool get_bit(const unsigned char bits[32], const unsigned char c)
+{
+	return bits[c/8] & (1u << (c%8));
+}
+
+// Add the other case of all letters in the set (matching is case-insensitive)
+static void fold_case(unsigned char bits[32])
+{
+	for(unsigned int c = 0; c < 256u; c++)
+	{
+		if(!get_bit(bits, c))
+			continue;
+		if(isupper(c))
+			set_bit(bits, tolower(c));
+		else if(islower(c))
+			set_bit(bits, toupper(c));
+	}
+}
+
+static int char_node(parser *ps, unsigned char bits[32])
+{
+	fold_case(bits);
+	const int charset = add_charset(ps->set, bits);
+	if(charset < 0)
+	{
+		ps->failed = true;
+		return -1;
+	}
+	const int node = new_node(ps, AST_CHAR, -1, -1);
+	if(node > -1)
+		ps->nodes[node].arg = charset;
+	return node;
+}
+
+static bool add_class(unsigned char bits[32], const char *name, const size_t len)
+{
+	static const struct { const char *name; int (*func)(int); } classes[] = {
+		{ "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum },
+		{ "upper", isupper }, { "lower", islower }, { "space", isspace },
+		{ "punct", ispunct }, { "xdigit", isxdigit }, { "blank", isblank },
+		{ "cntrl", iscntrl }, { "graph", isgraph }, { "print", isprint }
+	};
+	for(unsigned int i = 0; i < sizeof(classes)/sizeof(classes[0]); i++)
+	{
+		if(strlen(classes[i].name) != len || strncmp(classes[i].name, name, len) != 0)
+			continue;
+		for(unsigned int c = 1; c < 256u; c++)
+			if(classes[i].func(c))
+				set_bit(bits, c);
+		return true;
+	}
+	return false;
+}
+
+// Parse a bracket expression, ps->p points behind the opening bracket
+static int parse_bracket(parser *ps)
+{
+	unsigned char bits[32] = { 0 };
+	bool negate = false;
+	if(*ps->p == '^')
+	{
+		negate = true;
+		ps->p++;
+	}
+
+	bool first = true;
+	while(*ps->p != '\0' && (first || *ps->p != ']'))
+	{
+		first = false;
+		unsigned char lo = *ps->p;
+		if(ps->p[0] == '[' && ps->p[1] == ':')
+		{
+			const char *name = ps->p + 2;
+			const char *end = strstr(name, ":]");
+			if(end == NULL || !add_class(bits, name, end - name))
+				return ps->failed = true, -1;
+			ps->p = end + 2;
+			continue;
+		}
+		else if(ps->p[0] == '[' && (ps->p[1] == '.' || ps->p[1] == '='))
+		{
+			// Collating elements and equivalence classes
+			return ps->failed = true, -1;
+		}
+
+		ps->p++;
+		if(ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0')
+		{
+			const unsigned char hi = ps->p[1];
+			if(hi < lo || hi == '[')
+				return ps->failed = true, -1;
+			for(unsigned int c = lo; c <= hi; c++)
+				set_bit(bits, c);
+			ps->p += 2;
+		}
+		else
+			set_bit(bits, lo);
+	}
+
+	if(*ps->p != ']')
+		return ps->failed = true, -1;
+	ps->p++;
+
+	fold_case(bits);
+	if(negate)
+		for(unsigned int i = 0; i < 32u; i++)
+			bits[i] = ~bits[i];
+	// NUL never matches
+	bits[0] &= ~1u;
+
+	const int charset = add_charset(ps->set, bits);
+	if(charset < 0)
+		return ps->failed = true, -1;
+	const int node = new_node(ps, AST_CHAR, -1, -1);
+	if(node > -1)
+		ps->nodes[node].arg = charset;
+	return node;
+}
+
+static int parse_alt(parser *ps);
+
+static int parse_atom(parser *ps)
+{
+	unsigned char bits[32] = { 0 };
+	const char c = *ps->p++;
+	switch(c)
+	{
+		case '(':
+		{
+			const int node = parse_alt(ps);
+			if(*ps->p != ')')
+				return ps->failed = true, -1;
+			ps->p++;
+			return node;
+		}
+		case '[':
+			return parse_bracket(ps);
+		case '.':
+			memset(bits, 0xff, sizeof(bits));
+			bits[0] &= ~1u;
+			return char_node(ps, bits);
+		case '^':
+			return new_node(ps, AST_BOL, -1, -1);
+		case '$':
+			return new_node(ps, AST_EOL, -1, -1);
+		case '\\':
+			// Only escaped punctuation is a literal, everything else
+			// (\w, \b, \<, back-references, ...) is not supported here
+			if(*ps->p == '\0' || isalnum((unsigned char)*ps->p) ||
+			   strchr("<>`'", *ps->p) != NULL)
+				return ps->failed = true, -1;
+			set_bit(bits, *ps->p++);
+			return char_node(ps, bits);
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+		case ')':
+		case '\0':
+			return ps->failed = true, -1;
+		default:
+			set_bit(bits, c);
+			return char_node(ps, bits);
+	}
+}
+
+// Parse a {m}, {m,} or {m,n} bound, ps->p points behind the opening brace
+static bool parse_bound(parser *ps, int *min, int *max)
+{
+	char *end = NULL;
+	if(!isdigit((unsigned char)*ps->p))
+		return false;
+	*min = strtol(ps->p, &end, 10);
+	ps->p = end;
+	*max = *min;
+	if(*ps->p == ',')
+	{
+		ps->p++;
+		*max = -1;
+		if(isdigit((unsigned char)*ps->p))
+		{
+			*max = strtol(ps->p, &end, 10);
+			ps->p = end;
+		}
+	}
+	if(*ps->p != '}')
+		return false;
+	ps->p++;
+	return *min <= MAX_REPEAT && *max <= MAX_REPEAT && (*max < 0 || *min <= *max);
+}
+
+static int parse_cat(parser *ps)
+{
+	int node = new_node(ps, AST_EMPTY, -1, -1);
+	while(!ps->failed && *ps->p != '\0' && *ps->p != '|' && *ps->p != ')')
+	{
+		int atom = parse_atom(ps);
+		while(!ps->failed && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?' || *ps->p == '{'))
+		{
+			int min = 0, max = -1;
+			const char q = *ps->p++;
+			if(q == '+')
+				min = 1;
+			else if(q == '?')
+				max = 1;
+			else if(q == '{' && !parse_bound(ps, &min, &max))
+				return ps->failed = true, -1;
+
+			const int rep = new_node(ps, AST_REPEAT, atom, -1);
+			if(rep > -1)
+			{
+				ps->nodes[rep].min = min;
+				ps->nodes[rep].max = max;
+			}
+			atom = rep;
+		}
+		node = new_node(ps, AST_CAT, node, atom);
+	}
+	return node;
+}
+
+static int parse_alt(parser *ps)
+{
+	int node = parse_cat(ps);
+	while(!ps->failed && *ps->p == '|')
+	{
+		ps->p++;
+		node = new_node(ps, AST_ALT, node, parse_cat(ps));
+	}
+	return node;
+}
+
+/***************************** NFA ******************************/
+
+static int new_state(regexSet *set, const enum nfa_type type, const int out, const int out1, const int arg)
+{
+	if(set->nfa_count >= set->nfa_size)
+	{
+		const unsigned int new_size = set->nfa_size > 0u ? 2u*set->nfa_size : 1024u;
+		nfaState *new_nfa = realloc(set->nfa, new_size*sizeof(nfaState));
+		if(new_nfa == NULL)
+			return -1;
+		set->nfa = new_nfa;
+		set->nfa_size = new_size;
+	}
+
+	const int ID = set->nfa_count++;
+	set->nfa[ID].type = type;
+	set->nfa[ID].out = out;
+	set->nfa[ID].out1 = out1;
+	set->nfa[ID].arg = arg;
+	return ID;
+}
+
+// Compile an AST node into NFA states continuing with state next. Returns
+// the entry state or -1 on error
+static int compile_node(regexSet *set, const astNode *nodes, const int node, const int next,
+                        const unsigned int limit)
+{
+	if(next < 0 || set->nfa_count > limit)
+		return -1;
+
+	const astNode *n = &nodes[node];
+	switch(n->type)
+	{
+		case AST_EMPTY:
+			return next;
+		case AST_CHAR:
+			return new_state(set, NFA_CHAR, next, -1, n->arg);
+		case AST_BOL:
+			return new_state(set, NFA_BOL, next, -1, -1);
+		case AST_EOL:
+			return new_state(set, NFA_EOL, next, -1, -1);
+		case AST_CAT:
+			return compile_node(set, nodes, n->left,
+			                    compile_node(set, nodes, n->right, next, limit), limit);
+		case AST_ALT:
+		{
+			const int left = compile_node(set, nodes, n->left, next, limit);
+			const int right = compile_node(set, nodes, n->right, next, limit);
+			if(left < 0 || right < 0)
+				return -1;
+			return new_state(set, NFA_SPLIT, left, right, -1);
+		}
+		case AST_REPEAT:
+		{
+			int entry = next;
+			if(n->max < 0)
+			{
+				// Loop: split into the body (which returns to the
+				// split) or continue
+				const int split = new_state(set, NFA_SPLIT, -1, next, -1);
+				if(split < 0)
+					return -1;
+				const int body = compile_node(set, nodes, n->left, split, limit);
+				if(body < 0)
+					return -1;
+				set->nfa[split].out = body;
+				entry = split;
+			}
+			else
+			{
+				// Optional copies, each one may be skipped to continue
+				for(int i = n->min; i < n->max && entry > -1; i++)
+					entry = new_state(set, NFA_SPLIT, compile_node(set, nodes, n->left, entry, limit), next, -1);
+			}
+			// Mandatory copies
+			for(int i = 0; i < n->min && entry > -1; i++)
+				entry = compile_node(set, nodes, n->left, entry, limit);
+			return entry;
+		}
+	}
+	return -1;
+}
+
+// Add a filter to the set. Returns false if the pattern uses syntax which is
+// not supported, the set is left unchanged in this case
+bool regexset_add(regexSet *set, const char *pattern, const int index)
+{
+	if(set == NULL || index < 0 || index >= set->max_filters || set->dfa != NULL)
+		return false;
+
+	parser ps = { set, pattern, NULL, 0u, 0u, false };
+	const int root = parse_alt(&ps);
+	if(ps.failed || root < 0 || *ps.p != '\0')
+	{
+		if(ps.nodes != NULL)
+			free(ps.nodes);
+		return false;
+	}
+
+	const unsigned int nfa_count = set->nfa_count;
+	const int match = new_state(set, NFA_MATCH, -1, -1, index);
+	const int start = compile_node(set, ps.nodes, root, match, nfa_count + MAX_FILTER_NFA_STATES);
+	free(ps.nodes);
+	if(start < 0 || set->nfa_count > nfa_count + MAX_FILTER_NFA_STATES || !vec_push(&set->starts, start))
+	{
+		// Roll back states of this filter
+		set->nfa_count = nfa_count;
+		return false;
+	}
+
+	set->filters++;
+	return true;
+}
+
+/***************************** DFA ******************************/
+
+// Collect the important states (those consuming input, end anchors and
+// matches) reachable from the seeds without consuming input
+static void closure(regexSet *set, const int *seeds, const unsigned int num_seeds,
+                    const bool at_start, const bool at_end, intVec *out)
+{
+	if(++set->generation == 0u)
+	{
+		memset(set->mark, 0, set->nfa_count*sizeof(*set->mark));
+		set->generation = 1u;
+	}
+
+	set->stack.count = 0u;
+	for(unsigned int i = 0; i < num_seeds; i++)
+		vec_push(&set->stack, seeds[i]);
+
+	while(set->stack.count > 0u)
+	{
+		const int ID = set->stack.items[--set->stack.count];
+		if(ID < 0 || set->mark[ID] == set->generation)
+			continue;
+		set->mark[ID] = set->generation;
+
+		const nfaState *st = &set->nfa[ID];
+		switch(st->type)
+		{
+			case NFA_SPLIT:
+				vec_push(&set->stack, st->out1);
+				vec_push(&set->stack, st->out);
+				break;
+			case NFA_BOL:
+				if(at_start)
+					vec_push(&set->stack, st->out);
+				break;
+			case NFA_EOL:
+				if(at_end)
+					vec_push(&set->stack, st->out);
+				else
+					vec_push(out, ID);
+				break;
+			case NFA_CHAR:
+				if(!at_end)
+					vec_push(out, ID);
+				break;
+			case NFA_MATCH:
+				vec_push(out, ID);
+				break;
+		}
+	}
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	const int x = *(const int*)a, y = *(const int*)b;
+	return (x > y) - (x < y);
+}
+
+static bool dfa_matches(const int ID, const void *key)
+{
+	const intVec *list = key;
+	const dfaState *st = &match_set->dfa[ID];
+	return st->nfa_count == list->count &&
+	       memcmp(&match_set->nfa_pool.items[st->nfa_offset], list->items, list->count*sizeof(int)) == 0;
+}
+
+static void flush_dfa(regexSet *set)
+{
+	set->dfa_count = 0u;
+	set->nfa_pool.count = 0u;
+	set->match_pool.count = 0u;
+	memset(set->dfa_table, 0, set->dfa_table_size*sizeof(hashSlot));
+	set->initial = -1;
+	set->flushes++;
+}
+
+// Get the DFA state for a list of important NFA states (the list is sorted
+// and states of the start closure are removed)
+static int get_dfa_state(regexSet *set, intVec *list)
+{
+	unsigned int j = 0u;
+	for(unsigned int i = 0; i < list->count; i++)
+		if(!set->in_start[list->items[i]])
+			list->items[j++] = list->items[i];
+	list->count = j;
+	qsort(list->items, list->count, sizeof(int), cmp_int);
+
+	const uint32_t hash = hashBytes(list->items, list->count*sizeof(int));
+	match_set = set;
+	int ID = hashtable_find(set->dfa_table, set->dfa_table_size, hash, dfa_matches, list);
+	if(ID > -1)
+		return ID;
+
+	if(set->dfa_count >= MAX_DFA_STATES)
+		flush_dfa(set);
+
+	ID = set->dfa_count++;
+	dfaState *st = &set->dfa[ID];
+	st->nfa_offset = set->nfa_pool.count;
+	st->nfa_count = list->count;
+	st->match_offset = set->match_pool.count;
+	st->match_count = 0u;
+	st->end_offset = -1;
+	st->end_count = 0u;
+	for(unsigned int i = 0; i < list->count; i++)
+	{
+		vec_push(&set->nfa_pool, list->items[i]);
+		const nfaState *nfa = &set->nfa[list->items[i]];
+		if(nfa->type == NFA_MATCH && vec_push(&set->match_pool, nfa->arg))
+			st->match_count++;
+	}
+	for(unsigned int c = 0; c < 256u; c++)
+		st->trans[c] = -1;
+	hashtable_insert(set->dfa_table, set->dfa_table_size, hash, ID);
+
+	return ID;
+}
+
+static int get_initial_state(regexSet *set)
+{
+	set->list.count = 0u;
+	closure(set, set->starts.items, set->starts.count, true, false, &set->list);
+	set->initial = get_dfa_state(set, &set->list);
+	return set->initial;
+}
+
+static int compute_transition(regexSet *set, const int from, const unsigned char c)
+{
+	// Seeds: states reached by consuming c from this state and from the
+	// implicit start closure
+	intVec *seeds = &set->seeds;
+	seeds->count = 0u;
+	const dfaState *st = &set->dfa[from];
+	for(unsigned int i = 0; i < st->nfa_count; i++)
+	{
+		const nfaState *nfa = &set->nfa[set->nfa_pool.items[st->nfa_offset + i]];
+		if(nfa->type == NFA_CHAR && get_bit(set->charsets[nfa->arg], c))
+			vec_push(seeds, nfa->out);
+	}
+	for(unsigned int i = 0; i < set->start_seeds[c].count; i++)
+		vec_push(seeds, set->start_seeds[c].items[i]);
+
+	set->list.count = 0u;
+	closure(set, seeds->items, seeds->count, false, false, &set->list);
+
+	const unsigned int flushes = set->flushes;
+	const int to = get_dfa_state(set, &set->list);
+	// Only remember the transition if the origin survived
+	if(set->flushes == flushes)
+		set->dfa[from].trans[c] = to;
+	return to;
+}
+
+static void compute_end_matches(regexSet *set, const int ID)
+{
+	intVec *seeds = &set->seeds;
+	seeds->count = 0u;
+	dfaState *st = &set->dfa[ID];
+	for(unsigned int i = 0; i < st->nfa_count; i++)
+	{
+		const int nfa = set->nfa_pool.items[st->nfa_offset + i];
+		if(set->nfa[nfa].type == NFA_EOL)
+			vec_push(seeds, nfa);
+	}
+	for(unsigned int i = 0; i < set->start_closure.count; i++)
+	{
+		const int nfa = set->start_closure.items[i];
+		if(set->nfa[nfa].type == NFA_EOL)
+			vec_push(seeds, nfa);
+	}
+
+	set->list.count = 0u;
+	closure(set, seeds->items, seeds->count, false, true, &set->list);
+
+	st->end_offset = set->match_pool.count;
+	st->end_count = 0u;
+	for(unsigned int i = 0; i < set->list.count; i++)
+	{
+		const nfaState *nfa = &set->nfa[set->list.items[i]];
+		if(nfa->type == NFA_MATCH && vec_push(&set->match_pool, nfa->arg))
+			st->end_count++;
+	}
+}
+
+// Prepare matching after all filters have been added
+void regexset_compile(regexSet *set)
+{
+	if(set == NULL || set->filters == 0 || set->dfa != NULL)
+		return;
+
+	set->mark = calloc(set->nfa_count, sizeof(*set->mark));
+	set->in_start = calloc(set->nfa_count, sizeof(bool));
+	set->matched = calloc((set->max_filters + 63)/64, sizeof(uint64_t));
+	set->dfa = calloc(MAX_DFA_STATES, sizeof(dfaState));
+	set->dfa_table_size = hashtable_size(MAX_DFA_STATES);
+	set->dfa_table = calloc(set->dfa_table_size, sizeof(hashSlot));
+	if(set->mark == NULL || set->in_start == NULL || set->matched == NULL ||
+	   set->dfa == NULL || set->dfa_table == NULL)
+	{
+		// Matching will report no matches
+		set->filters = 0;
+		return;
+	}
+
+	// States active at every position of the input (filters may start
+	// matching anywhere)
+	closure(set, set->starts.items, set->starts.count, false, false, &set->start_closure);
+	for(unsigned int i = 0; i < set->start_closure.count; i++)
+	{
+		const int ID = set->start_closure.items[i];
+		set->in_start[ID] = true;
+		const nfaState *st = &set->nfa[ID];
+		if(st->type == NFA_MATCH)
+			vec_push(&set->empty_matches, st->arg);
+		else if(st->type == NFA_CHAR)
+			for(unsigned int c = 0; c < 256u; c++)
+				if(get_bit(set->charsets[st->arg], c))
+					vec_push(&set->start_seeds[c], st->out);
+	}
+
+	get_initial_state(set);
+}
+
+static inline void add_matches(regexSet *set, const unsigned int offset, const unsigned int count)
+{
+	for(unsigned int i = 0; i < count; i++)
+	{
+		const int index = set->match_pool.items[offset + i];
+		set->matched[index/64] |= 1ULL << (index%64);
+	}
+}
+
+// Match the input against all filters of the set. Returns the smallest index
+// of the matching filters whose bit is set in enabled or -1
+int regexset_match(regexSet *set, const char *input, const uint64_t *enabled)
+{
+	if(set == NULL || set->filters == 0 || set->dfa == NULL || enabled == NULL)
+		return -1;
+
+	const unsigned int words = (set->max_filters + 63)/64;
+	memset(set->matched, 0, words*sizeof(uint64_t));
+
+	// Filters matching the empty string match everywhere
+	for(unsigned int i = 0; i < set->empty_matches.count; i++)
+	{
+		const int index = set->empty_matches.items[i];
+		set->matched[index/64] |= 1ULL << (index%64);
+	}
+
+	int state = set->initial >= 0 ? set->initial : get_initial_state(set);
+	add_matches(set, set->dfa[state].match_offset, set->dfa[state].match_count);
+	for(const unsigned char *c = (const unsigned char*)input; *c != '\0'; c++)
+	{
+		int next = set->dfa[state].trans[*c];
+		if(next < 0)
+			next = compute_transition(set, state, *c);
+		state = next;
+		add_matches(set, set->dfa[state].match_offset, set->dfa[state].match_count);
+	}
+
+	if(set->dfa[state].end_offset < 0)
+		compute_end_matches(set, state);
+	add_matches(set, set->dfa[state].end_offset, set->dfa[state].end_count);
+
+	// Report the first enabled filter
+	for(unsigned int w = 0; w < words; w++)
+	{
+		const uint64_t bits = set->matched[w] & enabled[w];
+		if(bits != 0u)
+			return 64*w + __builtin_ctzll(bits);
+	}
+
+	return -1;
+}
+
+regexSet *regexset_new(const int max_filters)
+{
+	regexSet *set = calloc(1, sizeof(regexSet));
+	if(set == NULL)
+		return NULL;
+	set->max_filters = max_filters;
+	set->initial = -1;
+	return set;
+}
+
+int __attribute__((pure)) regexset_size(const regexSet *set)
+{
+	return set != NULL ? set->filters : 0;
+}
+
+void regexset_free(regexSet *set)
+{
+	if(set == NULL)
+		return;
+
+	void *ptrs[] = { set->charsets, set->charset_table, set->nfa, set->in_start,
+	                 set->dfa, set->dfa_table, set->mark, set->matched };
+	for(unsigned int i = 0; i < sizeof(ptrs)/sizeof(ptrs[0]); i++)
+		if(ptrs[i] != NULL)
+			free(ptrs[i]);
+
+	vec_free(&set->starts);
+	vec_free(&set->start_closure);
+	for(unsigned int c = 0; c < 256u; c++)
+		vec_free(&set->start_seeds[c]);
+	vec_free(&set->empty_matches);
+	vec_free(&set->nfa_pool);
+	vec_free(&set->match_pool);
+	vec_free(&set->stack);
+	vec_free(&set->seeds);
+	vec_free(&set->list);
+	free(set);
+}
+
+/*********************** Required literals **********************/
+
+// Skip a bracket expression, p points at the opening bracket
+static const char * __attribute__((pure)) skip_bracket(const char *p)
+{
+	p++;
+	if(*p == '^')
+		p++;
+	if(*p == ']')
+		p++;
+	while(*p != '\0' && *p != ']')
+	{
+		if(p[0] == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+		{
+			const char end[3] = { p[1], ']', '\0' };
+			const char *close = strstr(p + 2, end);
+			if(close == NULL)
+				return NULL;
+			p = close + 2;
+		}
+		else
+			p++;
+	}
+	return *p == ']' ? p + 1 : NULL;
+}
+
+// Skip a group, p points at the opening parenthesis
+static const char * __attribute__((pure)) skip_group(const char *p)
+{
+	int depth = 0;
+	while(*p != '\0')
+	{
+		if(*p == '\\')
+			p += p[1] != '\0' ? 2 : 1;
+		else if(*p == '[')
+		{
+			if((p = skip_bracket(p)) == NULL)
+				return NULL;
+		}
+		else if(*p++ == ')' && --depth == 0)
+			return p;
+		else if(p[-1] == '(')
+			depth++;
+	}
+	return NULL;
+}
+
+// Skip a chain of quantifiers. Returns false if any of them allows the
+// preceding atom to be absent
+static bool skip_quantifiers(const char **p)
+{
+	bool required = true;
+	while(**p == '*' || **p == '+' || **p == '?' || **p == '{')
+	{
+		if(**p == '{')
+		{
+			const char *close = strchr(*p, '}');
+			required = false;
+			*p = close != NULL ? close + 1 : *p + strlen(*p);
+		}
+		else if(*(*p)++ != '+')
+			required = false;
+	}
+	return required;
+}
+
+// Get the longest literal every string matched by the (case-insensitive)
+// POSIX ERE has to contain. The result is lowercase and has to be freed by
+// the caller. NULL is returned if there is no such literal (or the pattern
+// is too complex to tell)
+char *regex_required_literal(const char *pattern)
+{
+	// Top-level alternatives do not share any required literal
+	for(const char *p = pattern; *p != '\0';)
+	{
+		if(*p == '\\')
+			p += p[1] != '\0' ? 2 : 1;
+		else if(*p == '[')
+			p = skip_bracket(p);
+		else if(*p == '(')
+			p = skip_group(p);
+		else if(*p++ == '|')
+			return NULL;
+
+		if(p == NULL)
+			return NULL;
+	}
+
+	const size_t len = strlen(pattern);
+	char *best = calloc(len + 1u, sizeof(char));
+	char *run = calloc(len + 1u, sizeof(char));
+	if(best == NULL || run == NULL)
+	{
+		if(best != NULL)
+			free(best);
+		if(run != NULL)
+			free(run);
+		return NULL;
+	}
+
+	size_t best_len = 0u, run_len = 0u;
+	const char *p = pattern;
+	while(p != NULL)
+	{
+		char c = '\0';
+		if(p[0] == '\\' && p[1] != '\0' && !isalnum((unsigned char)p[1]) &&
+		   strchr("<>`'", p[1]) == NULL)
+		{
+			// Escaped punctuation is a literal
+			c = p[1];
+			p += 2;
+		}
+		else if(*p == '\0' || strchr("\\[(.^$*+?{)|", *p) != NULL)
+		{
+			// Anything but a literal ends the current run
+			if(run_len > best_len)
+			{
+				memcpy(best, run, run_len);
+				best[best_len = run_len] = '\0';
+			}
+			run_len = 0u;
+
+			if(*p == '\0')
+				break;
+			else if(*p == '\\')
+				p += p[1] != '\0' ? 2 : 1;
+			else if(*p == '[')
+				p = skip_bracket(p);
+			else if(*p == '(')
+				p = skip_group(p);
+			else if(*p == '{' || *p == '*' || *p == '+' || *p == '?')
+				skip_quantifiers(&p);
+			else
+				p++;
+			continue;
+		}
+		else
+			c = *p++;
+
+		// A quantified literal may be absent (or repeated), the run
+		// cannot continue past it in either case
+		const bool quantified = *p == '*' || *p == '+' || *p == '?' || *p == '{';
+		if(!quantified || skip_quantifiers(&p))
+			run[run_len++] = tolower((unsigned char)c);
+		if(quantified)
+		{
+			if(run_len > best_len)
+			{
+				memcpy(best, run, run_len);
+				best[best_len = run_len] = '\0';
+			}
+			run_len = 0u;
+		}
+	}
+
+	free(run);
+	if(p == NULL || best_len == 0u)
+	{
+		free(best);
+		return NULL;
+	}
+	return best;
+}
+
+// Domains consist of letters, digits, '-', '.' and '_'. All other
+// characters share one class, this may result in false positives only
+#define LITERAL_CLASSES 40
+
+typedef struct {
+	int next[LITERAL_CLASSES];
+	int fail;
+	// First own output and next node with outputs on the fail chain
+	int output;
+	int dict;
+} literalNode;
+
+typedef struct {
+	int index;
+	int next;
+} literalOutput;
+
+struct literalSet {
+	literalNode *nodes;
+	unsigned int num_nodes;
+	unsigned int nodes_size;
+	literalOutput *outputs;
+	unsigned int num_outputs;
+	unsigned int outputs_size;
+	bool compiled;
+};
+
+static inline unsigned int literal_class(const unsigned char c)
+{
+	if(c >= 'a' && c <= 'z')
+		return c - 'a';
+	if(c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if(c >= '0' && c <= '9')
+		return 26u + c - '0';
+	if(c == '-')
+		return 36u;
+	if(c == '.')
+		return 37u;
+	if(c == '_')
+		return 38u;
+	return 39u;
+}
+
+static int new_literal_node(literalSet *set)
+{
+	if(set->num_nodes >= set->nodes_size)
+	{
+		const unsigned int new_size = set->nodes_size > 0u ? 2u*set->nodes_size : 64u;
+		literalNode *new_nodes = realloc(set->nodes, new_size*sizeof(literalNode));
+		if(new_nodes == NULL)
+			return -1;
+		set->nodes = new_nodes;
+		set->nodes_size = new_size;
+	}
+
+	const int ID = set->num_nodes++;
+	literalNode *node = &set->nodes[ID];
+	for(unsigned int i = 0; i < LITERAL_CLASSES; i++)
+		node->next[i] = -1;
+	node->fail = 0;
+	node->output = -1;
+	node->dict = -1;
+	return ID;
+}
+
+literalSet *literalset_new(void)
+{
+	literalSet *set = calloc(1, sizeof(literalSet));
+	if(set == NULL)
+		return NULL;
+	if(new_literal_node(set) < 0)
+	{
+		free(set);
+		return NULL;
+	}
+	return set;
+}
+
+// Add a literal required by the filter with the given index
+bool literalset_add(literalSet *set, const char *literal, const int index)
+{
+	if(set == NULL || set->compiled || *literal == '\0')
+		return false;
+
+	if(set->num_outputs >= set->outputs_size)
+	{
+		const unsigned int new_size = set->outputs_size > 0u ? 2u*set->outputs_size : 16u;
+		literalOutput *new_outputs = realloc(set->outputs, new_size*sizeof(literalOutput));
+		if(new_outputs == NULL)
+			return false;
+		set->outputs = new_outputs;
+		set->outputs_size = new_size;
+	}
+
+	int node = 0;
+	for(const unsigned char *c = (const unsigned char*)literal; *c != '\0'; c++)
+	{
+		const unsigned int cls = literal_class(*c);
+		if(set->nodes[node].next[cls] < 0)
+		{
+			const int child = new_literal_node(set);
+			if(child < 0)
+				return false;
+			set->nodes[node].next[cls] = child;
+		}
+		node = set->nodes[node].next[cls];
+	}
+
+	const int ID = set->num_outputs++;
+	set->outputs[ID].index = index;
+	set->outputs[ID].next = set->nodes[node].output;
+	set->nodes[node].output = ID;
+	return true;
+}
+
+// Compute failure links and turn the trie into a complete automaton
+void literalset_compile(literalSet *set)
+{
+	if(set == NULL || set->compiled)
+		return;
+
+	int *queue = calloc(set->num_nodes, sizeof(int));
+	if(queue == NULL)
+		return;
+
+	unsigned int head = 0u, tail = 0u;
+	for(unsigned int cls = 0; cls < LITERAL_CLASSES; cls++)
+	{
+		int *child = &set->nodes[0].next[cls];
+		if(*child < 0)
+			*child = 0;
+		else
+		{
+			set->nodes[*child].fail = 0;
+			queue[tail++] = *child;
+		}
+	}
+
+	// Breadth-first so failure targets are complete when they are used
+	while(head < tail)
+	{
+		const int ID = queue[head++];
+		literalNode *node = &set->nodes[ID];
+		const literalNode *fail = &set->nodes[node->fail];
+		node->dict = fail->output > -1 ? node->fail : fail->dict;
+		for(unsigned int cls = 0; cls < LITERAL_CLASSES; cls++)
+		{
+			const int child = node->next[cls];
+			if(child < 0)
+				node->next[cls] = fail->next[cls];
+			else
+			{
+				set->nodes[child].fail = fail->next[cls];
+				queue[tail++] = child;
+			}
+		}
+	}
+
+	free(queue);
+	set->compiled = true;
+}
+
+// Set the bits of all filters whose literal occurs in the input
+void literalset_match(const literalSet *set, const char *input, uint64_t *found)
+{
+	if(set == NULL || !set->compiled)
+		return;
+
+	int state = 0;
+	for(const unsigned char *c = (const unsigned char*)input; *c != '\0'; c++)
+	{
+		state = set->nodes[state].next[literal_class(*c)];
+		for(int node = set->nodes[state].output > -1 ? state : set->nodes[state].dict;
+		    node > -1; node = set->nodes[node].dict)
+		{
+			for(int ID = set->nodes[node].output; ID > -1; ID = set->outputs[ID].next)
+			{
+				const int index = set->outputs[ID].index;
+				found[index/64] |= 1ULL << (index%64);
+			}
+		}
+	}
+}
+
+void literalset_free(literalSet *set)
+{
+	if(set == NULL)
+		return;
+	if(set->nodes != NULL)
+		free(set->nodes);
+	if(set->outputs != NULL)
+		free(set->outputs);
+	free(set);
+}
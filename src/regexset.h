@@ -0,0 +1,35 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2020 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Multi-pattern regex matching prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef REGEXSET_H
+#define REGEXSET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct regexSet regexSet;
+
+regexSet *regexset_new(const int max_filters);
+bool regexset_add(regexSet *set, const char *pattern, const int index);
+void regexset_compile(regexSet *set);
+int regexset_match(regexSet *set, const char *input, const uint64_t *enabled);
+int regexset_size(const regexSet *set) __attribute__((pure));
+void regexset_free(regexSet *set);
+
+// Prefilter matching the required literals of many filters at once
+typedef struct literalSet literalSet;
+
+char *regex_required_literal(const char *pattern);
+literalSet *literalset_new(void);
+bool literalset_add(literalSet *set, const char *literal, const int index);
+void literalset_compile(literalSet *set);
+void literalset_match(const literalSet *set, const char *input, uint64_t *found);
+void literalset_free(literalSet *set);
+
+#endif //REGEXSET_H
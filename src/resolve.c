@@ -244,16 +244,12 @@ static char *resolveHostname(const char *addr)
 	return hostname;
 }
 
-// Resolve upstream destination host names
-static size_t resolveAndAddHostname(size_t ippos, size_t oldnamepos)
+// Resolve the host name of an IP address. Returns the new host name or NULL
+// if it did not change. Adding it to the shared string buffer is up to the
+// caller as string positions may change whenever the lock is released (the
+// buffer is compacted by the GC thread)
+static char *resolveChangedHostname(const char *ipaddr, const char *oldname)
 {
-	// Get IP and host name strings. They are cloned in case shared memory is
-	// resized before the next lock
-	lock_shm();
-	char* ipaddr = strdup(getstr(ippos));
-	char* oldname = strdup(getstr(oldnamepos));
-	unlock_shm();
-
 	// Important: Don't hold a lock while resolving as the main thread
 	// (dnsmasq) needs to be operable during the call to resolveHostname()
 	char* newname = resolveHostname(ipaddr);
@@ -270,29 +266,18 @@ static size_t resolveAndAddHostname(size_t ippos, size_t oldnamepos)
 	// We do not need to check for oldname == NULL as names are
 	// always initialized with an empty string at position 0
 	if(newname != NULL && strcmp(oldname, newname) != 0)
-	{
-		lock_shm();
-		size_t newnamepos = addstr(newname);
-		// newname has already been checked against NULL
-		// so we can safely free it
-		free(newname);
-		free(ipaddr);
-		free(oldname);
-		unlock_shm();
-		return newnamepos;
-	}
+		return newname;
 	else if(config.debug & DEBUG_SHMEM)
 	{
 		// Debugging output
 		logg("Not adding \"%s\" to buffer (unchanged)", oldname);
 	}
 
-	free(newname);
-	free(ipaddr);
-	free(oldname);
+	if(newname != NULL)
+		free(newname);
 
-	// Not changed, return old namepos
-	return oldnamepos;
+	// Not changed
+	return NULL;
 }
 
 // Resolve client host names
@@ -317,21 +302,25 @@ void resolveClients(const bool onlynew)
 			continue;
 		}
 
-		bool newflag = client->new;
-		size_t ippos = client->ippos;
-		size_t oldnamepos = client->namepos;
-		unlock_shm();
-
 		// If onlynew flag is set, we will only resolve new clients
 		// If not, we will try to re-resolve all known clients
-		if(onlynew && !newflag)
+		if(onlynew && !client->new)
 		{
+			unlock_shm();
 			skipped++;
 			continue;
 		}
 
+		// Get IP and host name strings. They are cloned as positions and
+		// pointers may change before the next lock
+		char *ipaddr = strdup(getstr(client->ippos));
+		char *oldname = strdup(getstr(client->namepos));
+		unlock_shm();
+
 		// Obtain/update hostname of this client
-		size_t newnamepos = resolveAndAddHostname(ippos, oldnamepos);
+		char *newname = resolveChangedHostname(ipaddr, oldname);
+		free(ipaddr);
+		free(oldname);
 
 		lock_shm();
 		// Get client pointer for the second time (writing data)
@@ -342,12 +331,18 @@ void resolveClients(const bool onlynew)
 		if(client == NULL)
 		{
 			logg("ERROR: Unable to get client pointer (2) with ID %i, skipping...", clientID);
+			if(newname != NULL)
+				free(newname);
 			skipped++;
 			continue;
 		}
 
-		// Store obtained host name (may be unchanged)
-		client->namepos = newnamepos;
+		// Store obtained host name (if changed)
+		if(newname != NULL)
+		{
+			client->namepos = addstr(newname);
+			free(newname);
+		}
 		// Mark entry as not new
 		client->new = false;
 		unlock_shm();
@@ -382,21 +377,25 @@ void resolveForwardDestinations(const bool onlynew)
 			continue;
 		}
 
-		bool newflag = upstream->new;
-		size_t ippos = upstream->ippos;
-		size_t oldnamepos = upstream->namepos;
-		unlock_shm();
-
 		// If onlynew flag is set, we will only resolve new upstream destinations
 		// If not, we will try to re-resolve all known upstream destinations
-		if(onlynew && !newflag)
+		if(onlynew && !upstream->new)
 		{
+			unlock_shm();
 			skipped++;
 			continue;
 		}
 
+		// Get IP and host name strings. They are cloned as positions and
+		// pointers may change before the next lock
+		char *ipaddr = strdup(getstr(upstream->ippos));
+		char *oldname = strdup(getstr(upstream->namepos));
+		unlock_shm();
+
 		// Obtain/update hostname of this client
-		size_t newnamepos = resolveAndAddHostname(ippos, oldnamepos);
+		char *newname = resolveChangedHostname(ipaddr, oldname);
+		free(ipaddr);
+		free(oldname);
 
 		lock_shm();
 		// Get upstream pointer for the second time (writing data)
@@ -407,12 +406,18 @@ void resolveForwardDestinations(const bool onlynew)
 		if(upstream == NULL)
 		{
 			logg("ERROR: Unable to get upstream pointer with ID %i, skipping...", upstreamID);
+			if(newname != NULL)
+				free(newname);
 			skipped++;
 			continue;
 		}
 
-		// Store obtained host name (may be unchanged)
-		upstream->namepos = newnamepos;
+		// Store obtained host name (if changed)
+		if(newname != NULL)
+		{
+			upstream->namepos = addstr(newname);
+			free(newname);
+		}
 		// Mark entry as not new
 		upstream->new = false;
 		unlock_shm();
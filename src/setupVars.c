@@ -13,9 +13,50 @@
 #include "memory.h"
 #include "config.h"
 #include "setupVars.h"
-
-int setupVarsElements = 0;
-char ** setupVarsArray = NULL;
+// hashSlot
+#include "hashtable.h"
+#include <sys/inotify.h>
+
+// setupVars.conf is parsed once into an in-memory cache which is only
+// refreshed when inotify reports that the file changed, so API requests do
+// not have to read the file while holding the shared memory lock. The values
+// are additionally split at commas into (exclusion) lists whose exact
+// entries are put into a hash set, only wildcard entries need to be matched
+// one by one
+typedef struct {
+	char *key;
+	char *value;
+	// Value split at commas
+	char *list;
+	char **items;
+	int numitems;
+	// Exact entries
+	hashSlot *set;
+	size_t setsize;
+	// Entries starting with '*' (without the asterisk)
+	char **wildcards;
+	int numwildcards;
+} setupVar;
+
+typedef struct {
+	setupVar *vars;
+	int num;
+	// References held by threads (plus one for the cache itself)
+	int refs;
+} setupVarsCache;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static setupVarsCache *cache = NULL;
+static int inotify_fd = -1;
+static pid_t inotify_pid = 0;
+static struct stat cache_stat = { 0 };
+
+// Thread-local as API threads may read setupVars.conf concurrently
+// while holding the shared lock
+static __thread int setupVarsElements = 0;
+static __thread char ** setupVarsArray = NULL;
+static __thread setupVarsCache *thread_cache = NULL;
+static __thread const setupVar *thread_var = NULL;
 
 void check_setupVarsconf(void)
 {
@@ -61,71 +102,285 @@ void trim_whitespace(char *string)
 		*modified = '\0';
 }
 
-// This will hold the read string
-// in memory and will serve the space
-// we will point to in the rest of the
-// process (e.g. setupVarsArray will
-// actually point to memory addresses
-// which we allocate for this buffer.
-char * linebuffer = NULL;
-size_t linebuffersize = 0;
+// This will hold a copy of the value returned by read_setupVarsconf() which
+// callers are allowed to modify. It is valid until clearSetupVarsArray()
+static __thread char * linebuffer = NULL;
 
-char * read_setupVarsconf(const char * key)
+static __thread const char *match_str = NULL;
+static __thread const setupVar *match_var = NULL;
+static bool item_matches(const int ID, const void *key)
 {
-	FILE *setupVarsfp;
-	if((setupVarsfp = fopen(FTLfiles.setupVars, "r")) == NULL)
+	(void)key;
+	return strcmp(match_var->items[ID], match_str) == 0;
+}
+
+static void parse_list(setupVar *var)
+{
+	var->list = strdup(var->value);
+	if(var->list == NULL)
+		return;
+
+	// Count entries to size the arrays
+	int num = 1;
+	for(const char *p = var->list; *p; p++)
+		if(*p == ',')
+			num++;
+
+	var->items = calloc(num, sizeof(char*));
+	var->wildcards = calloc(num, sizeof(char*));
+	var->setsize = hashtable_size(num);
+	var->set = calloc(var->setsize, sizeof(hashSlot));
+	if(var->items == NULL || var->wildcards == NULL || var->set == NULL)
+		return;
+
+	char *saveptr = NULL;
+	for(char *p = strtok_r(var->list, ",", &saveptr); p != NULL; p = strtok_r(NULL, ",", &saveptr))
 	{
-		logg("WARN: Reading setupVars.conf failed: %s", strerror(errno));
-		return NULL;
+		if(p[0] == '*')
+		{
+			var->wildcards[var->numwildcards++] = p + 1;
+			continue;
+		}
+
+		var->items[var->numitems] = p;
+		hashtable_insert(var->set, var->setsize, hashStr(p), var->numitems);
+		var->numitems++;
 	}
+}
 
-	// Allocate keystr
-	char * keystr = calloc(strlen(key)+2, sizeof(char));
-	if(keystr == NULL)
+static void free_cache(setupVarsCache *old)
+{
+	for(int i = 0; i < old->num; i++)
 	{
-		logg("WARN: read_setupVarsconf failed: could not allocate memory for keystr");
-		fclose(setupVarsfp);
+		free(old->vars[i].key);
+		free(old->vars[i].value);
+		free(old->vars[i].list);
+		free(old->vars[i].items);
+		free(old->vars[i].set);
+		free(old->vars[i].wildcards);
+	}
+	free(old->vars);
+	free(old);
+}
+
+static setupVarsCache *parse_setupVarsconf(void)
+{
+	setupVarsCache *new = calloc(1, sizeof(setupVarsCache));
+	if(new == NULL)
 		return NULL;
+	new->refs = 1;
+
+	FILE *setupVarsfp;
+	if((setupVarsfp = fopen(FTLfiles.setupVars, "r")) == NULL)
+	{
+		logg("WARN: Reading setupVars.conf failed: %s", strerror(errno));
+		return new;
 	}
-	sprintf(keystr, "%s=", key);
 
+	char *line = NULL;
+	size_t size = 0;
+	int capacity = 0;
 	errno = 0;
-	while(getline(&linebuffer, &linebuffersize, setupVarsfp) != -1)
+	while(getline(&line, &size, setupVarsfp) != -1)
 	{
 		// Strip (possible) newline
-		linebuffer[strcspn(linebuffer, "\n")] = '\0';
+		line[strcspn(line, "\n")] = '\0';
 
 		// Skip comment lines
-		if(linebuffer[0] == '#' || linebuffer[0] == ';')
+		if(line[0] == '#' || line[0] == ';')
 			continue;
 
-		// Skip lines with other keys
-		if((strstr(linebuffer, keystr)) == NULL)
+		// Skip lines without key
+		char *equals = find_equals(line);
+		if(*equals != '=')
+			continue;
+		*equals = '\0';
+		trim_whitespace(line);
+
+		// The first occurrence of a key is used
+		bool known = false;
+		for(int i = 0; i < new->num && !known; i++)
+			known = strcmp(new->vars[i].key, line) == 0;
+		if(known)
 			continue;
 
-		// otherwise: key found
-		fclose(setupVarsfp);
-		free(keystr);
-		return (find_equals(linebuffer) + 1);
+		if(new->num >= capacity)
+		{
+			capacity = capacity > 0 ? 2*capacity : 32;
+			setupVar *vars = realloc(new->vars, capacity*sizeof(setupVar));
+			if(vars == NULL)
+				break;
+			new->vars = vars;
+		}
+
+		setupVar *var = &new->vars[new->num];
+		memset(var, 0, sizeof(*var));
+		var->key = strdup(line);
+		var->value = strdup(equals + 1);
+		if(var->key == NULL || var->value == NULL)
+		{
+			free(var->key);
+			free(var->value);
+			break;
+		}
+		parse_list(var);
+		new->num++;
 	}
 
 	if(errno == ENOMEM)
 		logg("WARN: read_setupVarsconf failed: could not allocate memory for getline");
 
-	// Key not found -> return NULL
+	free(line);
 	fclose(setupVarsfp);
 
-	// Freeing keystr, not setting to NULL, since not used outside of this routine
-	free(keystr);
+	return new;
+}
 
-	// Freeing and setting to NULL to prevent a dangling pointer
-	if(linebuffer != NULL)
+// Watch the directory containing setupVars.conf as the file is typically
+// replaced (e.g. by sed -i) rather than modified in place
+static void init_inotify(void)
+{
+	if(inotify_fd > -1)
+		close(inotify_fd);
+	inotify_pid = getpid();
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotify_fd < 0)
 	{
-		free(linebuffer);
-		linebuffersize = 0;
-		linebuffer = NULL;
+		logg("WARN: Cannot watch setupVars.conf for changes: %s", strerror(errno));
+		return;
+	}
+
+	char *dir = strdup(FTLfiles.setupVars);
+	if(dir == NULL)
+		return;
+	char *slash = strrchr(dir, '/');
+	if(slash == dir)
+		slash[1] = '\0';
+	else if(slash != NULL)
+		*slash = '\0';
+	else
+		strcpy(dir, ".");
+
+	if(inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+	                                      IN_CREATE | IN_DELETE) < 0)
+	{
+		logg("WARN: Cannot watch %s for changes: %s", dir, strerror(errno));
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	free(dir);
+}
+
+// Check if setupVars.conf may have changed since it was parsed
+static bool setupVars_changed(void)
+{
+	// The inotify instance is not shared with forked processes as they
+	// would otherwise consume each other's events
+	if(inotify_pid != getpid())
+	{
+		init_inotify();
+		return true;
 	}
 
+	if(inotify_fd < 0)
+	{
+		// Fall back to comparing the file's metadata
+		struct stat st = { 0 };
+		stat(FTLfiles.setupVars, &st);
+		const bool changed = st.st_ino != cache_stat.st_ino ||
+		                     st.st_size != cache_stat.st_size ||
+		                     st.st_mtim.tv_sec != cache_stat.st_mtim.tv_sec ||
+		                     st.st_mtim.tv_nsec != cache_stat.st_mtim.tv_nsec;
+		cache_stat = st;
+		return changed;
+	}
+
+	const char *name = strrchr(FTLfiles.setupVars, '/');
+	name = name != NULL ? name + 1 : FTLfiles.setupVars;
+
+	bool changed = false;
+	char buffer[4096];
+	ssize_t len;
+	while((len = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+	{
+		for(char *p = buffer; p < buffer + len;)
+		{
+			struct inotify_event event;
+			memcpy(&event, p, sizeof(event));
+			const char *evname = p + sizeof(event);
+			if(event.mask & IN_Q_OVERFLOW ||
+			   (event.len > 0 && strcmp(evname, name) == 0))
+				changed = true;
+			p += sizeof(event) + event.len;
+		}
+	}
+
+	return changed;
+}
+
+// Get a reference to the current cache, refreshing it first if needed
+static setupVarsCache *acquire_cache(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	if(setupVars_changed() || cache == NULL)
+	{
+		setupVarsCache *new = parse_setupVarsconf();
+		if(new != NULL)
+		{
+			if(cache != NULL && --cache->refs == 0)
+				free_cache(cache);
+			cache = new;
+		}
+	}
+
+	setupVarsCache *current = cache;
+	if(current != NULL)
+		current->refs++;
+	pthread_mutex_unlock(&cache_lock);
+
+	return current;
+}
+
+static void release_cache(setupVarsCache *old)
+{
+	if(old == NULL)
+		return;
+
+	pthread_mutex_lock(&cache_lock);
+	if(--old->refs == 0)
+		free_cache(old);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+char * read_setupVarsconf(const char * key)
+{
+	// Release anything left over from a previous call
+	clearSetupVarsArray();
+
+	thread_cache = acquire_cache();
+	if(thread_cache == NULL)
+		return NULL;
+
+	for(int i = 0; i < thread_cache->num; i++)
+	{
+		const setupVar *var = &thread_cache->vars[i];
+		if(strcmp(var->key, key) != 0)
+			continue;
+
+		// otherwise: key found
+		linebuffer = strdup(var->value);
+		if(linebuffer == NULL)
+		{
+			logg("WARN: read_setupVarsconf failed: could not allocate memory");
+			break;
+		}
+		thread_var = var;
+		return linebuffer;
+	}
+
+	// Key not found -> return NULL
+	clearSetupVarsArray();
 	return NULL;
 }
 
@@ -136,9 +391,17 @@ char * read_setupVarsconf(const char * key)
 // setupVarsArray[1] = def
 // setupVarsArray[2] = ghi
 // setupVarsArray[3] = NULL
+// If input is the value just returned by read_setupVarsconf(), the list
+// pre-built from the cache is used instead
 void getSetupVarsArray(const char * input)
 {
-	char * p = strtok((char*)input, ",");
+	if(thread_var != NULL && input == linebuffer &&
+	   strcmp(input, thread_var->value) == 0)
+		return;
+	thread_var = NULL;
+
+	char *saveptr = NULL;
+	char * p = strtok_r((char*)input, ",", &saveptr);
 
 	/* split string and append tokens to 'res' */
 
@@ -146,7 +409,7 @@ void getSetupVarsArray(const char * input)
 		setupVarsArray = realloc(setupVarsArray, sizeof(char*) * ++setupVarsElements);
 		if(setupVarsArray == NULL) return;
 		setupVarsArray[setupVarsElements-1] = p;
-		p = strtok(NULL, ",");
+		p = strtok_r(NULL, ",", &saveptr);
 	}
 
 	/* realloc one extra element for the last NULL */
@@ -169,9 +432,11 @@ void clearSetupVarsArray(void)
 	if(linebuffer != NULL)
 	{
 		free(linebuffer);
-		linebuffersize = 0;
 		linebuffer = NULL;
 	}
+	thread_var = NULL;
+	release_cache(thread_cache);
+	thread_cache = NULL;
 }
 
 /* Example
@@ -192,26 +457,30 @@ bool insetupVarsArray(const char * str)
 	if(str == NULL)
 		return false;
 
+	// Use the pre-built list if available
+	if(thread_var != NULL)
+	{
+		if(thread_var->set != NULL)
+		{
+			match_str = str;
+			match_var = thread_var;
+			if(hashtable_find(thread_var->set, thread_var->setsize, hashStr(str), item_matches, str) > -1)
+				return true;
+		}
+
+		for(int i = 0; i < thread_var->numwildcards; i++)
+			if(strstr(str, thread_var->wildcards[i]) != NULL)
+				return true;
+
+		return false;
+	}
+
 	// Loop over all entries in setupVarsArray
 	for (int i = 0; i < setupVarsElements; ++i)
 		if(setupVarsArray[i][0] == '*')
 		{
-			// Copying strlen-1 chars into buffer of size strlen: OK
-			size_t lenght = strlen(setupVarsArray[i]);
-			char * domain = calloc(lenght, sizeof(char));
-			if(domain == NULL) return false;
-			// strncat() NULL-terminates the copied string (strncpy() doesn't!)
-			strncat(domain, setupVarsArray[i]+1, lenght-1);
-
-			if(strstr(str, domain) != NULL)
-			{
-				free(domain);
+			if(strstr(str, setupVarsArray[i]+1) != NULL)
 				return true;
-			}
-			else
-			{
-				free(domain);
-			}
 		}
 		else
 		{
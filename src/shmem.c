@@ -16,38 +16,82 @@
 #include "config.h"
 // data getter functions
 #include "datastructure.h"
+// topListsStruct
+#include "toplist.h"
 
 /// The version of shared memory used
-#define SHARED_MEMORY_VERSION 9
+#define SHARED_MEMORY_VERSION 16
 
 /// The name of the shared memory. Use this when connecting to the shared memory.
 #define SHARED_LOCK_NAME "/FTL-lock"
 #define SHARED_STRINGS_NAME "/FTL-strings"
 #define SHARED_COUNTERS_NAME "/FTL-counters"
 #define SHARED_DOMAINS_NAME "/FTL-domains"
+#define SHARED_DOMAINS_HASH_NAME "/FTL-domains-hash"
 #define SHARED_CLIENTS_NAME "/FTL-clients"
+#define SHARED_CLIENTS_HASH_NAME "/FTL-clients-hash"
 #define SHARED_QUERIES_NAME "/FTL-queries"
+#define SHARED_QUERIES_HASH_NAME "/FTL-queries-hash"
 #define SHARED_UPSTREAMS_NAME "/FTL-upstreams"
 #define SHARED_OVERTIME_NAME "/FTL-overTime"
 #define SHARED_SETTINGS_NAME "/FTL-settings"
 #define SHARED_DNS_CACHE "/FTL-dns-cache"
+#define SHARED_DNS_CACHE_HASH "/FTL-dns-cache-hash"
 #define SHARED_PER_CLIENT_REGEX "/FTL-per-client-regex"
+#define SHARED_STRINGS_HASH_NAME "/FTL-strings-hash"
+#define SHARED_QUERY_POSTINGS_NAME "/FTL-query-postings"
+#define SHARED_TOPLISTS_NAME "/FTL-toplists"
+
+// Address space reserved for shared memory objects which can grow. They are
+// mapped with this size right away so they can grow without being moved
+// unless they exceed it. The reservations are sized per object as address
+// space is limited, e.g., to 512 GiB on arm64 kernels with 39-bit virtual
+// addresses or by RLIMIT_AS. On 32-bit systems, only 1/128 of the size is
+// reserved, so /FTL-queries (16 MiB) is outgrown after less than half a
+// million queries and moved anyway. Pointers into shared memory must not be
+// assumed to be stable there
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define SHM_RESERVE(mib) ((size_t)(mib) << 20)
+#else
+#define SHM_RESERVE(mib) ((size_t)(mib) << 13)
+#endif
 
 // Global counters struct
 countersStruct *counters = NULL;
 
+// Global top lists struct
+topListsStruct *toplists = NULL;
+
+// Chunk of a posting list. Entries before start belong to queries which have
+// already been removed by the garbage collector
+#define POSTING_CHUNK_IDS 28
+typedef struct {
+	int prev;
+	int next;
+	int start;
+	int count;
+	int ids[POSTING_CHUNK_IDS];
+} postingChunk;
+
 /// The pointer in shared memory to the shared string buffer
 static SharedMemory shm_lock = { 0 };
 static SharedMemory shm_strings = { 0 };
+static SharedMemory shm_strings_hash = { 0 };
 static SharedMemory shm_counters = { 0 };
 static SharedMemory shm_domains = { 0 };
+static SharedMemory shm_domains_hash = { 0 };
 static SharedMemory shm_clients = { 0 };
+static SharedMemory shm_clients_hash = { 0 };
 static SharedMemory shm_queries = { 0 };
+static SharedMemory shm_queries_hash = { 0 };
 static SharedMemory shm_upstreams = { 0 };
 static SharedMemory shm_overTime = { 0 };
 static SharedMemory shm_settings = { 0 };
 static SharedMemory shm_dns_cache = { 0 };
+static SharedMemory shm_dns_cache_hash = { 0 };
 static SharedMemory shm_per_client_regex = { 0 };
+static SharedMemory shm_query_postings = { 0 };
+static SharedMemory shm_toplists = { 0 };
 
 // Variable size array structs
 static queriesData *queries = NULL;
@@ -56,17 +100,28 @@ static domainsData *domains = NULL;
 static upstreamsData *upstreams = NULL;
 static DNSCacheData *dns_cache = NULL;
 
+// The shared memory lock is a reader/writer lock built from robust mutexes
+// so that it survives processes dying while holding it. Writers hold the
+// main lock for the entire time they access shared memory. Readers hold it
+// only while claiming one of the reader slots. Writers wait for all claimed
+// reader slots to be released after having obtained the main lock
 typedef struct {
 	pthread_mutex_t lock;
+	pthread_mutex_t readers[NUM_READER_SLOTS];
 	bool waitingForLock;
+	unsigned int seq;
+	unsigned long wait_histogram[2][LOCK_WAIT_BINS];
 } ShmLock;
 static ShmLock *shmLock = NULL;
 static ShmSettings *shmSettings = NULL;
 
 static int pagesize;
 static unsigned int local_shm_counter = 0;
+// Reader slot claimed by the current thread
+static __thread int reader_slot = -1;
 
 static size_t get_optimal_object_size(const size_t objsize, const size_t minsize);
+static void rehash_index(const enum memory_type which, const bool force);
 
 // chown_shmem() changes the file ownership of a given shared memory object
 static bool chown_shmem(SharedMemory *sharedMemory, struct passwd *ent_pw)
@@ -97,15 +152,52 @@ void chown_all_shmem(struct passwd *ent_pw)
 {
 	chown_shmem(&shm_lock, ent_pw);
 	chown_shmem(&shm_strings, ent_pw);
+	chown_shmem(&shm_strings_hash, ent_pw);
 	chown_shmem(&shm_counters, ent_pw);
 	chown_shmem(&shm_domains, ent_pw);
+	chown_shmem(&shm_domains_hash, ent_pw);
 	chown_shmem(&shm_clients, ent_pw);
+	chown_shmem(&shm_clients_hash, ent_pw);
 	chown_shmem(&shm_queries, ent_pw);
+	chown_shmem(&shm_queries_hash, ent_pw);
 	chown_shmem(&shm_upstreams, ent_pw);
 	chown_shmem(&shm_overTime, ent_pw);
 	chown_shmem(&shm_settings, ent_pw);
 	chown_shmem(&shm_dns_cache, ent_pw);
+	chown_shmem(&shm_dns_cache_hash, ent_pw);
 	chown_shmem(&shm_per_client_regex, ent_pw);
+	chown_shmem(&shm_query_postings, ent_pw);
+	chown_shmem(&shm_toplists, ent_pw);
+}
+
+static __thread const char *match_strings = NULL;
+
+static bool string_matches(const int pos, const void *key)
+{
+	return strcmp(&match_strings[pos], key) == 0;
+}
+
+// Re-create the string index with the given number of slots from all
+// strings in the pool
+static void rehash_strings(const size_t slots)
+{
+	if(slots*sizeof(hashSlot) > shm_strings_hash.size)
+		realloc_shm(&shm_strings_hash, slots*sizeof(hashSlot), true);
+	counters->strings_hash_MAX = shm_strings_hash.size/sizeof(hashSlot);
+
+	hashSlot *table = (hashSlot*)shm_strings_hash.ptr;
+	memset(table, 0, shm_strings_hash.size);
+	shmSettings->num_strings = 0;
+
+	const char *pool = shm_strings.ptr;
+	for(size_t pos = 1; pos < shmSettings->next_str_pos; pos += strlen(&pool[pos]) + 1)
+	{
+		hashtable_insert(table, counters->strings_hash_MAX, hashStr(&pool[pos]), pos);
+		shmSettings->num_strings++;
+	}
+
+	if(config.debug & DEBUG_SHMEM)
+		logg("Rehashed %u strings into %i slots", shmSettings->num_strings, counters->strings_hash_MAX);
 }
 
 size_t addstr(const char *str)
@@ -132,27 +224,126 @@ size_t addstr(const char *str)
 		len = pagesize;
 	}
 
+	// Identical strings are stored only once
+	const uint32_t hash = hashBytes(str, len - 1);
+	match_strings = shm_strings.ptr;
+	const int pos = hashtable_find(shm_strings_hash.ptr, counters->strings_hash_MAX,
+	                               hash, string_matches, str);
+	if(pos > 0)
+	{
+		if(config.debug & DEBUG_SHMEM)
+			logg("Re-using \"%s\" at position %i of the buffer", str, pos);
+		return pos;
+	}
+
 	// Debugging output
 	if(config.debug & DEBUG_SHMEM)
 		logg("Adding \"%s\" (len %zu) to buffer. next_str_pos is %u", str, len, shmSettings->next_str_pos);
 
-	// Reserve additional memory if necessary
-	if(shmSettings->next_str_pos + len > shm_strings.size &&
-	   !realloc_shm(&shm_strings, shm_strings.size + pagesize, true))
-		return 0;
+	// Reserve additional memory if necessary. The buffer grows by half of
+	// its size to avoid having to remap it in all processes frequently
+	if(shmSettings->next_str_pos + len > shm_strings.size)
+	{
+		size_t size = shm_strings.size + shm_strings.size/2;
+		if(size < shmSettings->next_str_pos + len)
+			size = shmSettings->next_str_pos + len;
+		size = ((size + pagesize - 1) / pagesize) * pagesize;
+		if(!realloc_shm(&shm_strings, size, true))
+			return 0;
+	}
 
 	// Store new string buffer size in corresponding counters entry
 	// for re-using when we need to re-map shared memory objects
 	counters->strings_MAX = shm_strings.size;
 
 	// Copy the C string pointed by str into the shared string buffer
-	strncpy(&((char*)shm_strings.ptr)[shmSettings->next_str_pos], str, len);
+	char *dest = &((char*)shm_strings.ptr)[shmSettings->next_str_pos];
+	memcpy(dest, str, len - 1);
+	dest[len - 1] = '\0';
 
 	// Increment string length counter
+	const size_t newpos = shmSettings->next_str_pos;
 	shmSettings->next_str_pos += len;
 
+	// Add string to the index, keeping its load factor at most 50%
+	if(2u*(shmSettings->num_strings + 1u) > (unsigned int)counters->strings_hash_MAX)
+		rehash_strings(2u*counters->strings_hash_MAX);
+	else
+	{
+		hashtable_insert(shm_strings_hash.ptr, counters->strings_hash_MAX, hash, newpos);
+		shmSettings->num_strings++;
+	}
+
 	// Return start of stored string
-	return (shmSettings->next_str_pos - len);
+	return newpos;
+}
+
+// Copy a string into the new pool being built by compact_strings() unless
+// it is already there
+static size_t compact_string(const size_t pos, char *pool, size_t *next)
+{
+	if(pos == 0u || pos >= shmSettings->next_str_pos)
+		return 0u;
+
+	const char *str = &((const char*)shm_strings.ptr)[pos];
+	const uint32_t hash = hashStr(str);
+	match_strings = pool;
+	const int found = hashtable_find(shm_strings_hash.ptr, counters->strings_hash_MAX,
+	                                 hash, string_matches, str);
+	if(found > 0)
+		return found;
+
+	const size_t len = strlen(str) + 1;
+	const size_t newpos = *next;
+	memcpy(&pool[newpos], str, len);
+	*next += len;
+	hashtable_insert(shm_strings_hash.ptr, counters->strings_hash_MAX, hash, newpos);
+	shmSettings->num_strings++;
+	return newpos;
+}
+
+// Remove strings which are no longer referenced, e.g., old host names. This
+// is only done when the pool has doubled in size since it was last compacted
+// so the cost of scanning all references is amortized
+void compact_strings(void)
+{
+	const unsigned int oldsize = shmSettings->next_str_pos;
+	if(oldsize <= 2u*shmSettings->compacted_str_pos)
+		return;
+
+	char *pool = calloc(oldsize, sizeof(char));
+	if(pool == NULL)
+		return;
+
+	memset(shm_strings_hash.ptr, 0, shm_strings_hash.size);
+	shmSettings->num_strings = 0;
+	size_t next = 1u;
+
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+		domains[domainID].domainpos = compact_string(domains[domainID].domainpos, pool, &next);
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		clientsData *client = &clients[clientID];
+		client->ippos = compact_string(client->ippos, pool, &next);
+		client->namepos = compact_string(client->namepos, pool, &next);
+		client->groupspos = compact_string(client->groupspos, pool, &next);
+	}
+	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
+	{
+		upstreamsData *upstream = &upstreams[upstreamID];
+		upstream->ippos = compact_string(upstream->ippos, pool, &next);
+		upstream->namepos = compact_string(upstream->namepos, pool, &next);
+	}
+
+	// The empty string at position zero is kept
+	memcpy((char*)shm_strings.ptr + 1, pool + 1, next - 1u);
+	shmSettings->next_str_pos = next;
+	shmSettings->compacted_str_pos = next;
+	free(pool);
+
+	if(config.debug & DEBUG_SHMEM)
+		logg("Compacted string buffer from %u to %zu bytes (%u strings)",
+		     oldsize, next, shmSettings->num_strings);
 }
 
 const char *getstr(const size_t pos)
@@ -196,38 +387,87 @@ static void remap_shm(void)
 	realloc_shm(&shm_queries, counters->queries_MAX*sizeof(queriesData), false);
 	queries = (queriesData*)shm_queries.ptr;
 
+	realloc_shm(&shm_queries_hash, hashtable_size(counters->queries_MAX)*sizeof(hashSlot), false);
+
 	realloc_shm(&shm_domains, counters->domains_MAX*sizeof(domainsData), false);
 	domains = (domainsData*)shm_domains.ptr;
 
+	realloc_shm(&shm_domains_hash, hashtable_size(counters->domains_MAX)*sizeof(hashSlot), false);
+	// hash indices are not exposed by a global pointer
+
 	realloc_shm(&shm_clients, counters->clients_MAX*sizeof(clientsData), false);
 	clients = (clientsData*)shm_clients.ptr;
 
+	realloc_shm(&shm_clients_hash, hashtable_size(counters->clients_MAX)*sizeof(hashSlot), false);
+
 	realloc_shm(&shm_upstreams, counters->upstreams_MAX*sizeof(upstreamsData), false);
 	upstreams = (upstreamsData*)shm_upstreams.ptr;
 
 	realloc_shm(&shm_dns_cache, counters->dns_cache_MAX*sizeof(DNSCacheData), false);
 	dns_cache = (DNSCacheData*)shm_dns_cache.ptr;
 
+	realloc_shm(&shm_dns_cache_hash, hashtable_size(counters->dns_cache_MAX)*sizeof(hashSlot), false);
+
 	realloc_shm(&shm_strings, counters->strings_MAX, false);
 	// strings are not exposed by a global pointer
 
+	realloc_shm(&shm_strings_hash, counters->strings_hash_MAX*sizeof(hashSlot), false);
+
+	realloc_shm(&shm_per_client_regex, counters->per_client_regex_MAX, false);
+
+	realloc_shm(&shm_query_postings, counters->postings_MAX*sizeof(postingChunk), false);
+
 	// Update local counter to reflect that we absorbed this change
 	local_shm_counter = shmSettings->global_shm_counter;
 }
 
-void _lock_shm(const char* func, const int line, const char * file) {
-	// Signal that FTL is waiting for a lock
-	shmLock->waitingForLock = true;
+// Lock a robust mutex, making it consistent if its previous owner died
+static int lock_robust(pthread_mutex_t *mutex, const bool try)
+{
+	int result = try ? pthread_mutex_trylock(mutex) : pthread_mutex_lock(mutex);
 
-	if(config.debug & DEBUG_LOCKS)
-		logg("Waiting for lock in %s() (%s:%i)", func, file, line);
+	if(result == EOWNERDEAD) {
+		// Try to make the lock consistent if the other process died while
+		// holding the lock
+		result = pthread_mutex_consistent(mutex);
+
+		// A writer which died between the two increments of the sequence
+		// number left it odd. Make it even again, otherwise the next
+		// writer would make it even while writing and lock-free readers
+		// would accept torn snapshots from then on
+		if(result == 0 && mutex == &shmLock->lock &&
+		   __atomic_load_n(&shmLock->seq, __ATOMIC_RELAXED) & 1)
+			__atomic_fetch_add(&shmLock->seq, 1, __ATOMIC_SEQ_CST);
+	}
 
-	int result = pthread_mutex_lock(&shmLock->lock);
+	return result;
+}
 
-	if(config.debug & DEBUG_LOCKS)
-		logg("Obtained lock for %s() (%s:%i)", func, file, line);
+static double lock_timestamp_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e6 + ts.tv_nsec*1e-3;
+}
+
+// Sort the time spent waiting for a lock into a histogram with bins of
+// doubling width: bin 0 counts waits below 1 us, bin 1 below 2 us, bin 2
+// below 4 us, etc. The last bin collects all longer waits
+static void record_lock_wait(const bool writer, const double start)
+{
+	const double waited = lock_timestamp_us() - start;
+	unsigned int bin = 0;
+	for(double limit = 1.0; waited >= limit && bin < LOCK_WAIT_BINS-1; limit *= 2.0)
+		bin++;
 
-	// Check if this process needs to remap the shared memory objects
+	__atomic_fetch_add(&shmLock->wait_histogram[writer ? 1 : 0][bin], 1, __ATOMIC_RELAXED);
+}
+
+// Check if this process needs to remap the shared memory objects. This is
+// always done while holding the main lock so no writer can change the
+// objects and no other thread of this process can remap concurrently
+static void check_remap(void)
+{
 	if(shmSettings != NULL &&
 	   local_shm_counter != shmSettings->global_shm_counter)
 	{
@@ -236,22 +476,49 @@ void _lock_shm(const char* func, const int line, const char * file) {
 		             local_shm_counter, shmSettings->global_shm_counter);
 		remap_shm();
 	}
+}
+
+void _lock_shm(const char* func, const int line, const char * file) {
+	// Signal that FTL is waiting for a lock
+	shmLock->waitingForLock = true;
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Waiting for lock in %s() (%s:%i)", func, file, line);
+
+	const double start = lock_timestamp_us();
+	int result = lock_robust(&shmLock->lock, false);
+
+	// Wait for all readers to finish. No new readers can enter as they
+	// need the main lock to claim a reader slot
+	for(unsigned int i = 0; i < NUM_READER_SLOTS; i++)
+	{
+		if(lock_robust(&shmLock->readers[i], false) == 0)
+			pthread_mutex_unlock(&shmLock->readers[i]);
+	}
+
+	record_lock_wait(true, start);
+
+	// Odd sequence number: lock-free readers of counters and overTime
+	// have to retry until we are done
+	__atomic_fetch_add(&shmLock->seq, 1, __ATOMIC_SEQ_CST);
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Obtained lock for %s() (%s:%i)", func, file, line);
+
+	check_remap();
 
 	// Turn off the waiting for lock signal to notify everyone who was
 	// deferring to FTL that they can jump in the lock queue.
 	shmLock->waitingForLock = false;
 
-	if(result == EOWNERDEAD) {
-		// Try to make the lock consistent if the other process died while
-		// holding the lock
-		result = pthread_mutex_consistent(&shmLock->lock);
-	}
-
 	if(result != 0)
 		logg("Failed to obtain SHM lock: %s", strerror(result));
 }
 
 void _unlock_shm(const char* func, const int line, const char * file) {
+	// Even sequence number: all writes are done
+	__atomic_fetch_add(&shmLock->seq, 1, __ATOMIC_SEQ_CST);
+
 	int result = pthread_mutex_unlock(&shmLock->lock);
 
 	if(config.debug & DEBUG_LOCKS)
@@ -261,6 +528,187 @@ void _unlock_shm(const char* func, const int line, const char * file) {
 		logg("Failed to unlock SHM lock: %s", strerror(result));
 }
 
+void _lock_shm_read(const char* func, const int line, const char * file) {
+	if(config.debug & DEBUG_LOCKS)
+		logg("Waiting for read lock in %s() (%s:%i)", func, file, line);
+
+	const double start = lock_timestamp_us();
+	int result = lock_robust(&shmLock->lock, false);
+
+	check_remap();
+
+	// Claim a free reader slot. If all slots are in use, we wait for the
+	// reader in the slot selected by our thread ID to finish
+	reader_slot = -1;
+	for(unsigned int i = 0; i < NUM_READER_SLOTS; i++)
+	{
+		if(lock_robust(&shmLock->readers[i], true) == 0)
+		{
+			reader_slot = i;
+			break;
+		}
+	}
+	if(reader_slot < 0)
+	{
+		reader_slot = (unsigned long)pthread_self() % NUM_READER_SLOTS;
+		lock_robust(&shmLock->readers[reader_slot], false);
+	}
+
+	if(result == 0)
+		pthread_mutex_unlock(&shmLock->lock);
+
+	record_lock_wait(false, start);
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Obtained read lock (slot %i) for %s() (%s:%i)", reader_slot, func, file, line);
+
+	if(result != 0)
+		logg("Failed to obtain SHM lock: %s", strerror(result));
+}
+
+void _unlock_shm_read(const char* func, const int line, const char * file) {
+	if(reader_slot < 0)
+	{
+		logg("Failed to unlock SHM read lock: No slot claimed in %s() (%s:%i)", func, file, line);
+		return;
+	}
+
+	int result = pthread_mutex_unlock(&shmLock->readers[reader_slot]);
+	reader_slot = -1;
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Removed read lock in %s() (%s:%i)", func, file, line);
+
+	if(result != 0)
+		logg("Failed to unlock SHM read lock: %s", strerror(result));
+}
+
+void snapshot_counters(countersStruct *counters_copy, overTimeData *overTime_copy)
+{
+	for(unsigned int attempt = 0; attempt < 100; attempt++)
+	{
+		const unsigned int seq = __atomic_load_n(&shmLock->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1)
+		{
+			// A writer is active
+			sched_yield();
+			continue;
+		}
+
+		if(counters_copy != NULL)
+			memcpy(counters_copy, counters, sizeof(countersStruct));
+		if(overTime_copy != NULL)
+			memcpy(overTime_copy, overTime, OVERTIME_SLOTS*sizeof(overTimeData));
+
+		// Ensure the copies are complete before checking the sequence
+		// number again
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&shmLock->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	}
+
+	lock_shm_read();
+	if(counters_copy != NULL)
+		memcpy(counters_copy, counters, sizeof(countersStruct));
+	if(overTime_copy != NULL)
+		memcpy(overTime_copy, overTime, OVERTIME_SLOTS*sizeof(overTimeData));
+	unlock_shm_read();
+}
+
+void get_lock_wait_histogram(unsigned long histogram[2][LOCK_WAIT_BINS])
+{
+	for(unsigned int i = 0; i < 2; i++)
+		for(unsigned int j = 0; j < LOCK_WAIT_BINS; j++)
+			histogram[i][j] = __atomic_load_n(&shmLock->wait_histogram[i][j], __ATOMIC_RELAXED);
+}
+
+// Ask the kernel to back a shared memory object with (transparent) huge
+// pages. This is only a hint, the kernel silently uses normal pages if huge
+// pages are not available or disabled for shared memory
+static bool use_hugepages(SharedMemory *sharedMemory)
+{
+#ifdef MADV_HUGEPAGE
+	if(madvise(sharedMemory->ptr, sharedMemory->reserved, MADV_HUGEPAGE) == 0)
+		return true;
+
+	logg("WARN: Cannot use huge pages for \"%s\": %s", sharedMemory->name, strerror(errno));
+#endif
+	return false;
+}
+
+// Whether huge pages have been requested for the large objects
+static bool hugepages_requested = false;
+
+// Report the page size requested for the large shared memory objects. Which
+// pages are actually obtained is only known once the objects are populated,
+// see log_hugepage_usage()
+static void report_pagesize(const bool hugepages)
+{
+	// Size of transparent huge pages (in bytes)
+	unsigned long hugepagesize = 0u;
+	FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if(fp != NULL)
+	{
+		if(fscanf(fp, "%lu", &hugepagesize) != 1)
+			hugepagesize = 0u;
+		fclose(fp);
+	}
+
+	// Policy for transparent huge pages of shared memory, the active
+	// setting is enclosed in brackets, e.g. "always within_size [advise] never"
+	char policy[32] = "unavailable";
+	fp = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+	if(fp != NULL)
+	{
+		char line[128] = { 0 };
+		if(fgets(line, sizeof(line), fp) != NULL)
+		{
+			const char *start = strchr(line, '[');
+			if(start != NULL && sscanf(start, "[%31[^]]]", policy) != 1)
+				strcpy(policy, "unknown");
+		}
+		fclose(fp);
+	}
+
+	const bool available = hugepagesize > 0u &&
+	                       (strcmp(policy, "always") == 0 || strcmp(policy, "within_size") == 0 ||
+	                        strcmp(policy, "advise") == 0 || strcmp(policy, "force") == 0);
+	hugepages_requested = hugepages && available;
+	if(hugepages_requested)
+		logg("Shared memory: Requested %lu kB huge pages for queries, clients and DNS cache (shmem policy: %s, %i byte pages otherwise)",
+		     hugepagesize/1024u, policy, pagesize);
+	else if(hugepages)
+		logg("Shared memory: Huge pages not available (shmem policy: %s), using %i byte pages",
+		     policy, pagesize);
+	else
+		logg("Shared memory: Using %i byte pages", pagesize);
+}
+
+// Log how much of the shared memory mapped by this process is actually
+// backed by huge pages. Call this once the objects have been populated
+void log_hugepage_usage(void)
+{
+	if(!hugepages_requested)
+		return;
+
+	unsigned long shmem_kB = 0u, file_kB = 0u, value = 0u;
+	FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+	if(fp == NULL)
+		return;
+
+	char line[128];
+	while(fgets(line, sizeof(line), fp) != NULL)
+	{
+		if(sscanf(line, "ShmemPmdMapped: %lu kB", &value) == 1)
+			shmem_kB = value;
+		else if(sscanf(line, "FilePmdMapped: %lu kB", &value) == 1)
+			file_kB = value;
+	}
+	fclose(fp);
+
+	logg(" -> Shared memory mapped using huge pages: %lu kB", shmem_kB + file_kB);
+}
+
 bool init_shmem(void)
 {
 	// Get kernel's page size
@@ -268,76 +716,126 @@ bool init_shmem(void)
 
 	/****************************** shared memory lock ******************************/
 	// Try to create shared memory object
-	shm_lock = create_shm(SHARED_LOCK_NAME, sizeof(ShmLock));
+	shm_lock = create_shm(SHARED_LOCK_NAME, sizeof(ShmLock), 0);
 	shmLock = (ShmLock*) shm_lock.ptr;
 	shmLock->lock = create_mutex();
+	for(unsigned int i = 0; i < NUM_READER_SLOTS; i++)
+		shmLock->readers[i] = create_mutex();
 	shmLock->waitingForLock = false;
 
 	/****************************** shared counters struct ******************************/
 	// Try to create shared memory object
-	shm_counters = create_shm(SHARED_COUNTERS_NAME, sizeof(countersStruct));
+	shm_counters = create_shm(SHARED_COUNTERS_NAME, sizeof(countersStruct), 0);
 	counters = (countersStruct*)shm_counters.ptr;
 
 	/****************************** shared settings struct ******************************/
 	// Try to create shared memory object
-	shm_settings = create_shm(SHARED_SETTINGS_NAME, sizeof(ShmSettings));
+	shm_settings = create_shm(SHARED_SETTINGS_NAME, sizeof(ShmSettings), 0);
 	shmSettings = (ShmSettings*)shm_settings.ptr;
 	shmSettings->version = SHARED_MEMORY_VERSION;
 	shmSettings->global_shm_counter = 0;
 
 	/****************************** shared strings buffer ******************************/
 	// Try to create shared memory object
-	shm_strings = create_shm(SHARED_STRINGS_NAME, pagesize);
+	shm_strings = create_shm(SHARED_STRINGS_NAME, pagesize, SHM_RESERVE(512));
 	counters->strings_MAX = pagesize;
 
 	// Initialize shared string object with an empty string at position zero
 	((char*)shm_strings.ptr)[0] = '\0';
 	shmSettings->next_str_pos = 1;
+	shmSettings->compacted_str_pos = 1;
+	shmSettings->num_strings = 0;
+
+	/****************************** shared strings hash table ******************************/
+	// Try to create shared memory object
+	counters->strings_hash_MAX = hashtable_size(pagesize/16);
+	shm_strings_hash = create_shm(SHARED_STRINGS_HASH_NAME, counters->strings_hash_MAX*sizeof(hashSlot), SHM_RESERVE(128));
 
 	/****************************** shared domains struct ******************************/
 	// Try to create shared memory object
-	shm_domains = create_shm(SHARED_DOMAINS_NAME, pagesize*sizeof(domainsData));
+	shm_domains = create_shm(SHARED_DOMAINS_NAME, pagesize*sizeof(domainsData), SHM_RESERVE(512));
 	domains = (domainsData*)shm_domains.ptr;
 	counters->domains_MAX = pagesize;
 
+	/****************************** shared domains hash table ******************************/
+	// Try to create shared memory object
+	shm_domains_hash = create_shm(SHARED_DOMAINS_HASH_NAME, hashtable_size(pagesize)*sizeof(hashSlot), SHM_RESERVE(128));
+
 	/****************************** shared clients struct ******************************/
 	size_t size = get_optimal_object_size(sizeof(clientsData), 1);
 	// Try to create shared memory object
-	shm_clients = create_shm(SHARED_CLIENTS_NAME, size*sizeof(clientsData));
+	shm_clients = create_shm(SHARED_CLIENTS_NAME, size*sizeof(clientsData), SHM_RESERVE(64));
 	clients = (clientsData*)shm_clients.ptr;
 	counters->clients_MAX = size;
 
+	/****************************** shared clients hash table ******************************/
+	// Try to create shared memory object
+	shm_clients_hash = create_shm(SHARED_CLIENTS_HASH_NAME, hashtable_size(size)*sizeof(hashSlot), SHM_RESERVE(16));
+
 	/****************************** shared upstreams struct ******************************/
 	size = get_optimal_object_size(sizeof(upstreamsData), 1);
 	// Try to create shared memory object
-	shm_upstreams = create_shm(SHARED_UPSTREAMS_NAME, size*sizeof(upstreamsData));
+	shm_upstreams = create_shm(SHARED_UPSTREAMS_NAME, size*sizeof(upstreamsData), SHM_RESERVE(16));
 	upstreams = (upstreamsData*)shm_upstreams.ptr;
 	counters->upstreams_MAX = size;
 
 	/****************************** shared queries struct ******************************/
 	// Try to create shared memory object
-	shm_queries = create_shm(SHARED_QUERIES_NAME, pagesize*sizeof(queriesData));
+	shm_queries = create_shm(SHARED_QUERIES_NAME, pagesize*sizeof(queriesData), SHM_RESERVE(2048));
 	queries = (queriesData*)shm_queries.ptr;
 	counters->queries_MAX = pagesize;
 
+	/****************************** shared queries hash table ******************************/
+	// Try to create shared memory object
+	shm_queries_hash = create_shm(SHARED_QUERIES_HASH_NAME, hashtable_size(pagesize)*sizeof(hashSlot), SHM_RESERVE(1024));
+
 	/****************************** shared overTime struct ******************************/
 	size = get_optimal_object_size(sizeof(overTimeData), OVERTIME_SLOTS);
 	// Try to create shared memory object
-	shm_overTime = create_shm(SHARED_OVERTIME_NAME, size*sizeof(overTimeData));
+	shm_overTime = create_shm(SHARED_OVERTIME_NAME, size*sizeof(overTimeData), 0);
 	overTime = (overTimeData*)shm_overTime.ptr;
 	initOverTime();
 
 	/****************************** shared DNS cache struct ******************************/
 	size = get_optimal_object_size(sizeof(DNSCacheData), 1);
 	// Try to create shared memory object
-	shm_dns_cache = create_shm(SHARED_DNS_CACHE, size*sizeof(DNSCacheData));
+	shm_dns_cache = create_shm(SHARED_DNS_CACHE, size*sizeof(DNSCacheData), SHM_RESERVE(512));
 	dns_cache = (DNSCacheData*)shm_dns_cache.ptr;
 	counters->dns_cache_MAX = size;
 
+	/****************************** shared DNS cache hash table ******************************/
+	// Try to create shared memory object
+	shm_dns_cache_hash = create_shm(SHARED_DNS_CACHE_HASH, hashtable_size(size)*sizeof(hashSlot), SHM_RESERVE(128));
+
 	/****************************** shared per-client regex buffer ******************************/
-	size = get_optimal_object_size(1, 2);
+	size = get_optimal_object_size(sizeof(uint64_t), 1);
+	// Try to create shared memory object
+	shm_per_client_regex = create_shm(SHARED_PER_CLIENT_REGEX, size, SHM_RESERVE(64));
+	counters->per_client_regex_MAX = size;
+
+	/****************************** shared query posting lists ******************************/
+	size = get_optimal_object_size(sizeof(postingChunk), 1);
 	// Try to create shared memory object
-	shm_per_client_regex = create_shm(SHARED_PER_CLIENT_REGEX, size);
+	shm_query_postings = create_shm(SHARED_QUERY_POSTINGS_NAME, size*sizeof(postingChunk), SHM_RESERVE(1024));
+	counters->postings_MAX = size;
+	counters->postings_used = 0;
+	counters->postings_free = -1;
+
+	/****************************** shared top lists struct ******************************/
+	// Try to create shared memory object
+	shm_toplists = create_shm(SHARED_TOPLISTS_NAME, sizeof(topListsStruct), 0);
+	toplists = (topListsStruct*)shm_toplists.ptr;
+
+	/****************************** huge pages ******************************/
+	// The objects scanned linearly are the ones which can become large
+	bool hugepages = false;
+	if(config.shm_hugepages)
+	{
+		hugepages = use_hugepages(&shm_queries) &&
+		            use_hugepages(&shm_clients) &&
+		            use_hugepages(&shm_dns_cache);
+	}
+	report_pagesize(hugepages);
 
 	return true;
 }
@@ -345,22 +843,31 @@ bool init_shmem(void)
 void destroy_shmem(void)
 {
 	pthread_mutex_destroy(&shmLock->lock);
+	for(unsigned int i = 0; i < NUM_READER_SLOTS; i++)
+		pthread_mutex_destroy(&shmLock->readers[i]);
 	shmLock = NULL;
 
 	delete_shm(&shm_lock);
 	delete_shm(&shm_strings);
+	delete_shm(&shm_strings_hash);
 	delete_shm(&shm_counters);
 	delete_shm(&shm_domains);
+	delete_shm(&shm_domains_hash);
 	delete_shm(&shm_clients);
+	delete_shm(&shm_clients_hash);
 	delete_shm(&shm_queries);
+	delete_shm(&shm_queries_hash);
 	delete_shm(&shm_upstreams);
 	delete_shm(&shm_overTime);
 	delete_shm(&shm_settings);
 	delete_shm(&shm_dns_cache);
+	delete_shm(&shm_dns_cache_hash);
 	delete_shm(&shm_per_client_regex);
+	delete_shm(&shm_query_postings);
+	delete_shm(&shm_toplists);
 }
 
-SharedMemory create_shm(const char *name, const size_t size)
+SharedMemory create_shm(const char *name, const size_t size, const size_t reserve)
 {
 	if(config.debug & DEBUG_SHMEM)
 		logg("Creating shared memory with name \"%s\" and size %zu", name, size);
@@ -368,7 +875,8 @@ SharedMemory create_shm(const char *name, const size_t size)
 	SharedMemory sharedMemory = {
 		.name = name,
 		.size = size,
-		.ptr = NULL
+		.ptr = NULL,
+		.reserved = size > reserve ? size : reserve
 	};
 
 	// Try unlinking the shared memory object before creating a new one.
@@ -403,8 +911,13 @@ SharedMemory create_shm(const char *name, const size_t size)
 		exit(EXIT_FAILURE);
 	}
 
-	// Create shared memory mapping
-	void *shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// Create shared memory mapping covering the entire reserved range. Pages
+	// beyond the current end of the object become usable as soon as any
+	// process enlarges it so neither this nor any other process (including
+	// forks) has to remap it after resizing. MAP_NORESERVE ensures that only
+	// address space but no memory is allocated for the remainder
+	void *shm = mmap(NULL, sharedMemory.reserved, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_NORESERVE, fd, 0);
 
 	// Check for `mmap` error
 	if(shm == MAP_FAILED)
@@ -422,6 +935,15 @@ SharedMemory create_shm(const char *name, const size_t size)
 	return sharedMemory;
 }
 
+// Grow objects by half of their current size, rounded down to a multiple of
+// the optimal step (which keeps the object page-aligned) to reach large sizes
+// in a logarithmic number of steps
+static size_t geometric_step(const size_t step, const int current)
+{
+	const size_t half = (size_t)current / 2u;
+	return half > step ? half - half % step : step;
+}
+
 void *enlarge_shmem_struct(const char type)
 {
 	SharedMemory *sharedMemory = NULL;
@@ -433,31 +955,43 @@ void *enlarge_shmem_struct(const char type)
 	{
 		case QUERIES:
 			sharedMemory = &shm_queries;
-			allocation_step = pagesize;
+			// Queries are stored in a ring buffer indexed by their ID
+			// modulo the buffer size. We double its size so that each
+			// query either stays in its slot or moves exactly one old
+			// buffer size up (see below)
+			allocation_step = counters->queries_MAX;
 			sizeofobj = sizeof(queriesData);
 			counter = &counters->queries_MAX;
 			break;
 		case CLIENTS:
 			sharedMemory = &shm_clients;
-			allocation_step = get_optimal_object_size(sizeof(clientsData), 1);
+			allocation_step = geometric_step(get_optimal_object_size(sizeof(clientsData), 1),
+			                                 counters->clients_MAX);
 			sizeofobj = sizeof(clientsData);
 			counter = &counters->clients_MAX;
 			break;
 		case DOMAINS:
 			sharedMemory = &shm_domains;
-			allocation_step = pagesize;
+			allocation_step = geometric_step(pagesize, counters->domains_MAX);
 			sizeofobj = sizeof(domainsData);
 			counter = &counters->domains_MAX;
 			break;
 		case UPSTREAMS:
 			sharedMemory = &shm_upstreams;
-			allocation_step = get_optimal_object_size(sizeof(upstreamsData), 1);
+			allocation_step = geometric_step(get_optimal_object_size(sizeof(upstreamsData), 1),
+			                                 counters->upstreams_MAX);
 			sizeofobj = sizeof(upstreamsData);
 			counter = &counters->upstreams_MAX;
 			break;
 		case DNS_CACHE:
 			sharedMemory = &shm_dns_cache;
-			allocation_step = get_optimal_object_size(sizeof(DNSCacheData), 1);
+			// The DNS cache holds up to one entry per domain/client
+			// pair and may grow to millions of entries. We double its
+			// size each time to keep the number of resizing (and
+			// remapping) operations logarithmic. As the current size is
+			// a multiple of the optimal object size, the result stays
+			// page-aligned
+			allocation_step = counters->dns_cache_MAX;
 			sizeofobj = sizeof(DNSCacheData);
 			counter = &counters->dns_cache_MAX;
 			break;
@@ -466,12 +1000,50 @@ void *enlarge_shmem_struct(const char type)
 			return 0;
 	}
 
-	// Reallocate enough space for 4096 instances of requested object
+	// Reallocate enough space for allocation_step more instances of the requested object
 	realloc_shm(sharedMemory, sharedMemory->size + allocation_step*sizeofobj, true);
 
 	// Add allocated memory to corresponding counter
 	*counter += allocation_step;
 
+	// Grow hash table index alongside the object it indexes
+	if(type == QUERIES)
+	{
+		queries = (queriesData*)sharedMemory->ptr;
+
+		// Move queries whose slot changed with the new buffer size into
+		// the (zeroed) upper half of the enlarged ring buffer
+		const int oldMAX = *counter - allocation_step;
+		const int first = counters->queries_first;
+		for(int queryID = first; queryID < first + counters->queries; queryID++)
+		{
+			const int oldslot = queryID % oldMAX;
+			const int newslot = queryID % counters->queries_MAX;
+			if(oldslot == newslot)
+				continue;
+
+			memcpy(&queries[newslot], &queries[oldslot], sizeof(queriesData));
+			memset(&queries[oldslot], 0, sizeof(queriesData));
+		}
+
+		rehash_index(QUERIES, false);
+	}
+	else if(type == DOMAINS)
+	{
+		domains = (domainsData*)sharedMemory->ptr;
+		rehash_index(DOMAINS, false);
+	}
+	else if(type == CLIENTS)
+	{
+		clients = (clientsData*)sharedMemory->ptr;
+		rehash_index(CLIENTS, false);
+	}
+	else if(type == DNS_CACHE)
+	{
+		dns_cache = (DNSCacheData*)sharedMemory->ptr;
+		rehash_index(DNS_CACHE, false);
+	}
+
 	return sharedMemory->ptr;
 }
 
@@ -484,12 +1056,14 @@ bool realloc_shm(SharedMemory *sharedMemory, const size_t size, const bool resiz
 		return true;
 
 	// Log that we are doing something here
-	logg("%s \"%s\" from %zu to %zu", resize ? "Resizing" : "Remapping", sharedMemory->name, sharedMemory->size, size);
+	if(resize || config.debug & DEBUG_SHMEM)
+		logg("%s \"%s\" from %zu to %zu", resize ? "Resizing" : "Remapping", sharedMemory->name, sharedMemory->size, size);
 
 	// Resize shard memory object if requested
-	// If not, we only remap a shared memory object which might have changed
-	// in another process. This happens when pihole-FTL forks due to incoming
-	// TCP requests.
+	// If not, we only pick up the size of a shared memory object which might
+	// have changed in another process. This happens when pihole-FTL forks
+	// due to incoming TCP requests. The mapping already covers the new size
+	// unless the object outgrew its reserved address space (see below)
 	if(resize)
 	{
 		// Open shared memory object
@@ -518,16 +1092,33 @@ bool realloc_shm(SharedMemory *sharedMemory, const size_t size, const bool resiz
 		local_shm_counter++;
 	}
 
-	void *new_ptr = mremap(sharedMemory->ptr, sharedMemory->size, size, MREMAP_MAYMOVE);
-	if(new_ptr == MAP_FAILED)
+	// The object can only move if it outgrew the reserved address range
+	if(size > sharedMemory->reserved)
 	{
-		logg("FATAL: realloc_shm(): mremap(%p, %zu, %zu, MREMAP_MAYMOVE): Failed to reallocate \"%s\": %s",
-		     sharedMemory->ptr, sharedMemory->size, size, sharedMemory->name,
-		     strerror(errno));
-		exit(EXIT_FAILURE);
+		const size_t reserved = 2*size;
+		void *new_ptr = mremap(sharedMemory->ptr, sharedMemory->reserved, reserved, MREMAP_MAYMOVE);
+		if(new_ptr == MAP_FAILED)
+		{
+			logg("FATAL: realloc_shm(): mremap(%p, %zu, %zu, MREMAP_MAYMOVE): Failed to reallocate \"%s\": %s",
+			     sharedMemory->ptr, sharedMemory->reserved, reserved, sharedMemory->name,
+			     strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		// Expected on 32-bit systems where only little address space
+		// is reserved (see SHM_RESERVE)
+#if UINTPTR_MAX > 0xFFFFFFFFu
+		logg("WARN: Shared memory object \"%s\" exceeded its reserved address space and had to be moved",
+		     sharedMemory->name);
+#else
+		if(config.debug & DEBUG_SHMEM)
+			logg("Shared memory object \"%s\" exceeded its reserved address space and was moved",
+			     sharedMemory->name);
+#endif
+		sharedMemory->ptr = new_ptr;
+		sharedMemory->reserved = reserved;
 	}
 
-	sharedMemory->ptr = new_ptr;
 	sharedMemory->size = size;
 
 	return true;
@@ -536,9 +1127,9 @@ bool realloc_shm(SharedMemory *sharedMemory, const size_t size, const bool resiz
 void delete_shm(SharedMemory *sharedMemory)
 {
 	// Unmap shared memory
-	int ret = munmap(sharedMemory->ptr, sharedMemory->size);
+	int ret = munmap(sharedMemory->ptr, sharedMemory->reserved);
 	if(ret != 0)
-		logg("delete_shm(): munmap(%p, %zu) failed: %s", sharedMemory->ptr, sharedMemory->size, strerror(errno));
+		logg("delete_shm(): munmap(%p, %zu) failed: %s", sharedMemory->ptr, sharedMemory->reserved, strerror(errno));
 
 	// Now you can no longer `shm_open` the memory,
 	// and once all others unlink, it will be destroyed.
@@ -681,58 +1272,443 @@ void memory_check(const enum memory_type which)
 	}
 }
 
-void reset_per_client_regex(const int clientID)
+// Every client has one bitset per regex type, both start at a word boundary
+// so the enabled filters of a type can be read word by word
+static inline unsigned int per_client_regex_words(const unsigned char regexid)
+{
+	return (counters->num_regex[regexid] + 63u) / 64u;
+}
+
+static inline unsigned int per_client_regex_stride(void)
+{
+	return per_client_regex_words(REGEX_BLACKLIST) + per_client_regex_words(REGEX_WHITELIST);
+}
+
+// Get the word and bit of a regex, whitelist regexIDs are offset by the
+// number of blacklist regex
+static bool per_client_regex_bit(const int clientID, int regexID, size_t *word, uint64_t *bit)
 {
-	const unsigned int num_regex_tot = counters->num_regex[REGEX_BLACKLIST] +
-	                                   counters->num_regex[REGEX_WHITELIST];
-	for(unsigned int i = 0u; i < num_regex_tot; i++)
+	const unsigned int stride = per_client_regex_stride();
+	size_t offset = (size_t)clientID * stride;
+	if(regexID >= counters->num_regex[REGEX_BLACKLIST])
 	{
-		// Zero-initialize/reset (= false) all regex (white + black)
-		set_per_client_regex(clientID, i, false);
+		regexID -= counters->num_regex[REGEX_BLACKLIST];
+		offset += per_client_regex_words(REGEX_BLACKLIST);
 	}
+
+	*word = offset + regexID / 64;
+	*bit = 1ULL << (regexID % 64);
+	return clientID < counters->clients &&
+	       (*word + 1u) * sizeof(uint64_t) <= shm_per_client_regex.size;
+}
+
+void reset_per_client_regex(const int clientID)
+{
+	// Zero-initialize/reset (= false) all regex (white + black)
+	const size_t stride = per_client_regex_stride();
+	if(((size_t)clientID + 1u) * stride * sizeof(uint64_t) <= shm_per_client_regex.size)
+		memset((uint64_t*)shm_per_client_regex.ptr + clientID * stride, 0, stride * sizeof(uint64_t));
 }
 
 void add_per_client_regex(unsigned int clientID)
 {
-	const unsigned int num_regex_tot = counters->num_regex[REGEX_BLACKLIST] +
-	                                   counters->num_regex[REGEX_WHITELIST];
-	const size_t size = counters->clients * num_regex_tot;
-	if(size > shm_per_client_regex.size &&
-	   realloc_shm(&shm_per_client_regex, size, true))
+	// Grow geometrically to avoid resizing for every new client
+	const size_t size = (size_t)counters->clients * per_client_regex_stride() * sizeof(uint64_t);
+	if(size > shm_per_client_regex.size)
 	{
-		reset_per_client_regex(clientID);
+		size_t new_size = 2u * shm_per_client_regex.size;
+		if(new_size < size)
+			new_size = size;
+		new_size = ((new_size + pagesize - 1u) / pagesize) * pagesize;
+		realloc_shm(&shm_per_client_regex, new_size, true);
+		counters->per_client_regex_MAX = shm_per_client_regex.size;
 	}
+
+	// The stride changes when the regex filters are reloaded, always start
+	// from a clean state
+	reset_per_client_regex(clientID);
 }
 
 bool get_per_client_regex(const int clientID, const int regexID)
 {
-	const unsigned int num_regex_tot = counters->num_regex[REGEX_BLACKLIST] +
-	                                   counters->num_regex[REGEX_WHITELIST];
-	const unsigned int id = clientID * num_regex_tot + regexID;
-	const unsigned int maxval = counters->clients * num_regex_tot;
-	if(id > maxval)
+	size_t word = 0u;
+	uint64_t bit = 0u;
+	if(!per_client_regex_bit(clientID, regexID, &word, &bit))
 	{
-		logg("ERROR: get_per_client_regex(%d,%d): Out of bounds (%d > %d * %d == %d)!",
-		     clientID, regexID, id, counters->clients-1, num_regex_tot, maxval);
+		logg("ERROR: get_per_client_regex(%d,%d): Out of bounds (%d clients, %zu bytes)!",
+		     clientID, regexID, counters->clients, shm_per_client_regex.size);
 		return false;
 	}
-	return ((bool*) shm_per_client_regex.ptr)[id];
+	return ((uint64_t*) shm_per_client_regex.ptr)[word] & bit;
 }
 
 void set_per_client_regex(const int clientID, const int regexID, const bool value)
 {
-	const unsigned int num_regex_tot = counters->num_regex[REGEX_BLACKLIST] +
-	                                   counters->num_regex[REGEX_WHITELIST];
-	const unsigned int id = clientID * num_regex_tot + regexID;
-	const unsigned int maxval = counters->clients * num_regex_tot;
-	if(id > maxval)
+	size_t word = 0u;
+	uint64_t bit = 0u;
+	if(!per_client_regex_bit(clientID, regexID, &word, &bit))
 	{
-		logg("ERROR: set_per_client_regex(%d,%d,%s): Out of bounds (%d > %d * %d == %d)!",
+		logg("ERROR: set_per_client_regex(%d,%d,%s): Out of bounds (%d clients, %zu bytes)!",
 		     clientID, regexID, value ? "true" : "false",
-		     id, counters->clients-1, num_regex_tot, maxval);
+		     counters->clients, shm_per_client_regex.size);
+		return;
+	}
+	if(value)
+		((uint64_t*) shm_per_client_regex.ptr)[word] |= bit;
+	else
+		((uint64_t*) shm_per_client_regex.ptr)[word] &= ~bit;
+}
+
+// Get the bitset of regex filters of the given type enabled for a client.
+// Bit i of word i/64 corresponds to the regex with index i
+const uint64_t * __attribute__((pure)) get_per_client_regex_bits(const int clientID, const unsigned char regexid)
+{
+	const size_t stride = per_client_regex_stride();
+	if(clientID < 0 || clientID >= counters->clients ||
+	   ((size_t)clientID + 1u) * stride * sizeof(uint64_t) > shm_per_client_regex.size)
+		return NULL;
+
+	const uint64_t *bits = (uint64_t*) shm_per_client_regex.ptr + clientID * stride;
+	return regexid == REGEX_WHITELIST ? bits + per_client_regex_words(REGEX_BLACKLIST) : bits;
+}
+
+// Get the shared memory object storing the hash index of the given type
+static SharedMemory *get_index_shm(const enum memory_type which)
+{
+	switch(which)
+	{
+		case DOMAINS:
+			return &shm_domains_hash;
+		case CLIENTS:
+			return &shm_clients_hash;
+		case DNS_CACHE:
+			return &shm_dns_cache_hash;
+		case QUERIES:
+			return &shm_queries_hash;
+		case UPSTREAMS: // fall through
+		case OVERTIME: // fall through
+		default:
+			logg("ERROR: No hash index available for type %i", which);
+			return NULL;
+	}
+}
+
+// Queries are indexed by the ID dnsmasq assigned to them
+static inline uint32_t query_id_hash(const int id)
+{
+	return hashBytes(&id, sizeof(id));
+}
+
+// Hash index callback: was the query with the given ID assigned this dnsmasq ID?
+static bool query_id_matches(const int queryID, const void *id)
+{
+	return queries[queryID % counters->queries_MAX].id == *(const int*)id;
+}
+
+// Resize a hash index so it can hold all elements the indexed object has
+// room for and re-insert all known elements. The index is resized in
+// power-of-two steps so this happens only rarely even though the indexed
+// objects grow linearly. If force is true, the index is rebuilt even if
+// its size is sufficient (e.g., because the indexed objects moved)
+static void rehash_index(const enum memory_type which, const bool force)
+{
+	SharedMemory *index = get_index_shm(which);
+	if(index == NULL)
+		return;
+
+	size_t elements = 0u;
+	int num = 0;
+	switch(which)
+	{
+		case QUERIES:
+			elements = counters->queries_MAX;
+			num = counters->queries;
+			break;
+		case DOMAINS:
+			elements = counters->domains_MAX;
+			num = counters->domains;
+			break;
+		case CLIENTS:
+			elements = counters->clients_MAX;
+			num = counters->clients;
+			break;
+		case DNS_CACHE:
+			elements = counters->dns_cache_MAX;
+			num = counters->dns_cache_size;
+			break;
+		case UPSTREAMS: // fall through
+		case OVERTIME: // fall through
+		default:
+			return;
+	}
+
+	// Nothing to be done if the index is large enough
+	const size_t size = hashtable_size(elements);
+	if(size*sizeof(hashSlot) <= index->size && !force)
+		return;
+
+	if(size*sizeof(hashSlot) > index->size)
+		realloc_shm(index, size*sizeof(hashSlot), true);
+	const size_t slots = index->size/sizeof(hashSlot);
+	hashSlot *table = (hashSlot*)index->ptr;
+	memset(table, 0, index->size);
+
+	// Re-insert all known elements using their stored hashes
+	if(which == QUERIES)
+	{
+		// Queries imported from the database have no dnsmasq ID. If
+		// dnsmasq re-used an ID, the most recent query takes precedence
+		const int first = counters->queries_first;
+		for(int queryID = first; queryID < first + num; queryID++)
+		{
+			const queriesData *query = &queries[queryID % counters->queries_MAX];
+			if(query->id != 0)
+				hashtable_upsert(table, slots, query_id_hash(query->id), queryID,
+				                 query_id_matches, &query->id);
+		}
+	}
+	else for(int i = 0; i < num; i++)
+	{
+		if(which == DOMAINS)
+			hashtable_insert(table, slots, domains[i].domainhash, i);
+		// Clients with non-IP addresses are not part of the index
+		else if(which == CLIENTS && clients[i].family != AF_UNSPEC)
+			hashtable_insert(table, slots, clients[i].addrhash, i);
+		else if(which == DNS_CACHE)
+			hashtable_insert(table, slots, hashPair(dns_cache[i].domainID, dns_cache[i].clientID), i);
+	}
+
+	if(config.debug & DEBUG_SHMEM)
+		logg("Rehashed %i elements into %zu slots of \"%s\"", num, slots, index->name);
+}
+
+void rebuild_index(const enum memory_type which)
+{
+	rehash_index(which, true);
+}
+
+int lookup_query_id(const int id)
+{
+	return lookup_hash(QUERIES, query_id_hash(id), query_id_matches, &id);
+}
+
+void insert_query_id(const int queryID)
+{
+	const int id = queries[queryID % counters->queries_MAX].id;
+	hashtable_upsert(shm_queries_hash.ptr, shm_queries_hash.size/sizeof(hashSlot),
+	                 query_id_hash(id), queryID, query_id_matches, &id);
+}
+
+// Remove a query from the index. Nothing is done if the query has been
+// superseded by a more recent one with the same dnsmasq ID
+void remove_query_id(const int queryID)
+{
+	const int id = queries[queryID % counters->queries_MAX].id;
+	hashtable_remove(shm_queries_hash.ptr, shm_queries_hash.size/sizeof(hashSlot),
+	                 query_id_hash(id), queryID);
+}
+
+// Every query is appended to the posting lists of its domain and its client.
+// The lists are made of chunks which are linked in both directions so they
+// can be walked from either end. As queries are only ever added with
+// increasing IDs and removed oldest first, the lists stay sorted and
+// expired queries are always found at their front
+static inline postingChunk *get_chunk(const int chunk)
+{
+	return &((postingChunk*)shm_query_postings.ptr)[chunk];
+}
+
+static int alloc_posting_chunk(void)
+{
+	int chunk = counters->postings_free;
+	if(chunk > -1)
+	{
+		// Reuse previously released chunk
+		counters->postings_free = get_chunk(chunk)->next;
+	}
+	else
+	{
+		if(counters->postings_used >= counters->postings_MAX)
+		{
+			const size_t step = get_optimal_object_size(sizeof(postingChunk), 1);
+			const size_t size = counters->postings_MAX + geometric_step(step, counters->postings_MAX);
+			realloc_shm(&shm_query_postings, size*sizeof(postingChunk), true);
+			counters->postings_MAX = size;
+		}
+		chunk = counters->postings_used++;
+	}
+
+	postingChunk *new = get_chunk(chunk);
+	new->prev = -1;
+	new->next = -1;
+	new->start = 0;
+	new->count = 0;
+	return chunk;
+}
+
+static void append_posting(postingList *list, const int queryID)
+{
+	int last = list->last;
+	if(last < 0 || get_chunk(last)->count >= POSTING_CHUNK_IDS)
+	{
+		const int chunk = alloc_posting_chunk();
+		get_chunk(chunk)->prev = last;
+		if(last > -1)
+			get_chunk(last)->next = chunk;
+		else
+			list->first = chunk;
+		list->last = last = chunk;
+	}
+
+	postingChunk *chunk = get_chunk(last);
+	chunk->ids[chunk->count++] = queryID;
+}
+
+static void trim_postings(postingList *list, const int queryID)
+{
+	while(list->first > -1)
+	{
+		postingChunk *chunk = get_chunk(list->first);
+		while(chunk->start < chunk->count && chunk->ids[chunk->start] <= queryID)
+			chunk->start++;
+
+		if(chunk->start < chunk->count)
+			return;
+
+		// Release the exhausted chunk. If it was the last one, the list
+		// is empty now and append_posting() allocates a new chunk once
+		// there are new queries
+		const int next = chunk->next;
+		chunk->next = counters->postings_free;
+		counters->postings_free = list->first;
+		if(next > -1)
+			get_chunk(next)->prev = -1;
+		else
+			list->last = -1;
+		list->first = next;
+	}
+}
+
+void add_query_postings(const int queryID)
+{
+	if(!config.query_index)
+		return;
+
+	const queriesData *query = &queries[queryID % counters->queries_MAX];
+	domainsData *domain = getDomain(query->domainID, true);
+	if(domain != NULL)
+		append_posting(&domain->queries, queryID);
+
+	clientsData *client = getClient(query->clientID, true);
+	if(client != NULL)
+		append_posting(&client->queries, queryID);
+}
+
+void remove_query_postings(const int queryID)
+{
+	if(!config.query_index)
 		return;
+
+	const queriesData *query = &queries[queryID % counters->queries_MAX];
+	domainsData *domain = getDomain(query->domainID, true);
+	if(domain != NULL)
+		trim_postings(&domain->queries, queryID);
+
+	clientsData *client = getClient(query->clientID, true);
+	if(client != NULL)
+		trim_postings(&client->queries, queryID);
+}
+
+// Query IDs have been shifted down, update all stored IDs accordingly
+void rebase_query_postings(const int offset)
+{
+	for(int i = 0; i < counters->postings_used; i++)
+	{
+		postingChunk *chunk = get_chunk(i);
+		for(int j = chunk->start; j < chunk->count; j++)
+			chunk->ids[j] -= offset;
+	}
+}
+
+// Position iterator behind the last query of the list whose ID is not larger
+// than the given one. Whole chunks are skipped by looking at their first entry
+void postings_seek(const postingList *list, postingIterator *it, const int queryID)
+{
+	it->chunk = list->last;
+	it->pos = 0;
+	while(it->chunk > -1)
+	{
+		const postingChunk *chunk = get_chunk(it->chunk);
+		if(chunk->start < chunk->count && chunk->ids[chunk->start] <= queryID)
+		{
+			it->pos = chunk->count;
+			while(it->pos > chunk->start && chunk->ids[it->pos - 1] > queryID)
+				it->pos--;
+			return;
+		}
+
+		if(chunk->prev < 0)
+		{
+			// All queries are more recent, position in front of the first one
+			it->pos = chunk->start;
+			return;
+		}
+		it->chunk = chunk->prev;
+	}
+}
+
+bool postings_next(postingIterator *it, int *queryID)
+{
+	while(it->chunk > -1)
+	{
+		const postingChunk *chunk = get_chunk(it->chunk);
+		if(it->pos < chunk->start)
+			it->pos = chunk->start;
+		if(it->pos < chunk->count)
+		{
+			*queryID = chunk->ids[it->pos++];
+			return true;
+		}
+		it->chunk = chunk->next;
+		it->pos = 0;
 	}
-	((bool*) shm_per_client_regex.ptr)[id] = value;
+
+	return false;
+}
+
+bool postings_prev(postingIterator *it, int *queryID)
+{
+	while(it->chunk > -1)
+	{
+		const postingChunk *chunk = get_chunk(it->chunk);
+		if(it->pos > chunk->start)
+		{
+			*queryID = chunk->ids[--it->pos];
+			return true;
+		}
+		it->chunk = chunk->prev;
+		it->pos = it->chunk > -1 ? get_chunk(it->chunk)->count : 0;
+	}
+
+	return false;
+}
+
+int lookup_hash(const enum memory_type which, const uint32_t hash, hashMatchFunc match, const void *key)
+{
+	const SharedMemory *index = get_index_shm(which);
+	if(index == NULL)
+		return -1;
+
+	return hashtable_find(index->ptr, index->size/sizeof(hashSlot), hash, match, key);
+}
+
+void insert_hash(const enum memory_type which, const uint32_t hash, const int ID)
+{
+	SharedMemory *index = get_index_shm(which);
+	if(index == NULL)
+		return;
+
+	hashtable_insert(index->ptr, index->size/sizeof(hashSlot), hash, ID);
 }
 
 static inline bool check_range(int ID, int MAXID, const char* type, int line, const char * function, const char * file)
@@ -763,9 +1739,20 @@ static inline bool check_magic(int ID, bool checkMagic, unsigned char magic, con
 
 queriesData* _getQuery(int queryID, bool checkMagic, int line, const char * function, const char * file)
 {
-	if(check_range(queryID, counters->queries_MAX, "query", line, function, file) &&
-	   check_magic(queryID, checkMagic, queries[queryID].magic, "query", line, function, file))
-		return &queries[queryID];
+	// Queries are stored in a ring buffer. Valid are the IDs of all queries
+	// currently in memory and the ID the next query is going to get
+	const int first = counters->queries_first;
+	if(queryID < first || queryID > first + counters->queries)
+	{
+		logg("FATAL: Trying to access query ID %i, but valid range is %i - %i",
+		     queryID, first, first + counters->queries);
+		logg("       found in %s() (%s:%i)", function, file, line);
+		return NULL;
+	}
+
+	queriesData *query = &queries[queryID % counters->queries_MAX];
+	if(check_magic(queryID, checkMagic, query->magic, "query", line, function, file))
+		return query;
 	else
 		return NULL;
 }
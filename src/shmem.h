@@ -17,33 +17,44 @@
 
 // TYPE_MAX
 #include "datastructure.h"
+// overTimeData
+#include "overTime.h"
+// hashSlot
+#include "hashtable.h"
 
 typedef struct {
     const char *name;
     size_t size;
     void *ptr;
+    // Size of the address range reserved for the object to grow in place
+    size_t reserved;
 } SharedMemory;
 
 typedef struct {
 	int version;
 	unsigned int global_shm_counter;
 	unsigned int next_str_pos;
+	unsigned int compacted_str_pos;
+	unsigned int num_strings;
 } ShmSettings;
 
 typedef struct {
 	int queries;
+	int queries_first;
 	int blocked;
 	int forwarded;
 	int cached;
 	int unknown;
 	int upstreams;
 	int clients;
+	int active_clients;
 	int domains;
 	int queries_MAX;
 	int upstreams_MAX;
 	int clients_MAX;
 	int domains_MAX;
 	int strings_MAX;
+	int strings_hash_MAX;
 	int gravity;
 	int querytype[TYPE_MAX-1];
 	int reply_NODATA;
@@ -54,6 +65,14 @@ typedef struct {
 	int dns_cache_size;
 	int dns_cache_MAX;
 	int num_regex[2];
+	int per_client_regex_MAX;
+	unsigned int overTime_offset;
+	// Total amount query IDs have been shifted down by, query ID plus this
+	// value gives an ID which is stable for the lifetime of the query
+	long long queries_rebased;
+	int postings_MAX;
+	int postings_used;
+	int postings_free;
 } countersStruct;
 
 extern countersStruct *counters;
@@ -62,9 +81,10 @@ extern countersStruct *counters;
 ///
 /// \param name the name of the shared memory
 /// \param size the size to allocate
+/// \param reserve the address space to reserve for growing in place (0 for fixed-size objects)
 /// \return a structure with a pointer to the mounted shared memory. The pointer
 /// will always be valid, because if it failed FTL will have exited.
-SharedMemory create_shm(const char *name, const size_t size);
+SharedMemory create_shm(const char *name, const size_t size, const size_t reserve);
 
 /// Reallocate shared memory
 ///
@@ -87,9 +107,36 @@ void _lock_shm(const char* func, const int line, const char* file);
 #define unlock_shm() _unlock_shm(__FUNCTION__, __LINE__, __FILE__)
 void _unlock_shm(const char* func, const int line, const char* file);
 
+/// Block until a shared (read-only) lock can be obtained. Any number of
+/// readers may hold this lock at the same time, however, not concurrently
+/// with lock_shm(). Shared memory must not be modified while holding it
+#define lock_shm_read() _lock_shm_read(__FUNCTION__, __LINE__, __FILE__)
+void _lock_shm_read(const char* func, const int line, const char* file);
+
+/// Unlock the shared lock obtained by this thread
+#define unlock_shm_read() _unlock_shm_read(__FUNCTION__, __LINE__, __FILE__)
+void _unlock_shm_read(const char* func, const int line, const char* file);
+
+/// Copy the global counters and/or the overTime data (pass NULL to skip
+/// either) without taking the lock. A sequence counter incremented by each
+/// writer when obtaining and again when releasing the lock tells us if the
+/// copy is consistent. If it isn't after a number of attempts (because a
+/// writer holds the lock for long), we fall back to the shared lock
+void snapshot_counters(countersStruct *counters_copy, overTimeData *overTime_copy);
+
+/// Number of readers that can hold the shared lock at the same time
+#define NUM_READER_SLOTS 16
+/// Number of bins of the lock wait histograms (doubling from 1 us on)
+#define LOCK_WAIT_BINS 24
+/// Copy the histograms of the time spent waiting for the shared
+/// (histogram[0]) and exclusive (histogram[1]) lock
+void get_lock_wait_histogram(unsigned long histogram[2][LOCK_WAIT_BINS]);
+
 bool init_shmem(void);
+void log_hugepage_usage(void);
 void destroy_shmem(void);
 size_t addstr(const char *str);
+void compact_strings(void);
 const char *getstr(const size_t pos);
 void *enlarge_shmem_struct(const char type);
 
@@ -113,7 +160,30 @@ void add_per_client_regex(unsigned int clientID);
 void reset_per_client_regex(const int clientID);
 bool get_per_client_regex(const int clientID, const int regexID);
 void set_per_client_regex(const int clientID, const int regexID, const bool value);
+const uint64_t * __attribute__((pure)) get_per_client_regex_bits(const int clientID, const unsigned char regexid);
 
 void memory_check(const enum memory_type which);
 
+// Hash table indices of shared memory objects
+int lookup_hash(const enum memory_type which, const uint32_t hash, hashMatchFunc match, const void *key);
+void insert_hash(const enum memory_type which, const uint32_t hash, const int ID);
+void rebuild_index(const enum memory_type which);
+
+// Index of queries by the ID dnsmasq assigned to them
+int lookup_query_id(const int id);
+void insert_query_id(const int queryID);
+void remove_query_id(const int queryID);
+
+// Posting lists of the queries of each domain and client (ascending IDs)
+typedef struct {
+	int chunk;
+	int pos;
+} postingIterator;
+void add_query_postings(const int queryID);
+void remove_query_postings(const int queryID);
+void rebase_query_postings(const int offset);
+void postings_seek(const postingList *list, postingIterator *it, const int queryID);
+bool postings_next(postingIterator *it, int *queryID);
+bool postings_prev(postingIterator *it, int *queryID);
+
 #endif //SHARED_MEMORY_SERVER_H
@@ -13,8 +13,10 @@
 // Timer enumeration
 enum timers {
 	DATABASE_WRITE_TIMER,
+	DATABASE_LOCK_TIMER,
 	EXIT_TIMER,
 	GC_TIMER,
+	GC_BATCH_TIMER,
 	LISTS_TIMER,
 	REGEX_TIMER,
 	ARP_TIMER,
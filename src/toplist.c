@@ -0,0 +1,262 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2020 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Incrementally maintained top lists
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "toplist.h"
+#include "shmem.h"
+#include "memory.h"
+// data getter functions
+#include "datastructure.h"
+
+// Each top list holds up to TOPLIST_SIZE candidates together with an upper
+// bound for the values of all domains or clients which are not in the list.
+// The values themselves are not stored but read from the domain and client
+// structs when needed. As counters are only incremented while queries are
+// added, it is sufficient to check an entity whenever one of its counters
+// increased: it either replaces the smallest candidate or raises the bound.
+// Counters decreasing (garbage collection) never invalidate the bound but
+// make it less tight, so the lists are rebuilt exactly after each GC run.
+// All candidates with a value not smaller than the bound are guaranteed to
+// be the top entries in this order, only requests going beyond them need to
+// look at all domains or clients.
+
+static int toplist_value(const enum toplist_type type, const int ID)
+{
+	if(type == TOPLIST_DOMAINS || type == TOPLIST_ADS)
+	{
+		const domainsData *domain = getDomain(ID, true);
+		if(domain == NULL)
+			return 0;
+		return type == TOPLIST_ADS ? domain->blockedcount : domain->count - domain->blockedcount;
+	}
+	else
+	{
+		const clientsData *client = getClient(ID, true);
+		if(client == NULL)
+			return 0;
+		return type == TOPLIST_CLIENTS_BLOCKED ? client->blockedcount : client->count;
+	}
+}
+
+// Bitmask of the lists this domain or client is currently a candidate in
+static unsigned char *toplist_flags(const enum toplist_type type, const int ID)
+{
+	if(type == TOPLIST_DOMAINS || type == TOPLIST_ADS)
+	{
+		domainsData *domain = getDomain(ID, true);
+		return domain != NULL ? &domain->in_toplists : NULL;
+	}
+	else
+	{
+		clientsData *client = getClient(ID, true);
+		return client != NULL ? &client->in_toplists : NULL;
+	}
+}
+
+void toplist_update(const enum toplist_type type, const int ID)
+{
+	topList *list = &toplists->lists[type];
+	const unsigned char bit = 1u << type;
+	unsigned char *flags = toplist_flags(type, ID);
+	if(flags == NULL || *flags & bit)
+		return;
+
+	// Add new candidate while there is space left
+	if(list->num < TOPLIST_SIZE)
+	{
+		list->ids[list->num++] = ID;
+		*flags |= bit;
+		return;
+	}
+
+	const int value = toplist_value(type, ID);
+	if(value <= list->bound)
+		return;
+
+	// Find the smallest candidate
+	int min = 0, minvalue = toplist_value(type, list->ids[0]);
+	for(int i = 1; i < list->num; i++)
+	{
+		const int v = toplist_value(type, list->ids[i]);
+		if(v < minvalue)
+		{
+			min = i;
+			minvalue = v;
+		}
+	}
+
+	if(value > minvalue)
+	{
+		// Replace smallest candidate, it is now outside of the list
+		unsigned char *minflags = toplist_flags(type, list->ids[min]);
+		if(minflags != NULL)
+			*minflags &= ~bit;
+		list->ids[min] = ID;
+		*flags |= bit;
+		if(minvalue > list->bound)
+			list->bound = minvalue;
+	}
+	else
+		list->bound = value;
+}
+
+typedef struct {
+	int ID;
+	int value;
+} toplistEntry;
+
+static int __attribute__((pure)) cmpentries(const void *a, const void *b)
+{
+	const toplistEntry *e1 = a, *e2 = b;
+	if(e1->value > e2->value)
+		return -1;
+	else if(e1->value < e2->value)
+		return 1;
+	else
+		return 0;
+}
+
+static int __attribute__((pure)) cmpentries_asc(const void *a, const void *b)
+{
+	return cmpentries(b, a);
+}
+
+// Get the candidates which are known to be the top entries in descending
+// order. complete is set if there are no further domains or clients with a
+// positive value
+int toplist_get(const enum toplist_type type, int ids[TOPLIST_SIZE], bool *complete)
+{
+	const topList *list = &toplists->lists[type];
+	toplistEntry entries[TOPLIST_SIZE];
+	int num = 0;
+	for(int i = 0; i < list->num; i++)
+	{
+		const int value = toplist_value(type, list->ids[i]);
+		if(value < list->bound)
+			continue;
+
+		entries[num].ID = list->ids[i];
+		entries[num].value = value;
+		num++;
+	}
+
+	qsort(entries, num, sizeof(*entries), cmpentries);
+	for(int i = 0; i < num; i++)
+		ids[i] = entries[i].ID;
+
+	*complete = list->bound < 1;
+	return num;
+}
+
+// Get the IDs of all domains or clients sorted by their value. This is the
+// fallback for requests which cannot be served from the top list alone
+int *toplist_sorted(const enum toplist_type type, const bool asc, int *num)
+{
+	*num = (type == TOPLIST_DOMAINS || type == TOPLIST_ADS) ? counters->domains : counters->clients;
+	toplistEntry *entries = calloc(*num > 0 ? *num : 1, sizeof(toplistEntry));
+	int *ids = calloc(*num > 0 ? *num : 1, sizeof(int));
+	if(entries == NULL || ids == NULL)
+	{
+		free(entries);
+		free(ids);
+		return NULL;
+	}
+
+	for(int ID = 0; ID < *num; ID++)
+	{
+		entries[ID].ID = ID;
+		entries[ID].value = toplist_value(type, ID);
+	}
+
+	qsort(entries, *num, sizeof(*entries), asc ? cmpentries_asc : cmpentries);
+	for(int i = 0; i < *num; i++)
+		ids[i] = entries[i].ID;
+
+	free(entries);
+	return ids;
+}
+
+// Restore the min-heap property of the selection heap used below
+static void heap_sift_down(toplistEntry *heap, const int num, int i)
+{
+	while(true)
+	{
+		int min = i;
+		const int left = 2*i + 1, right = 2*i + 2;
+		if(left < num && heap[left].value < heap[min].value)
+			min = left;
+		if(right < num && heap[right].value < heap[min].value)
+			min = right;
+		if(min == i)
+			return;
+
+		const toplistEntry tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void heap_sift_up(toplistEntry *heap, int i)
+{
+	while(i > 0 && heap[(i - 1)/2].value > heap[i].value)
+	{
+		const int parent = (i - 1)/2;
+		const toplistEntry tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+// Recompute a list exactly. The TOPLIST_SIZE + 1 largest values (the extra
+// one is the new bound) are selected in a single pass using a min-heap so
+// that no memory has to be allocated. Has to be called with the lock held
+void toplist_rebuild(const enum toplist_type type)
+{
+	topList *list = &toplists->lists[type];
+	const unsigned char bit = 1u << type;
+	const int total = (type == TOPLIST_DOMAINS || type == TOPLIST_ADS) ? counters->domains : counters->clients;
+
+	toplistEntry heap[TOPLIST_SIZE + 1];
+	int num = 0;
+	for(int ID = 0; ID < total; ID++)
+	{
+		unsigned char *flags = toplist_flags(type, ID);
+		if(flags != NULL)
+			*flags &= ~bit;
+
+		const int value = toplist_value(type, ID);
+		if(num < TOPLIST_SIZE + 1)
+		{
+			heap[num].ID = ID;
+			heap[num].value = value;
+			heap_sift_up(heap, num++);
+		}
+		else if(value > heap[0].value)
+		{
+			heap[0].ID = ID;
+			heap[0].value = value;
+			heap_sift_down(heap, num, 0);
+		}
+	}
+
+	qsort(heap, num, sizeof(*heap), cmpentries);
+
+	list->num = num < TOPLIST_SIZE ? num : TOPLIST_SIZE;
+	for(int i = 0; i < list->num; i++)
+	{
+		list->ids[i] = heap[i].ID;
+		unsigned char *flags = toplist_flags(type, heap[i].ID);
+		if(flags != NULL)
+			*flags |= bit;
+	}
+	list->bound = num > TOPLIST_SIZE ? heap[TOPLIST_SIZE].value : 0;
+}
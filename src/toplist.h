@@ -0,0 +1,43 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2020 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Incrementally maintained top lists prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef TOPLIST_H
+#define TOPLIST_H
+
+#include <stdbool.h>
+
+#define TOPLIST_SIZE 64
+
+enum toplist_type {
+	TOPLIST_DOMAINS, // permitted queries per domain
+	TOPLIST_ADS, // blocked queries per domain
+	TOPLIST_CLIENTS, // queries per client
+	TOPLIST_CLIENTS_BLOCKED, // blocked queries per client
+	TOPLISTS
+};
+
+typedef struct {
+	int ids[TOPLIST_SIZE];
+	int num;
+	// Upper bound of the value of every domain or client not in the list
+	int bound;
+} topList;
+
+typedef struct {
+	topList lists[TOPLISTS];
+} topListsStruct;
+
+extern topListsStruct *toplists;
+
+void toplist_update(const enum toplist_type type, const int ID);
+int toplist_get(const enum toplist_type type, int ids[TOPLIST_SIZE], bool *complete);
+int *toplist_sorted(const enum toplist_type type, const bool asc, int *num);
+void toplist_rebuild(const enum toplist_type type);
+
+#endif //TOPLIST_H
@@ -163,6 +163,8 @@ INSERT INTO domainlist VALUES(4,2,'discourse',1,1559928803,1559928803,'');
 
 INSERT INTO domainlist VALUES(5,1,'blacklist-blocked.test.pi-hole.net',1,1559928803,1559928803,'Migrated from /etc/pihole/blacklist.txt');
 INSERT INTO domainlist VALUES(6,3,'regex[0-9].test.pi-hole.net',1,1559928803,1559928803,'Migrated from /etc/pihole/regex.list');
+INSERT INTO domainlist VALUES(8,3,'(\.|^)Wildcard\.test\.pi-hole\.net$',1,1559928803,1559928803,'Wildcard entry matched by its domain suffix');
+INSERT INTO domainlist VALUES(9,3,'\btelemetry\b',1,1559928803,1559928803,'Not supported by the single-pass matcher, prefiltered by its literal');
 
 INSERT INTO adlist VALUES(1,'https://hosts-file.net/ad_servers.txt',1,1559928803,1559928803,'Migrated from /etc/pihole/adlists.list');
 
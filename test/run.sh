@@ -11,65 +11,95 @@ if ! id -u pihole &> /dev/null; then
   useradd -m -s /usr/sbin/nologin pihole
 fi
 
-# Clean up possible old files from earlier test runs
-rm -f /etc/pihole/gravity.db /etc/pihole/pihole-FTL.db /var/log/pihole.log /var/log/pihole-FTL.log
-
-# Create necessary directories and files
-mkdir -p /etc/pihole /run/pihole /var/log
-touch /var/log/pihole-FTL.log /var/log/pihole.log /run/pihole-FTL.pid /run/pihole-FTL.port
-chown pihole:pihole /etc/pihole /run/pihole /var/log/pihole.log /var/log/pihole-FTL.log /run/pihole-FTL.pid /run/pihole-FTL.port
-
 # Copy binary into a location the new user pihole can access
 cp ./pihole-FTL /home/pihole
 chmod +x /home/pihole/pihole-FTL
 # Note: We cannot add CAP_NET_RAW and CAP_NET_ADMIN at this point
 setcap CAP_NET_BIND_SERVICE+eip /home/pihole/pihole-FTL
 
-# Prepare gravity database
-sqlite3 /etc/pihole/gravity.db < test/gravity.db.sql
-
-# Prepare setupVars.conf
-echo "BLOCKING_ENABLED=true" > /etc/pihole/setupVars.conf
-
-# Prepare pihole-FTL.conf
-echo -e "DEBUG_ALL=true\nRESOLVE_IPV4=no\nRESOLVE_IPV6=no" > /etc/pihole/pihole-FTL.conf
-
-# Prepare dnsmasq.conf
-echo -e "log-queries\nlog-facility=/var/log/pihole.log" > /etc/dnsmasq.conf
-
-# Set restrictive umask
-OLDUMASK=$(umask)
-umask 0022
-
-# Start FTL
-if ! su pihole -s /bin/sh -c /home/pihole/pihole-FTL; then
-  echo "pihole-FTL failed to start"
-  exit 1
-fi
-
 # Prepare BATS
 mkdir -p test/libs
 git clone --depth=1 --quiet https://github.com/bats-core/bats-core test/libs/bats > /dev/null
 
-# Block until FTL is ready, retry once per second for 45 seconds
-sleep 2
-
-# Print versions of pihole-FTL
-echo -n "FTL version: "
-dig TXT CHAOS version.FTL @127.0.0.1 +short
-echo -n "Contained dnsmasq version: "
-dig TXT CHAOS version.bind @127.0.0.1 +short
-
-# Print content of pihole.log and pihole-FTL.log
-cat /var/log/pihole.log
-cat /var/log/pihole-FTL.log
-
-# Run tests
-test/libs/bats/bin/bats "test/test_suite.bats"
-RET=$?
+# Set restrictive umask
+OLDUMASK=$(umask)
+umask 0022
 
-# Kill pihole-FTL after having completed tests
-kill $(pidof pihole-FTL)
+# Run the test suite against a freshly started FTL. The argument selects how
+# gravity and the exact lists are checked:
+#   database: SQLite queries (default settings)
+#   memory:   in-memory index (GRAVITY_IN_MEMORY=true)
+#   image:    image compiled by "pihole-FTL gravity-compile" (default settings)
+run_tests() {
+  export GRAVITY_MODE="$1"
+  echo "Running tests (gravity mode: ${GRAVITY_MODE})"
+
+  # Clean up possible old files from earlier test runs
+  rm -f /etc/pihole/gravity.db /etc/pihole/pihole-FTL.db /var/log/pihole.log /var/log/pihole-FTL.log
+
+  # Create necessary directories and files
+  mkdir -p /etc/pihole /run/pihole /var/log
+  touch /var/log/pihole-FTL.log /var/log/pihole.log /run/pihole-FTL.pid /run/pihole-FTL.port
+  chown pihole:pihole /etc/pihole /run/pihole /var/log/pihole.log /var/log/pihole-FTL.log /run/pihole-FTL.pid /run/pihole-FTL.port
+
+  # Prepare gravity database
+  sqlite3 /etc/pihole/gravity.db < test/gravity.db.sql
+
+  # Prepare setupVars.conf
+  echo "BLOCKING_ENABLED=true" > /etc/pihole/setupVars.conf
+
+  # Prepare pihole-FTL.conf
+  echo -e "DEBUG_ALL=true\nRESOLVE_IPV4=no\nRESOLVE_IPV6=no" > /etc/pihole/pihole-FTL.conf
+  if [[ "${GRAVITY_MODE}" == "memory" ]]; then
+    echo "GRAVITY_IN_MEMORY=true" >> /etc/pihole/pihole-FTL.conf
+  fi
+
+  # Prepare dnsmasq.conf
+  echo -e "log-queries\nlog-facility=/var/log/pihole.log" > /etc/dnsmasq.conf
+
+  # Compile gravity database into the image mapped by FTL on startup
+  rm -f /etc/pihole/gravity.img
+  if [[ "${GRAVITY_MODE}" == "image" ]]; then
+    if ! su pihole -s /bin/sh -c "/home/pihole/pihole-FTL gravity-compile"; then
+      echo "pihole-FTL gravity-compile failed"
+      return 1
+    fi
+  fi
+
+  # Start FTL
+  if ! su pihole -s /bin/sh -c /home/pihole/pihole-FTL; then
+    echo "pihole-FTL failed to start"
+    return 1
+  fi
+
+  # Block until FTL is ready, retry once per second for 45 seconds
+  sleep 2
+
+  # Print versions of pihole-FTL
+  echo -n "FTL version: "
+  dig TXT CHAOS version.FTL @127.0.0.1 +short
+  echo -n "Contained dnsmasq version: "
+  dig TXT CHAOS version.bind @127.0.0.1 +short
+
+  # Print content of pihole.log and pihole-FTL.log
+  cat /var/log/pihole.log
+  cat /var/log/pihole-FTL.log
+
+  # Run tests
+  test/libs/bats/bin/bats "test/test_suite.bats"
+  local ret=$?
+
+  # Kill pihole-FTL after having completed tests and wait until it is gone
+  kill $(pidof pihole-FTL)
+  while pidof pihole-FTL > /dev/null; do sleep 0.1; done
+
+  return $ret
+}
+
+RET=0
+for mode in database memory image; do
+  run_tests "${mode}" || RET=1
+done
 
 # Restore umask
 umask $OLDUMASK
@@ -24,9 +24,39 @@
 }
 
 @test "Number of compiled regex filters as expected" {
-  run bash -c 'grep -c "Compiled 2 whitelist and 1 blacklist regex filters" /var/log/pihole-FTL.log'
+  run bash -c 'grep -c "Compiled 2 whitelist and 3 blacklist regex filters" /var/log/pihole-FTL.log'
   printf "%s\n" "${lines[@]}"
   [[ ${lines[0]} == "1" ]]
+  run bash -c 'grep -c "of which 0 whitelist and 1 blacklist filters are domain wildcards" /var/log/pihole-FTL.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "1" ]]
+  # The remaining blacklist filter (\btelemetry\b) is matched by regexec()
+  run bash -c 'grep -c "of which 2 whitelist and 1 blacklist filters are matched in a single pass" /var/log/pihole-FTL.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "1" ]]
+}
+
+# test/run.sh runs this suite once per way of checking gravity and the exact
+# lists (GRAVITY_MODE). All blocking tests below have to pass in every mode
+
+@test "In-memory gravity index is used (GRAVITY_IN_MEMORY)" {
+  [[ "${GRAVITY_MODE}" == "memory" ]] || skip "gravity mode is ${GRAVITY_MODE:-database}"
+  run bash -c 'grep -c "Compiled gravity index (" /var/log/pihole-FTL.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} != "0" ]]
+  run bash -c 'grep -c "using the database instead" /var/log/pihole-FTL.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0" ]]
+}
+
+@test "Compiled gravity image is mapped (gravity-compile)" {
+  [[ "${GRAVITY_MODE}" == "image" ]] || skip "gravity mode is ${GRAVITY_MODE:-database}"
+  run bash -c 'grep -c "Stored gravity image in /etc/pihole/gravity.img" /var/log/pihole-FTL.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "1" ]]
+  run bash -c 'grep "Mapped gravity image /etc/pihole/gravity.img" /var/log/pihole-FTL.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == *"(3 gravity, "* ]]
 }
 
 @test "Blacklisted domain is blocked" {
@@ -330,6 +360,21 @@
   [[ ${lines[3]} == "" ]]
 }
 
+@test "Get all queries (cursor paginated)" {
+  run bash -c 'echo ">getallqueries-cursor 0 2 client=127.0.0.1 >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == *"A ftl.pi-hole.net "?*" 2 0 4"* ]]
+  [[ ${lines[2]} == *"AAAA google.com "?*" 2 0 4"* ]]
+  [[ ${lines[3]} == "cursor 20" ]]
+  [[ ${lines[4]} == "" ]]
+  run bash -c 'echo ">getallqueries-cursor 20 2 client=127.0.0.1 >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == *"A google.com "?*" 2 0 4"* ]]
+  [[ ${lines[2]} == *"A regex1.test.pi-hole.net 127.0.0.1 3 0 4"* ]]
+  [[ ${lines[3]} == "cursor 13" ]]
+  [[ ${lines[4]} == "" ]]
+}
+
 @test "Recent blocked" {
   run bash -c 'echo ">recentBlocked >quit" | nc -v 127.0.0.1 4711'
   printf "%s\n" "${lines[@]}"
@@ -337,6 +382,14 @@
   [[ ${lines[2]} == "" ]]
 }
 
+@test "Lock wait histogram" {
+  run bash -c 'echo ">lockstats >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "1 "* ]]
+  [[ ${lines[24]} == "inf "* ]]
+  [[ ${lines[25]} == "" ]]
+}
+
 @test "pihole-FTL.db schema as expected" {
   run bash -c 'sqlite3 /etc/pihole/pihole-FTL.db .dump'
   printf "%s\n" "${lines[@]}"
@@ -456,3 +509,64 @@
   printf "%s\n" "${lines[@]}"
   [[ ${lines[0]} == "2" ]]
 }
+
+# The domains below are queried after all statistics have been checked so
+# they do not change the expected counts
+
+@test "Wildcard regex blacklist match is blocked" {
+  run bash -c "dig wildcard.test.pi-hole.net @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0.0.0.0" ]]
+}
+
+@test "Wildcard regex blacklist match of subdomain is blocked" {
+  run bash -c "dig sub.wildcard.test.pi-hole.net @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0.0.0.0" ]]
+}
+
+@test "Wildcard regex blacklist mismatch is not blocked" {
+  run bash -c "dig xwildcard.test.pi-hole.net @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} != "0.0.0.0" ]]
+}
+
+@test "Client 3: Unassociated wildcard regex blacklist match is not blocked" {
+  run bash -c "dig wildcard.test.pi-hole.net -b 127.0.0.3 @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} != "0.0.0.0" ]]
+}
+
+@test "Prefiltered regex blacklist match is blocked" {
+  run bash -c "dig telemetry.test.pi-hole.net @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0.0.0.0" ]]
+}
+
+@test "Prefiltered regex blacklist mismatch containing the literal is not blocked" {
+  run bash -c "dig notelemetry.test.pi-hole.net @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} != "0.0.0.0" ]]
+}
+
+# Has to be the last test as it modifies the gravity database and causes a
+# warning to be logged
+@test "Outdated gravity image is ignored (gravity-compile)" {
+  [[ "${GRAVITY_MODE}" == "image" ]] || skip "gravity mode is ${GRAVITY_MODE:-database}"
+  touch /etc/pihole/gravity.db
+  kill -s RTMIN $(pidof pihole-FTL)
+  sleep 2
+  run bash -c 'grep -c "Ignoring outdated gravity image /etc/pihole/gravity.img" /var/log/pihole-FTL.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "1" ]]
+  # Lists are checked using the database again
+  run bash -c "dig gravity-blocked.test.pi-hole.net @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0.0.0.0" ]]
+  run bash -c "dig blacklist-blocked.test.pi-hole.net @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0.0.0.0" ]]
+  run bash -c "dig whitelisted.test.pi-hole.net @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} != "0.0.0.0" ]]
+}
@@ -0,0 +1,110 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2020 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Benchmark of the per-client blocking cache lookup
+*
+*  Compile with
+*    gcc -O2 -I src tools/hashtable_benchmark.c src/hashtable.c -o hashtable_benchmark
+*
+*  The program fills a (domainID, clientID) table the same way findCacheID()
+*  does and measures the average cost of a lookup at increasing table sizes.
+*  The cost of the former linear scan is shown for comparison as long as it
+*  finishes in reasonable time.
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "hashtable.h"
+
+#define MAX_ENTRIES (4*1024*1024)
+#define NUM_CLIENTS 50
+#define LOOKUPS 1000000
+#define LINEAR_LOOKUPS 1000
+#define LINEAR_MAX_ENTRIES 100000
+
+typedef struct {
+	int domainID;
+	int clientID;
+} cacheEntry;
+
+static cacheEntry *cache = NULL;
+
+static bool matches(const int cacheID, const void *key)
+{
+	const int *pair = key;
+	return cache[cacheID].domainID == pair[0] && cache[cacheID].clientID == pair[1];
+}
+
+static int linear(const int domainID, const int clientID, const int num)
+{
+	for(int i = 0; i < num; i++)
+		if(cache[i].domainID == domainID && cache[i].clientID == clientID)
+			return i;
+	return -1;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+int main(void)
+{
+	cache = calloc(MAX_ENTRIES, sizeof(cacheEntry));
+	const size_t size = hashtable_size(MAX_ENTRIES);
+	hashSlot *table = calloc(size, sizeof(hashSlot));
+	if(cache == NULL || table == NULL)
+	{
+		fprintf(stderr, "Memory allocation failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%10s %18s %18s\n", "entries", "hashed [ns/query]", "linear [ns/query]");
+	int num = 0;
+	volatile int sink = 0;
+	for(int target = 1000; target <= MAX_ENTRIES; target *= 4)
+	{
+		// Fill cache up to the target size
+		for(; num < target; num++)
+		{
+			cache[num].domainID = num / NUM_CLIENTS;
+			cache[num].clientID = num % NUM_CLIENTS;
+			hashtable_insert(table, size, hashPair(cache[num].domainID, cache[num].clientID), num);
+		}
+
+		// Measure random lookups of existing pairs
+		srand(target);
+		double start = now_ns();
+		for(int i = 0; i < LOOKUPS; i++)
+		{
+			const int id = rand() % num;
+			const int pair[2] = { cache[id].domainID, cache[id].clientID };
+			sink += hashtable_find(table, size, hashPair(pair[0], pair[1]), matches, pair);
+		}
+		const double hashed = (now_ns() - start) / LOOKUPS;
+
+		if(num <= LINEAR_MAX_ENTRIES)
+		{
+			start = now_ns();
+			for(int i = 0; i < LINEAR_LOOKUPS; i++)
+			{
+				const int id = rand() % num;
+				sink += linear(cache[id].domainID, cache[id].clientID, num);
+			}
+			const double lin = (now_ns() - start) / LINEAR_LOOKUPS;
+			printf("%10d %18.1f %18.1f\n", num, hashed, lin);
+		}
+		else
+			printf("%10d %18.1f %18s\n", num, hashed, "-");
+	}
+
+	free(table);
+	free(cache);
+	return sink == 42 ? EXIT_FAILURE : EXIT_SUCCESS;
+}